@@ -0,0 +1,72 @@
+#define GLRT_API_EXPORT
+#include "alias_table.h"
+
+#include <algorithm>
+
+namespace glrt {
+
+AliasTable::AliasTable() {}
+
+AliasTable::AliasTable(const std::vector<double> &weights) {
+    construct(weights);
+}
+
+AliasTable::~AliasTable() {}
+
+void AliasTable::construct(const std::vector<double> &weights) {
+    const int n = (int)weights.size();
+    entries.assign(n, AliasEntry());
+    if (n == 0) {
+        total = 0.0;
+        return;
+    }
+
+    total = 0.0;
+    for (double w : weights) {
+        total += std::max(0.0, w);
+    }
+
+    // Normalized probabilities (fallback to uniform for degenerate weights)
+    std::vector<double> pmf(n);
+    for (int i = 0; i < n; i++) {
+        pmf[i] = total > 0.0 ? std::max(0.0, weights[i]) / total : 1.0 / n;
+    }
+
+    // Split into the columns lighter and heavier than the average
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; i++) {
+        scaled[i] = pmf[i] * n;
+        if (scaled[i] < 1.0) {
+            small.push_back(i);
+        } else {
+            large.push_back(i);
+        }
+    }
+
+    while (!small.empty() && !large.empty()) {
+        const int s = small.back();
+        small.pop_back();
+        const int l = large.back();
+        large.pop_back();
+
+        entries[s].values = glm::vec4((float)scaled[s], (float)l, (float)pmf[s], 0.0f);
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if (scaled[l] < 1.0) {
+            small.push_back(l);
+        } else {
+            large.push_back(l);
+        }
+    }
+
+    // Remaining columns are full up to round-off errors
+    for (int i : large) {
+        entries[i].values = glm::vec4(1.0f, (float)i, (float)pmf[i], 0.0f);
+    }
+
+    for (int i : small) {
+        entries[i].values = glm::vec4(1.0f, (float)i, (float)pmf[i], 0.0f);
+    }
+}
+
+}  // namespace glrt
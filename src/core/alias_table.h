@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+#include "api.h"
+#include "common.h"
+
+namespace glrt {
+
+struct AliasEntry {
+    glm::vec4 values;  // threshold, alias, pmf, unused
+};
+
+//! Alias table for O(1) sampling from a discrete distribution (Vose's method)
+struct GLRT_API AliasTable {
+    AliasTable();
+    explicit AliasTable(const std::vector<double> &weights);
+    virtual ~AliasTable();
+
+    void construct(const std::vector<double> &weights);
+
+    std::vector<AliasEntry> entries;
+    double total = 0.0;
+};
+
+}  // namespace glrt
@@ -0,0 +1,118 @@
+#define GLRT_API_EXPORT
+#include "envmap.h"
+
+#include <vector>
+
+#include <stb_image.h>
+
+namespace glrt {
+
+Envmap::Envmap() {}
+
+Envmap::Envmap(const std::string &filename, float scale) { load(filename, scale); }
+
+Envmap::~Envmap() { release(); }
+
+void Envmap::load(const std::string &filename, float scale) {
+    release();
+
+    int channels;
+    float *pixels = stbi_loadf(filename.c_str(), &width_, &height_, &channels, 3);
+    if (!pixels) {
+        FatalError("Failed to load environment map: %s", filename.c_str());
+    }
+
+    const int W = width_;
+    const int H = height_;
+    std::vector<float> radiance(pixels, pixels + W * H * 3);
+    stbi_image_free(pixels);
+    for (auto &v : radiance) {
+        v *= scale;
+    }
+
+    // Luminance weighted by the solid angle of each row
+    std::vector<double> func(W * H);
+    for (int j = 0; j < H; j++) {
+        const double sinTheta = std::sin(Pi * (j + 0.5) / H);
+        for (int i = 0; i < W; i++) {
+            const float *rgb = &radiance[(j * W + i) * 3];
+            const double luminance = 0.2126 * rgb[0] + 0.7152 * rgb[1] + 0.0722 * rgb[2];
+            func[j * W + i] = std::max(0.0, luminance) * sinTheta;
+        }
+    }
+
+    // Conditional distributions of each row and the marginal distribution
+    std::vector<float> distrib((W + 1) * H * 2, 0.0f);
+    std::vector<double> rowSums(H, 0.0);
+    double total = 0.0;
+    for (int j = 0; j < H; j++) {
+        for (int i = 0; i < W; i++) {
+            rowSums[j] += func[j * W + i];
+        }
+        total += rowSums[j];
+    }
+
+    if (total <= 0.0) {
+        // Black map, fallback to uniform sampling
+        std::fill(func.begin(), func.end(), 1.0);
+        std::fill(rowSums.begin(), rowSums.end(), (double)W);
+        total = (double)W * H;
+    }
+
+    double marginalCdf = 0.0;
+    for (int j = 0; j < H; j++) {
+        double cdf = 0.0;
+        for (int i = 0; i < W; i++) {
+            cdf += func[j * W + i];
+            const int k = j * (W + 1) + i;
+            distrib[k * 2 + 0] = rowSums[j] > 0.0 ? (float)(cdf / rowSums[j]) : (float)(i + 1) / W;
+            distrib[k * 2 + 1] = (float)(func[j * W + i] * W * H / total);
+        }
+
+        marginalCdf += rowSums[j];
+        const int k = j * (W + 1) + W;
+        distrib[k * 2 + 0] = (float)(marginalCdf / total);
+        distrib[k * 2 + 1] = (float)(rowSums[j] * H / total);
+    }
+
+    // Transfer to OpenGL (the first row is the top of the map)
+    glGenTextures(1, &radianceTexId);
+    glBindTexture(GL_TEXTURE_2D, radianceTexId);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, W, H, 0, GL_RGB, GL_FLOAT, radiance.data());
+
+    glGenTextures(1, &distribTexId);
+    glBindTexture(GL_TEXTURE_2D, distribTexId);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, W + 1, H, 0, GL_RG, GL_FLOAT, distrib.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    Info("Environment map: %s (%dx%d)", filename.c_str(), W, H);
+}
+
+void Envmap::bind(GLuint radianceUnit, GLuint distribUnit) const {
+    glActiveTexture(GL_TEXTURE0 + radianceUnit);
+    glBindTexture(GL_TEXTURE_2D, radianceTexId);
+    glActiveTexture(GL_TEXTURE0 + distribUnit);
+    glBindTexture(GL_TEXTURE_2D, distribTexId);
+}
+
+void Envmap::release() {
+    if (radianceTexId != 0) {
+        glDeleteTextures(1, &radianceTexId);
+        radianceTexId = 0;
+    }
+
+    if (distribTexId != 0) {
+        glDeleteTextures(1, &distribTexId);
+        distribTexId = 0;
+    }
+}
+
+}  // namespace glrt
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+
+#include "api.h"
+#include "common.h"
+#include "uncopyable.h"
+
+namespace glrt {
+
+//! Equirectangular HDR environment map with a piecewise-constant sampling distribution.
+//! The distribution texture has (width + 1) x height texels: for the texel (i, j) with i < width,
+//! R is the conditional CDF (inclusive) in row "j" and G is the joint PDF over the unit square.
+//! The last column stores the marginal CDF (inclusive) and the marginal PDF of row "j".
+class GLRT_API Envmap : private Uncopyable {
+public:
+    Envmap();
+    explicit Envmap(const std::string &filename, float scale = 1.0f);
+    virtual ~Envmap();
+
+    void load(const std::string &filename, float scale = 1.0f);
+
+    void bind(GLuint radianceUnit, GLuint distribUnit) const;
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+private:
+    void release();
+
+    int width_ = 0, height_ = 0;
+    GLuint radianceTexId = 0;
+    GLuint distribTexId = 0;
+};
+
+}  // namespace glrt
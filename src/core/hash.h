@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+namespace glrt {
+
+//! 64-bit FNV-1a hash of a byte sequence
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ULL) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+inline uint64_t hashString(const std::string &str, uint64_t h = 0xcbf29ce484222325ULL) {
+    return hashBytes(str.data(), str.size(), h);
+}
+
+//! Mix a new hash value into a seed (boost::hash_combine extended to 64 bits)
+inline uint64_t hashCombine(uint64_t seed, uint64_t h) {
+    return seed ^ (h + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+//! Hexadecimal representation used to name cache files
+inline std::string hashToString(uint64_t h) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+    return std::string(buf);
+}
+
+}  // namespace glrt
@@ -0,0 +1,248 @@
+#define GLRT_API_EXPORT
+#include "light_bvh.h"
+
+#include <algorithm>
+
+namespace glrt {
+
+namespace {
+
+glm::vec3 rotate(const glm::vec3 &v, const glm::vec3 &axis, float theta) {
+    // Rodrigues' rotation formula
+    const float c = std::cos(theta);
+    const float s = std::sin(theta);
+    return v * c + glm::cross(axis, v) * s + axis * glm::dot(axis, v) * (1.0f - c);
+}
+
+float safeAcos(float x) {
+    return std::acos(std::max(-1.0f, std::min(x, 1.0f)));
+}
+
+}  // anonymous namespace
+
+// ---------------------------------------------------------------------------------------------------------------------
+// LightCone
+// ---------------------------------------------------------------------------------------------------------------------
+
+LightCone LightCone::merge(const LightCone &c0, const LightCone &c1) {
+    if (c0.empty) return c1;
+    if (c1.empty) return c0;
+
+    LightCone cone;
+    cone.empty = false;
+    cone.cosThetaE = std::min(c0.cosThetaE, c1.cosThetaE);
+
+    // Cone which bounds both the normal cones
+    const float theta0 = safeAcos(c0.cosThetaO);
+    const float theta1 = safeAcos(c1.cosThetaO);
+    const float thetaD = safeAcos(glm::dot(c0.axis, c1.axis));
+    if (std::min(thetaD + theta1, (float)Pi) <= theta0) {
+        cone.axis = c0.axis;
+        cone.cosThetaO = c0.cosThetaO;
+        return cone;
+    }
+
+    if (std::min(thetaD + theta0, (float)Pi) <= theta1) {
+        cone.axis = c1.axis;
+        cone.cosThetaO = c1.cosThetaO;
+        return cone;
+    }
+
+    const float thetaO = 0.5f * (theta0 + thetaD + theta1);
+    const glm::vec3 wr = glm::cross(c0.axis, c1.axis);
+    if (thetaO >= Pi || glm::length(wr) == 0.0f) {
+        cone.axis = c0.axis;
+        cone.cosThetaO = -1.0f;
+        return cone;
+    }
+
+    cone.axis = glm::normalize(rotate(c0.axis, glm::normalize(wr), thetaO - theta0));
+    cone.cosThetaO = std::cos(thetaO);
+    return cone;
+}
+
+float LightCone::measure() const {
+    const float thetaO = safeAcos(cosThetaO);
+    const float thetaE = safeAcos(cosThetaE);
+    const float thetaW = std::min(thetaO + thetaE, (float)Pi);
+    const float sinThetaO = std::sin(thetaO);
+    return 2.0f * Pi * (1.0f - cosThetaO) +
+           0.5f * Pi * (2.0f * thetaW * sinThetaO - std::cos(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinThetaO +
+                        cosThetaO);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// LightBVH
+// ---------------------------------------------------------------------------------------------------------------------
+
+LightBVH::LightBVH() {}
+
+LightBVH::~LightBVH() {}
+
+void LightBVH::construct(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                         const std::vector<double> &powers) {
+    nodes.clear();
+    leaves.clear();
+
+    const int nLights = (int)indices.size() / 3;
+    std::vector<LightInfo> prims;
+    for (int i = 0; i < nLights; i++) {
+        const Vertex &v0 = vertices[indices[i * 3 + 0]];
+        const Vertex &v1 = vertices[indices[i * 3 + 1]];
+        const Vertex &v2 = vertices[indices[i * 3 + 2]];
+
+        LightInfo info;
+        info.index = i;
+        info.power = powers[i];
+        info.bounds.merge(v0.pos);
+        info.bounds.merge(v1.pos);
+        info.bounds.merge(v2.pos);
+        info.centroid = (v0.pos + v1.pos + v2.pos) / 3.0f;
+
+        // Emission is one-sided about the interpolated shading normal, so the cone
+        // around the face normal must also contain all the vertex normals.
+        glm::vec3 axis = glm::cross(v1.pos - v0.pos, v2.pos - v0.pos);
+        const glm::vec3 nsum = v0.normal + v1.normal + v2.normal;
+        if (glm::length(axis) == 0.0f) {
+            axis = glm::length(nsum) > 0.0f ? nsum : glm::vec3(0.0f, 0.0f, 1.0f);
+        }
+        axis = glm::normalize(axis);
+        if (glm::dot(axis, nsum) < 0.0f) {
+            axis = -axis;
+        }
+
+        float cosThetaO = 1.0f;
+        cosThetaO = std::min(cosThetaO, glm::dot(axis, v0.normal));
+        cosThetaO = std::min(cosThetaO, glm::dot(axis, v1.normal));
+        cosThetaO = std::min(cosThetaO, glm::dot(axis, v2.normal));
+        info.cone = LightCone(axis, std::max(cosThetaO, -1.0f), 0.0f);
+        info.cone.empty = false;
+
+        prims.push_back(info);
+    }
+
+    if (nLights == 0) {
+        return;
+    }
+
+    leaves.assign(nLights, 0.0f);
+    constructRec(prims, 0, nLights, -1, 0);
+}
+
+int LightBVH::constructRec(std::vector<LightInfo> &prims, int left, int right, int parent, int depth) {
+    const int nodeId = static_cast<int>(nodes.size());
+    nodes.push_back(LightBVHNode());
+
+    Bounds bounds, centroidBounds;
+    LightCone cone;
+    double power = 0.0;
+    for (int i = left; i < right; i++) {
+        bounds = Bounds::merge(bounds, prims[i].bounds);
+        centroidBounds.merge(prims[i].centroid);
+        cone = LightCone::merge(cone, prims[i].cone);
+        power += prims[i].power;
+    }
+
+    LightBVHNode &node = nodes[nodeId];
+    node.bboxMin = glm::vec4(bounds.posMin, (float)power);
+    node.bboxMax = glm::vec4(bounds.posMax, cone.cosThetaO);
+    node.axis = glm::vec4(cone.axis, cone.cosThetaE);
+    node.links = glm::vec4(0.0f, (float)parent, 0.0f, 0.0f);
+
+    const int nprims = right - left;
+    if (nprims == 1) {
+        // Leaf node
+        nodes[nodeId].links.x = -(float)(prims[left].index + 1);
+        leaves[prims[left].index] = (float)nodeId;
+        return nodeId;
+    }
+
+    // Split with SAOH (surface area orientation heuristic)
+    const int nBuckets = 12;
+    const glm::vec3 extent = bounds.posMax - bounds.posMin;
+    const float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+    const double parentCost = std::max(1.0e-12, power * cone.measure() * bounds.area());
+
+    double minCost = 1.0e30;
+    int minAxis = -1, minSplit = -1;
+    for (int axis = 0; axis < 3 && depth < maxSAOHDepth; axis++) {
+        const float cmin = centroidBounds.posMin[axis];
+        const float cmax = centroidBounds.posMax[axis];
+        if (cmax <= cmin) {
+            continue;
+        }
+
+        Bounds bucketBounds[nBuckets];
+        LightCone bucketCones[nBuckets];
+        double bucketPowers[nBuckets] = { 0.0 };
+        int bucketCounts[nBuckets] = { 0 };
+        for (int i = left; i < right; i++) {
+            int b = (int)(nBuckets * (prims[i].centroid[axis] - cmin) / (cmax - cmin));
+            b = std::max(0, std::min(b, nBuckets - 1));
+            bucketBounds[b] = Bounds::merge(bucketBounds[b], prims[i].bounds);
+            bucketCones[b] = LightCone::merge(bucketCones[b], prims[i].cone);
+            bucketPowers[b] += prims[i].power;
+            bucketCounts[b] += 1;
+        }
+
+        // Thin axes are penalized to avoid long and thin nodes
+        const double kr = extent[axis] > 0.0f ? maxExtent / extent[axis] : 1.0;
+        for (int s = 0; s < nBuckets - 1; s++) {
+            Bounds b0, b1;
+            LightCone c0, c1;
+            double p0 = 0.0, p1 = 0.0;
+            int n0 = 0, n1 = 0;
+            for (int j = 0; j <= s; j++) {
+                b0 = Bounds::merge(b0, bucketBounds[j]);
+                c0 = LightCone::merge(c0, bucketCones[j]);
+                p0 += bucketPowers[j];
+                n0 += bucketCounts[j];
+            }
+            for (int j = s + 1; j < nBuckets; j++) {
+                b1 = Bounds::merge(b1, bucketBounds[j]);
+                c1 = LightCone::merge(c1, bucketCones[j]);
+                p1 += bucketPowers[j];
+                n1 += bucketCounts[j];
+            }
+
+            if (n0 == 0 || n1 == 0) {
+                continue;
+            }
+
+            const double cost = kr * (p0 * c0.measure() * b0.area() + p1 * c1.measure() * b1.area()) / parentCost;
+            if (cost < minCost) {
+                minCost = cost;
+                minAxis = axis;
+                minSplit = s;
+            }
+        }
+    }
+
+    int mid = (left + right) / 2;
+    if (minAxis >= 0) {
+        const float cmin = centroidBounds.posMin[minAxis];
+        const float cmax = centroidBounds.posMax[minAxis];
+        auto it = std::partition(prims.begin() + left, prims.begin() + right, [&](const LightInfo &info) {
+            int b = (int)(nBuckets * (info.centroid[minAxis] - cmin) / (cmax - cmin));
+            b = std::max(0, std::min(b, nBuckets - 1));
+            return b <= minSplit;
+        });
+        mid = (int)(it - prims.begin());
+    }
+
+    if (minAxis < 0 || mid == left || mid == right) {
+        // Degenerated (e.g., all the centroids coincide) or too deep, then split by count
+        mid = (left + right) / 2;
+        const int axis = centroidBounds.maxExtent();
+        std::nth_element(prims.begin() + left, prims.begin() + mid, prims.begin() + right,
+                         [&](const LightInfo &a, const LightInfo &b) { return a.centroid[axis] < b.centroid[axis]; });
+    }
+
+    constructRec(prims, left, mid, nodeId, depth + 1);
+    const int rightChild = constructRec(prims, mid, right, nodeId, depth + 1);
+    nodes[nodeId].links.x = (float)rightChild;
+
+    return nodeId;
+}
+
+}  // namespace glrt
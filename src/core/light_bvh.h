@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+
+#include "api.h"
+#include "common.h"
+#include "trimesh.h"
+#include "bvh.h"
+
+namespace glrt {
+
+//! Bounding cone of emission directions (see "Importance Sampling of Many Lights
+//! with Adaptive Tree Splitting" by A. Conty Estevez and C. Kulla, 2018)
+struct LightCone {
+    LightCone() {}
+    LightCone(const glm::vec3 &axis, float cosThetaO, float cosThetaE)
+        : axis(axis)
+        , cosThetaO(cosThetaO)
+        , cosThetaE(cosThetaE) {
+    }
+
+    static LightCone merge(const LightCone &c0, const LightCone &c1);
+
+    //! Solid angle measure which is used for the SAOH cost
+    float measure() const;
+
+    glm::vec3 axis = glm::vec3(0.0f, 0.0f, 1.0f);
+    float cosThetaO = 1.0f;
+    float cosThetaE = 0.0f;
+    bool empty = true;
+};
+
+struct LightBVHNode {
+    glm::vec4 bboxMin;  // xyz: bounding box min, w: power
+    glm::vec4 bboxMax;  // xyz: bounding box max, w: cosine of normal bound angle
+    glm::vec4 axis;     // xyz: normal cone axis, w: cosine of emission bound angle
+    glm::vec4 links;    // x: right child (left child is next) or -(light + 1) for a leaf, y: parent
+};
+
+struct GLRT_API LightBVH {
+    LightBVH();
+    virtual ~LightBVH();
+
+    void construct(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                   const std::vector<double> &powers);
+
+    std::vector<LightBVHNode> nodes;
+    std::vector<float> leaves;  // leaf node of each light
+
+    //! Depth limit of the traversal in the shader. Nodes below "maxSAOHDepth" are split by count, which
+    //! takes at most 31 more levels for any number of lights.
+    static const int maxDepth = 64;
+    static const int maxSAOHDepth = 32;
+
+private:
+    struct LightInfo {
+        int index;
+        Bounds bounds;
+        glm::vec3 centroid;
+        LightCone cone;
+        double power;
+    };
+
+    int constructRec(std::vector<LightInfo> &prims, int left, int right, int parent, int depth);
+};
+
+}  // namespace glrt
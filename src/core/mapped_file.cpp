@@ -0,0 +1,104 @@
+#define GLRT_API_EXPORT
+#include "mapped_file.h"
+
+#include <stdexcept>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace glrt {
+
+MappedFile::MappedFile() {}
+
+MappedFile::MappedFile(const std::string &filename) { open(filename); }
+
+MappedFile::~MappedFile() { close(); }
+
+void MappedFile::open(const std::string &filename) {
+    close();
+
+#if defined(_WIN32)
+    file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) {
+        file_ = nullptr;
+        throw std::runtime_error("Failed to open file: " + filename);
+    }
+
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file_, &fileSize);
+    size_ = (size_t)fileSize.QuadPart;
+    if (size_ == 0) {
+        return;
+    }
+
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (!mapping_) {
+        close();
+        throw std::runtime_error("Failed to map file: " + filename);
+    }
+
+    data_ = (char *)MapViewOfFile(mapping_, FILE_MAP_COPY, 0, 0, 0);
+    if (!data_) {
+        close();
+        throw std::runtime_error("Failed to map file: " + filename);
+    }
+#else
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open file: " + filename);
+    }
+
+    struct stat st;
+    fstat(fd_, &st);
+    size_ = (size_t)st.st_size;
+    if (size_ == 0) {
+        return;
+    }
+
+    void *ptr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd_, 0);
+    if (ptr == MAP_FAILED) {
+        close();
+        throw std::runtime_error("Failed to map file: " + filename);
+    }
+    data_ = (char *)ptr;
+
+    // Payloads are usually read from the head to the tail
+    madvise(data_, size_, MADV_SEQUENTIAL);
+#endif
+}
+
+void MappedFile::close() {
+#if defined(_WIN32)
+    if (data_) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_) {
+        CloseHandle(mapping_);
+    }
+    if (file_) {
+        CloseHandle(file_);
+    }
+    mapping_ = nullptr;
+    file_ = nullptr;
+#else
+    if (data_) {
+        munmap(data_, size_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    fd_ = -1;
+#endif
+    data_ = nullptr;
+    size_ = 0;
+}
+
+}  // namespace glrt
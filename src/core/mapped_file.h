@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+
+#include "api.h"
+#include "uncopyable.h"
+
+namespace glrt {
+
+//! Read-only view of a whole file mapped into memory. Pages are private (copy-on-write),
+//! so the mapped contents can be modified without writing them back to the file.
+class GLRT_API MappedFile : private Uncopyable {
+public:
+    MappedFile();
+    explicit MappedFile(const std::string &filename);
+    virtual ~MappedFile();
+
+    void open(const std::string &filename);
+    void close();
+
+    char *data() { return data_; }
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    char *data_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    void *file_ = nullptr;
+    void *mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+}  // namespace glrt
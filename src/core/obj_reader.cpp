@@ -0,0 +1,369 @@
+#define GLRT_API_EXPORT
+#include "obj_reader.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "common.h"
+#include "mapped_file.h"
+
+namespace glrt {
+
+namespace {
+
+// Face corner whose attribute indices are not resolved yet
+struct Corner {
+    int v = 0;
+    int vt = 0;
+    int vn = 0;
+    uint8_t flags = 0;
+};
+
+enum CornerFlags : uint8_t {
+    RelativeV = 0x01,  // Counted from the head of the chunk (negative indices in the file)
+    RelativeVT = 0x02,
+    RelativeVN = 0x04,
+    MissingVT = 0x08,
+    MissingVN = 0x10
+};
+
+// Attributes and triangulated faces of a line-aligned chunk
+struct Chunk {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> texcoords;
+    std::vector<Corner> corners;  // Three for each triangle
+};
+
+const double powersOf10[] = { 1.0e0,  1.0e1,  1.0e2,  1.0e3,  1.0e4,  1.0e5,  1.0e6,  1.0e7,
+                              1.0e8,  1.0e9,  1.0e10, 1.0e11, 1.0e12, 1.0e13, 1.0e14, 1.0e15,
+                              1.0e16, 1.0e17, 1.0e18, 1.0e19, 1.0e20, 1.0e21, 1.0e22 };
+
+inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+inline bool isEndOfLine(const char *p, const char *end) { return p >= end || *p == '\n' || *p == '#'; }
+
+inline const char *skipBlanks(const char *p, const char *end) {
+    while (p < end && isBlank(*p)) {
+        p++;
+    }
+    return p;
+}
+
+inline const char *nextLine(const char *p, const char *end) {
+    const char *eol = (const char *)std::memchr(p, '\n', end - p);
+    return eol ? eol + 1 : end;
+}
+
+// Decimal number independent of the locale. Up to 19 significant digits are kept exactly, so the only error
+// is the rounding of the scaling by a power of ten, which is far below the precision of the float result.
+const char *parseFloat(const char *p, const char *end, float *value) {
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool hasDigits = false;
+    while (p < end && isDigit(*p)) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0 ? 1 : 0;
+        } else {
+            exponent += 1;
+        }
+        hasDigits = true;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && isDigit(*p)) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0 ? 1 : 0;
+                exponent -= 1;
+            }
+            hasDigits = true;
+            p++;
+        }
+    }
+
+    if (!hasDigits) {
+        // Rare spellings such as "nan" and "inf" (the token is copied, since the mapping is not null-terminated)
+        char token[64];
+        size_t length = 0;
+        while (start + length < end && length + 1 < sizeof(token) && !isBlank(start[length]) &&
+               start[length] != '\n') {
+            token[length] = start[length];
+            length++;
+        }
+        token[length] = '\0';
+        char *next = nullptr;
+        *value = std::strtof(token, &next);
+        return start + std::max((size_t)(next - token), (size_t)1);
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negativeExp = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            negativeExp = *q == '-';
+            q++;
+        }
+        if (q < end && isDigit(*q)) {
+            int e = 0;
+            while (q < end && isDigit(*q)) {
+                e = std::min(e * 10 + (*q - '0'), 10000);
+                q++;
+            }
+            exponent += negativeExp ? -e : e;
+            p = q;
+        }
+    }
+
+    double d = (double)mantissa;
+    for (; exponent > 22; exponent -= 22) {
+        d *= powersOf10[22];
+    }
+    for (; exponent < -22; exponent += 22) {
+        d /= powersOf10[22];
+    }
+    d = exponent >= 0 ? d * powersOf10[exponent] : d / powersOf10[-exponent];
+    *value = (float)(negative ? -d : d);
+    return p;
+}
+
+const char *parseIndex(const char *p, const char *end, int *index) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    int64_t value = 0;
+    while (p < end && isDigit(*p)) {
+        value = std::min(value * 10 + (*p - '0'), (int64_t)INT32_MAX);
+        p++;
+    }
+    *index = (int)(negative ? -value : value);
+    return p;
+}
+
+// Absolute indices are turned 0-based, and negative ones are made relative to the head of the chunk
+// (zero is invalid in OBJ and is left out of range)
+void resolveIndex(int index, size_t count, uint8_t relativeFlag, int *resolved, uint8_t *flags) {
+    if (index < 0) {
+        *resolved = (int)count + index;
+        *flags |= relativeFlag;
+    } else {
+        *resolved = index - 1;
+    }
+}
+
+const char *parseVector(const char *p, const char *end, int dims, float *values) {
+    for (int i = 0; i < dims; i++) {
+        p = skipBlanks(p, end);
+        if (isEndOfLine(p, end)) {
+            break;
+        }
+        p = parseFloat(p, end, &values[i]);
+    }
+    return p;
+}
+
+void parseChunk(const char *p, const char *end, Chunk *chunk) {
+    std::vector<Corner> polygon;
+    while (p < end) {
+        p = skipBlanks(p, end);
+        if (p >= end) {
+            break;
+        }
+
+        const char c0 = p[0];
+        const char c1 = p + 1 < end ? p[1] : '\n';
+        const char c2 = p + 2 < end ? p[2] : '\n';
+        if (c0 == 'v' && isBlank(c1)) {
+            float xyz[3] = { 0.0f, 0.0f, 0.0f };
+            p = parseVector(p + 1, end, 3, xyz);
+            chunk->positions.emplace_back(xyz[0], xyz[1], xyz[2]);
+        } else if (c0 == 'v' && c1 == 'n' && isBlank(c2)) {
+            float xyz[3] = { 0.0f, 0.0f, 0.0f };
+            p = parseVector(p + 2, end, 3, xyz);
+            chunk->normals.emplace_back(xyz[0], xyz[1], xyz[2]);
+        } else if (c0 == 'v' && c1 == 't' && isBlank(c2)) {
+            float uv[2] = { 0.0f, 0.0f };
+            p = parseVector(p + 2, end, 2, uv);
+            chunk->texcoords.emplace_back(uv[0], uv[1]);
+        } else if (c0 == 'f' && isBlank(c1)) {
+            // Each corner is "v", "v/vt", "v//vn" or "v/vt/vn"
+            polygon.clear();
+            p += 1;
+            while (true) {
+                p = skipBlanks(p, end);
+                if (isEndOfLine(p, end)) {
+                    break;
+                }
+
+                Corner corner;
+                corner.flags = MissingVT | MissingVN;
+                int index;
+                p = parseIndex(p, end, &index);
+                resolveIndex(index, chunk->positions.size(), RelativeV, &corner.v, &corner.flags);
+                if (p < end && *p == '/') {
+                    p++;
+                    if (p < end && *p != '/' && !isBlank(*p) && *p != '\n') {
+                        p = parseIndex(p, end, &index);
+                        resolveIndex(index, chunk->texcoords.size(), RelativeVT, &corner.vt, &corner.flags);
+                        corner.flags &= ~MissingVT;
+                    }
+                    if (p < end && *p == '/') {
+                        p++;
+                        p = parseIndex(p, end, &index);
+                        resolveIndex(index, chunk->normals.size(), RelativeVN, &corner.vn, &corner.flags);
+                        corner.flags &= ~MissingVN;
+                    }
+                }
+                polygon.push_back(corner);
+
+                // Skip anything unexpected in the corner
+                while (p < end && !isBlank(*p) && *p != '\n') {
+                    p++;
+                }
+            }
+
+            // Triangulate as a fan
+            for (size_t k = 1; k + 1 < polygon.size(); k++) {
+                chunk->corners.push_back(polygon[0]);
+                chunk->corners.push_back(polygon[k]);
+                chunk->corners.push_back(polygon[k + 1]);
+            }
+        }
+
+        p = nextLine(p, end);
+    }
+}
+
+template <typename T>
+std::vector<T> concatenate(const std::vector<Chunk> &chunks, const std::vector<size_t> &offsets,
+                           std::vector<T> Chunk::*member) {
+    std::vector<T> values(offsets.back());
+    const int numChunks = (int)chunks.size();
+    omp_parallel_for (int c = 0; c < numChunks; c++) {
+        const std::vector<T> &src = chunks[c].*member;
+        std::copy(src.begin(), src.end(), values.begin() + offsets[c]);
+    }
+    return values;
+}
+
+}  // anonymous namespace
+
+void readOBJ(const std::string &filename, std::vector<Vertex> *vertices, std::vector<uint32_t> *indices,
+             bool *hasNorm, bool *hasUV) {
+    MappedFile file(filename);
+    const char *data = file.data();
+    const size_t size = file.size();
+
+    // Line-aligned chunks
+    const size_t chunkBytes = 4 * 1024 * 1024;
+    const int numChunks = (int)std::max((size + chunkBytes - 1) / chunkBytes, (size_t)1);
+    std::vector<size_t> bounds(numChunks + 1, size);
+    bounds[0] = 0;
+    for (int c = 1; c < numChunks; c++) {
+        const size_t begin = std::max(bounds[c - 1], c * chunkBytes);
+        bounds[c] = begin < size ? nextLine(data + begin, data + size) - data : size;
+    }
+
+    std::vector<Chunk> chunks(numChunks);
+    omp_parallel_for (int c = 0; c < numChunks; c++) {
+        parseChunk(data + bounds[c], data + bounds[c + 1], &chunks[c]);
+    }
+
+    // Offsets of each chunk in the whole file
+    std::vector<size_t> posOffsets(numChunks + 1, 0);
+    std::vector<size_t> normOffsets(numChunks + 1, 0);
+    std::vector<size_t> uvOffsets(numChunks + 1, 0);
+    std::vector<size_t> cornerOffsets(numChunks + 1, 0);
+    for (int c = 0; c < numChunks; c++) {
+        posOffsets[c + 1] = posOffsets[c] + chunks[c].positions.size();
+        normOffsets[c + 1] = normOffsets[c] + chunks[c].normals.size();
+        uvOffsets[c + 1] = uvOffsets[c] + chunks[c].texcoords.size();
+        cornerOffsets[c + 1] = cornerOffsets[c] + chunks[c].corners.size();
+    }
+
+    // Faces may refer to the attributes in any chunk
+    const std::vector<glm::vec3> positions = concatenate(chunks, posOffsets, &Chunk::positions);
+    const std::vector<glm::vec3> normals = concatenate(chunks, normOffsets, &Chunk::normals);
+    const std::vector<glm::vec2> texcoords = concatenate(chunks, uvOffsets, &Chunk::texcoords);
+
+    // One vertex for each corner, written in place in the order of the file
+    vertices->resize(cornerOffsets[numChunks]);
+    indices->resize(cornerOffsets[numChunks]);
+    std::vector<int> invalidCounts(numChunks, 0);
+    std::vector<char> chunkHasNorm(numChunks, 1);
+    std::vector<char> chunkHasUV(numChunks, 1);
+    omp_parallel_for (int c = 0; c < numChunks; c++) {
+        const std::vector<Corner> &corners = chunks[c].corners;
+        for (size_t i = 0; i < corners.size(); i++) {
+            const Corner &corner = corners[i];
+            const size_t k = cornerOffsets[c] + i;
+            Vertex &vertex = (*vertices)[k];
+            vertex.pos = glm::vec3(0.0f);
+            vertex.normal = glm::vec3(0.0f);
+            vertex.uv = glm::vec3(0.0f);
+
+            const int64_t v = corner.v + ((corner.flags & RelativeV) ? (int64_t)posOffsets[c] : 0);
+            if (v >= 0 && v < (int64_t)positions.size()) {
+                vertex.pos = positions[v];
+            } else {
+                invalidCounts[c] += 1;
+            }
+
+            if (corner.flags & MissingVN) {
+                chunkHasNorm[c] = 0;
+            } else {
+                const int64_t vn = corner.vn + ((corner.flags & RelativeVN) ? (int64_t)normOffsets[c] : 0);
+                if (vn >= 0 && vn < (int64_t)normals.size()) {
+                    const float length = glm::length(normals[vn]);
+                    vertex.normal = length > 0.0f ? normals[vn] / length : normals[vn];
+                } else {
+                    invalidCounts[c] += 1;
+                }
+            }
+
+            if (corner.flags & MissingVT) {
+                chunkHasUV[c] = 0;
+            } else {
+                const int64_t vt = corner.vt + ((corner.flags & RelativeVT) ? (int64_t)uvOffsets[c] : 0);
+                if (vt >= 0 && vt < (int64_t)texcoords.size()) {
+                    vertex.uv = glm::vec3(texcoords[vt], 0.0f);
+                } else {
+                    invalidCounts[c] += 1;
+                }
+            }
+
+            (*indices)[k] = (uint32_t)k;
+        }
+    }
+
+    *hasNorm = std::find(chunkHasNorm.begin(), chunkHasNorm.end(), 0) == chunkHasNorm.end();
+    *hasUV = std::find(chunkHasUV.begin(), chunkHasUV.end(), 0) == chunkHasUV.end();
+
+    int invalid = 0;
+    for (int count : invalidCounts) {
+        invalid += count;
+    }
+    if (invalid > 0) {
+        Warn("%d attribute indices are out of range in *.obj file: %s", invalid, filename.c_str());
+    }
+}
+
+}  // namespace glrt
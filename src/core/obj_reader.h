@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "api.h"
+#include "trimesh.h"
+
+namespace glrt {
+
+//! Parse a Wavefront OBJ file in parallel. The file is memory-mapped and split into line-aligned chunks, whose
+//! attributes and faces are parsed concurrently and then written straight into "vertices" and "indices"
+//! (one vertex per face corner, and polygons are triangulated as fans). Throws std::runtime_error on failure.
+GLRT_API void readOBJ(const std::string &filename, std::vector<Vertex> *vertices, std::vector<uint32_t> *indices,
+                      bool *hasNorm, bool *hasUV);
+
+}  // namespace glrt
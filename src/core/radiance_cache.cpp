@@ -0,0 +1,85 @@
+#define GLRT_API_EXPORT
+#include "radiance_cache.h"
+
+#include <vector>
+
+namespace glrt {
+
+namespace {
+
+// Same hash functions as the ray tracing shader
+uint32_t hashUint(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+uint32_t hashCombine(uint32_t seed, uint32_t v) {
+    return seed ^ (hashUint(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+const float minSamples = 4.0f;
+const float maxSamples = 1024.0f;
+
+}  // anonymous namespace
+
+RadianceCache::RadianceCache(float cellSize, int tableSize)
+    : cellSize_{ cellSize }
+    , tableSize_{ tableSize } {
+    if ((tableSize & (tableSize - 1)) != 0) {
+        FatalError("Radiance cache table size must be a power of two: %d", tableSize);
+    }
+    upload();
+}
+
+void RadianceCache::record(const glm::vec3 &pos, int normalBucket, const glm::vec3 &value) {
+    if (!std::isfinite(value.x) || !std::isfinite(value.y) || !std::isfinite(value.z)) {
+        return;
+    }
+
+    const glm::ivec3 cell = glm::ivec3(glm::floor(pos / cellSize_));
+    uint32_t h = hashUint((uint32_t)cell.x);
+    h = hashCombine(h, (uint32_t)cell.y);
+    h = hashCombine(h, (uint32_t)cell.z);
+    h = hashCombine(h, (uint32_t)normalBucket);
+    const uint32_t checksum = (hashUint(h + 0x9e3779b9u) & 0xffffffu) + 1u;
+    const uint64_t key = ((uint64_t)h << 32) | checksum;
+
+    Cell &c = cells[key];
+    c.slot = h & (uint32_t)(tableSize_ - 1);
+    c.checksum = checksum;
+    c.sum += value;
+    c.count += 1.0f;
+
+    // Forget old samples gradually, since they were estimated with an older cache
+    if (c.count > maxSamples) {
+        c.sum *= maxSamples / c.count;
+        c.count = maxSamples;
+    }
+}
+
+void RadianceCache::upload() {
+    std::vector<glm::vec4> table(tableSize_, glm::vec4(0.0f));
+    for (const auto &it : cells) {
+        const Cell &c = it.second;
+        if (c.count < minSamples) {
+            continue;
+        }
+
+        for (int k = 0; k < maxProbes; k++) {
+            const uint32_t slot = (c.slot + k) & (uint32_t)(tableSize_ - 1);
+            if (table[slot].w == 0.0f) {
+                table[slot] = glm::vec4(c.sum / c.count, (float)c.checksum);
+                break;
+            }
+        }
+    }
+
+    buffer_ = std::make_shared<TextureBuffer>(table.size() * sizeof(glm::vec4), GL_RGBA32F, GL_DYNAMIC_DRAW);
+    buffer_->setData(table.data());
+}
+
+}  // namespace glrt
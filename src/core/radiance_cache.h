@@ -0,0 +1,44 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+
+#include "api.h"
+#include "common.h"
+#include "texture_buffer.h"
+
+namespace glrt {
+
+//! World-space radiance cache on a hashed voxel grid. Each cell (voxel and dominant
+//! normal axis) keeps the running mean of the reflected radiance divided by the albedo.
+//! The GPU table is open-addressed with linear probing, and each RGBA32F entry has
+//! the cached value in RGB and a 24-bit checksum (plus one, zero means empty) in A.
+class GLRT_API RadianceCache {
+public:
+    RadianceCache(float cellSize, int tableSize = 1 << 20);
+
+    void record(const glm::vec3 &pos, int normalBucket, const glm::vec3 &value);
+
+    //! Transfer the cells which have enough samples to the texture buffer
+    void upload();
+
+    float cellSize() const { return cellSize_; }
+    int tableSize() const { return tableSize_; }
+    std::shared_ptr<TextureBuffer> buffer() const { return buffer_; }
+
+    static const int maxProbes = 8;
+
+private:
+    struct Cell {
+        uint32_t slot, checksum;
+        glm::vec3 sum = glm::vec3(0.0f);
+        float count = 0.0f;
+    };
+
+    float cellSize_;
+    int tableSize_;
+    std::unordered_map<uint64_t, Cell> cells;
+    std::shared_ptr<TextureBuffer> buffer_ = nullptr;
+};
+
+}  // namespace glrt
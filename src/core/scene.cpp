@@ -1,8 +1,12 @@
 #define GLRT_API_EXPORT
 #include "scene.h"
 
+#include <cstring>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <tuple>
 #include <unordered_map>
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
@@ -14,12 +18,171 @@ namespace fs = std::experimental::filesystem;
 using namespace json11;
 
 #include "common.h"
+#include "hash.h"
+#include "mapped_file.h"
 #include "texture.h"
 #include "texture_buffer.h"
 #include "volume.h"
+#include "sparse_volume.h"
+#include "volume_sequence.h"
+#include "system.h"
+#include "timer.h"
 
 namespace glrt {
 
+namespace {
+
+using ChunkEncoder = std::function<void(const float *src, size_t count, void *dst)>;
+
+// Stream a dense volume into the atlas at "origin" slice by slice through double-buffered pixel buffers,
+// so that reading the memory-mapped payload overlaps with the transfer of the previous slices
+void uploadVolume(GLuint texId, const glm::ivec3 &origin, const Volume &volume, GLenum format, GLenum type,
+                  size_t texelBytes, const ChunkEncoder &encode) {
+    const size_t sliceSize = (size_t)volume.size_x * volume.size_y;
+    const size_t sliceBytes = sliceSize * texelBytes;
+    const size_t chunkBytes = 64 * 1024 * 1024;
+    const int slicesPerChunk = std::max(1, (int)(chunkBytes / sliceBytes));
+    const size_t bufferBytes = slicesPerChunk * sliceBytes;
+
+    // Rows of 8- and 16-bit texels are not always aligned to 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_3D, texId);
+
+    GLuint pbo[2];
+    glGenBuffers(2, pbo);
+    for (int z = 0, k = 0; z < volume.size_z; z += slicesPerChunk, k++) {
+        const int depth = std::min(slicesPerChunk, volume.size_z - z);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[k % 2]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bufferBytes, nullptr, GL_STREAM_DRAW);
+        void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, depth * sliceBytes,
+                                     GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        encode(volume.data + (size_t)z * sliceSize * volume.channels, depth * sliceSize, dst);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        glTexSubImage3D(GL_TEXTURE_3D, 0, origin.x, origin.y, origin.z + z, volume.size_x, volume.size_y, depth,
+                        format, type, nullptr);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(2, pbo);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+// Precompute the black body emission from the temperature grid and upload it as RGB texels.
+// Returns the factor to restore the normalized emission
+float uploadEmission(GLuint texId, const glm::ivec3 &origin, const Volume &temperature, float temperatureScale,
+                     bool halfPrecision) {
+    float scale = 1.0f;
+    auto encode = [&](const float *src, size_t count, void *dst) {
+        scale = encodeEmission(src, count, temperature.channels, temperatureScale, temperature.maxValue,
+                               halfPrecision, dst);
+    };
+    uploadVolume(texId, origin, temperature, GL_RGB, halfPrecision ? GL_HALF_FLOAT : GL_FLOAT,
+                 3 * (halfPrecision ? sizeof(uint16_t) : sizeof(float)), encode);
+    return scale;
+}
+
+// Place boxes in shelves along x, each of which stacks them along z up to "maxDepth".
+// Returns the size of the atlas with the origin of each box
+glm::ivec3 packAtlas(const std::vector<glm::ivec3> &sizes, int maxDepth, std::vector<glm::ivec3> *origins) {
+    origins->assign(sizes.size(), glm::ivec3(0));
+    glm::ivec3 atlasSize(1);
+    int shelfX = 0, shelfWidth = 0, z = 0;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (z > 0 && z + sizes[i].z > maxDepth) {
+            shelfX += shelfWidth;
+            shelfWidth = 0;
+            z = 0;
+        }
+        (*origins)[i] = glm::ivec3(shelfX, 0, z);
+        z += sizes[i].z;
+        shelfWidth = std::max(shelfWidth, sizes[i].x);
+        atlasSize.x = std::max(atlasSize.x, shelfX + sizes[i].x);
+        atlasSize.y = std::max(atlasSize.y, sizes[i].y);
+        atlasSize.z = std::max(atlasSize.z, z);
+    }
+    return atlasSize;
+}
+
+GLuint createAtlasTexture(GLenum internalFormat, const glm::ivec3 &size) {
+    GLuint texId;
+    glGenTextures(1, &texId);
+    glBindTexture(GL_TEXTURE_3D, texId);
+    glTexStorage3D(GL_TEXTURE_3D, 1, internalFormat, size.x, size.y, size.z);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    return texId;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Scene snapshot file
+// ---------------------------------------------------------------------------------------------------------------------
+
+struct SnapshotHeader {
+    char magic[8] = { 'G', 'L', 'R', 'T', 'S', 'C', 'N', '\0' };
+    // Bump whenever the processed geometry changes (2: duplicate vertices are welded)
+    uint32_t version = 2;
+    uint32_t numSections = 0;
+    uint64_t key = 0;
+    double lightPowerTotal = 0.0;
+};
+
+//! Array stored in the snapshot. Offsets are aligned, so that the mapped arrays are uploaded as they are
+struct SnapshotSection {
+    uint64_t offset = 0;
+    uint64_t count = 0;
+    uint64_t stride = 0;
+};
+
+enum SnapshotSectionID : int {
+    SnapshotVertices = 0,
+    SnapshotIndices,
+    SnapshotTriangles,
+    SnapshotLights,
+    SnapshotTriLightIndices,
+    SnapshotBVHNodes,
+    SnapshotAliasEntries,
+    SnapshotLightBVHNodes,
+    SnapshotLightLeaves,
+    SnapshotNumSections
+};
+
+const uint64_t SnapshotAlignment = 256;
+
+uint64_t alignSnapshot(uint64_t offset) {
+    return (offset + SnapshotAlignment - 1) / SnapshotAlignment * SnapshotAlignment;
+}
+
+template <typename T>
+bool readSection(const MappedFile &file, const SnapshotSection &section, std::vector<T> *values) {
+    if (section.stride != sizeof(T) || section.offset + section.count * sizeof(T) > file.size()) {
+        return false;
+    }
+    const T *begin = (const T *)(file.data() + section.offset);
+    values->assign(begin, begin + section.count);
+    return true;
+}
+
+//! Identity of an input file for the snapshot key. The size and the modification time stand in for the contents,
+//! which would take about as long to hash as to parse.
+uint64_t fileStamp(const std::string &filename) {
+    const fs::path path(filename.c_str());
+    std::error_code err;
+    uint64_t h = hashString(filename);
+    h = hashCombine(h, (uint64_t)fs::file_size(path, err));
+    h = hashCombine(h, (uint64_t)fs::last_write_time(path, err).time_since_epoch().count());
+    return h;
+}
+
+}  // anonymous namespace
+
+std::string Scene::snapshotCacheDir = "";
+BinaryCacheMode Scene::snapshotCacheMode = BinaryCacheMode::Disabled;
+
 // ---------------------------------------------------------------------------------------------------------------------
 // PUBLIC methods
 // ---------------------------------------------------------------------------------------------------------------------
@@ -113,12 +276,143 @@ void Scene::parse(const std::string &filename) {
         projM = glm::perspective(glm::radians(fov), aspect, zNear, zFar);
     }
 
+    // Sampler
+    samplerType = "independent";
+    blueNoiseTex = nullptr;
+    if (!json["sampler"]["type"].is_null()) {
+        samplerType = json["sampler"]["type"].string_value();
+        if (samplerType == "bluenoise") {
+            if (json["sampler"]["texture"].is_null()) {
+                Warn("bluenoise sampler node does not have \"texture\" key! Use sobol instead.");
+                samplerType = "sobol";
+            } else {
+                const std::string &texfile = json["sampler"]["texture"].string_value();
+                blueNoiseTex = std::make_shared<Texture>((baseDirPath / fs::path(texfile.c_str())).string());
+            }
+        } else if (samplerType != "independent" && samplerType != "sobol") {
+            Warn("Unknown sampler type: %s", samplerType.c_str());
+            samplerType = "independent";
+        }
+    }
+    Info("Sampler type: %s", samplerType.c_str());
+
+    // Adaptive sampling
+    adaptiveSampling = json["sampler"]["adaptive"].bool_value();
+    adaptiveMinSamples = 16;
+    if (!json["sampler"]["adaptiveMinSamples"].is_null()) {
+        adaptiveMinSamples = json["sampler"]["adaptiveMinSamples"].int_value();
+    }
+    adaptiveThreshold = 0.01f;
+    if (!json["sampler"]["adaptiveThreshold"].is_null()) {
+        adaptiveThreshold = (float)json["sampler"]["adaptiveThreshold"].number_value();
+    }
+    if (adaptiveSampling) {
+        Info("Adaptive sampling: threshold = %f, min samples = %d", adaptiveThreshold, adaptiveMinSamples);
+    }
+
+    // Environment map
+    envmap = nullptr;
+    if (!json["envmap"].is_null()) {
+        const std::string &envfile = json["envmap"]["filename"].string_value();
+        const float scale = json["envmap"]["scale"].is_null() ? 1.0f : (float)json["envmap"]["scale"].number_value();
+        envmap = std::make_shared<Envmap>((baseDirPath / fs::path(envfile.c_str())).string(), scale);
+    }
+
+    // Integrator
+    lightSampling = "power";
+    if (!json["integrator"]["lightSampling"].is_null()) {
+        lightSampling = json["integrator"]["lightSampling"].string_value();
+        if (lightSampling != "uniform" && lightSampling != "power" && lightSampling != "bvh") {
+            Warn("Unknown light sampling strategy: %s", lightSampling.c_str());
+            lightSampling = "power";
+        }
+    }
+    Info("Light sampling: %s", lightSampling.c_str());
+
+    triangleSampling = "solidangle";
+    if (!json["integrator"]["triangleSampling"].is_null()) {
+        triangleSampling = json["integrator"]["triangleSampling"].string_value();
+        if (triangleSampling != "area" && triangleSampling != "solidangle") {
+            Warn("Unknown triangle sampling strategy: %s", triangleSampling.c_str());
+            triangleSampling = "solidangle";
+        }
+    }
+
+    directLighting = "nee";
+    if (!json["integrator"]["directLighting"].is_null()) {
+        directLighting = json["integrator"]["directLighting"].string_value();
+        if (directLighting != "nee" && directLighting != "restir") {
+            Warn("Unknown direct lighting method: %s", directLighting.c_str());
+            directLighting = "nee";
+        }
+    }
+    Info("Direct lighting: %s", directLighting.c_str());
+
+    russianRoulette = "throughput";
+    if (!json["integrator"]["russianRoulette"].is_null()) {
+        russianRoulette = json["integrator"]["russianRoulette"].string_value();
+        if (russianRoulette != "throughput" && russianRoulette != "adrrs") {
+            Warn("Unknown Russian roulette method: %s", russianRoulette.c_str());
+            russianRoulette = "throughput";
+        }
+    }
+    maxSplit = 4;
+    if (!json["integrator"]["maxSplit"].is_null()) {
+        maxSplit = json["integrator"]["maxSplit"].int_value();
+    }
+    Info("Russian roulette: %s", russianRoulette.c_str());
+
+    // Light sampling at the collisions in media, with shadow rays attenuated by ratio tracking
+    mediumNEE = true;
+    if (!json["integrator"]["mediumNEE"].is_null()) {
+        mediumNEE = json["integrator"]["mediumNEE"].bool_value();
+    }
+
+    guiding = json["integrator"]["guiding"].bool_value();
+    guidingIterations = 6;
+    if (!json["integrator"]["guidingIterations"].is_null()) {
+        guidingIterations = json["integrator"]["guidingIterations"].int_value();
+    }
+
+    radianceCache = json["integrator"]["radianceCache"].bool_value();
+    radianceCacheDepth = 1;
+    if (!json["integrator"]["radianceCacheDepth"].is_null()) {
+        radianceCacheDepth = json["integrator"]["radianceCacheDepth"].int_value();
+    }
+    radianceCacheCellSize = (float)json["integrator"]["radianceCacheCellSize"].number_value();
+    // Initial mode: "preview" terminates paths into the cache (biased), "final" only renders unbiased, and
+    // "auto" takes the preview for interactive runs and the final quality for "--max-spp" or "--target-rmse"
+    radianceCacheMode = "auto";
+    if (!json["integrator"]["radianceCacheMode"].is_null()) {
+        radianceCacheMode = json["integrator"]["radianceCacheMode"].string_value();
+        if (radianceCacheMode != "auto" && radianceCacheMode != "preview" && radianceCacheMode != "final") {
+            Warn("Unknown radiance cache mode: %s", radianceCacheMode.c_str());
+            radianceCacheMode = "auto";
+        }
+    }
+    if (radianceCache && guiding && directLighting == "restir") {
+        Warn("Radiance cache cannot be used with both ReSTIR and path guiding (too many render targets)!");
+        radianceCache = false;
+    }
+
+    useDouble = false;
+    if (!json["integrator"]["precision"].is_null()) {
+        const std::string precision = json["integrator"]["precision"].string_value();
+        if (precision == "double") {
+            useDouble = true;
+        } else if (precision != "float") {
+            Warn("Unknown integrator precision: %s", precision.c_str());
+        }
+    }
+
     // Shapes
     vertices.clear();
     indices.clear();
     triangles.clear();
     lights.clear();
+    triLightIndices.clear();
     materials.clear();
+    std::vector<MeshJob> meshJobs;
     const auto &shapes = json["scene"].array_items();
     for (int i = 0; i < shapes.size(); i++) {
         // Material
@@ -173,89 +467,156 @@ void Scene::parse(const std::string &filename) {
             }
         } else if(material == "media") {
             mtrl.type = glm::vec3((float)MaterialType::Media);
-            const int baseIndex = volumes.size();
             VolumeData voldata;
-            {
-                const std::string &filename = shapes[i]["volume"]["density"].string_value();
-                Volume volume;
-                volume.load((baseDirPath / fs::path(filename.c_str())).string());
-
-                GLuint texId;
-                glGenTextures(1, &texId);
-                glBindTexture(GL_TEXTURE_3D, texId);
-                glTexStorage3D(GL_TEXTURE_3D, 1, GL_R32F, volume.size_x, volume.size_y, volume.size_z);
-                glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, volume.size_x, volume.size_y, volume.size_z, GL_RED,
-                                GL_FLOAT, volume.data);
-
-                voldata.densityTex = texId;
-                voldata.maxValue = volume.maxValue;
-                voldata.bboxMin = glm::vec3(shapes[i]["volume"]["bboxMin"][0].number_value(),
-                                            shapes[i]["volume"]["bboxMin"][1].number_value(),
-                                            shapes[i]["volume"]["bboxMin"][2].number_value());
-                voldata.bboxMax = glm::vec3(shapes[i]["volume"]["bboxMax"][0].number_value(),
-                                            shapes[i]["volume"]["bboxMax"][1].number_value(),
-                                            shapes[i]["volume"]["bboxMax"][2].number_value());
+            const Json &volnode = shapes[i]["volume"];
+            voldata.bboxMin = glm::vec3(volnode["bboxMin"][0].number_value(),
+                                        volnode["bboxMin"][1].number_value(),
+                                        volnode["bboxMin"][2].number_value());
+            voldata.bboxMax = glm::vec3(volnode["bboxMax"][0].number_value(),
+                                        volnode["bboxMax"][1].number_value(),
+                                        volnode["bboxMax"][2].number_value());
+
+            fs::path densityPath = baseDirPath / fs::path(volnode["density"].string_value().c_str());
+            fs::path temperaturePath = baseDirPath / fs::path(volnode["temperature"].string_value().c_str());
+
+            // Animated volume with the file names given by patterns (e.g., "fire_%04d.vol")
+            const Json &seqnode = volnode["sequence"];
+            if (!seqnode.is_null()) {
+                voldata.sequence = std::make_shared<VolumeSequence>(
+                    (baseDirPath / fs::path(seqnode["density"].string_value().c_str())).string(),
+                    (baseDirPath / fs::path(seqnode["temperature"].string_value().c_str())).string(),
+                    seqnode["first"].int_value(), seqnode["frames"].is_null() ? 1 : seqnode["frames"].int_value());
+                densityPath = fs::path(voldata.sequence->densityPath(0).c_str());
+                temperaturePath = fs::path(voldata.sequence->temperaturePath(0).c_str());
             }
 
-            {
-                const std::string &filename = shapes[i]["volume"]["temperature"].string_value();
-                Volume volume;
-                volume.load((baseDirPath / fs::path(filename.c_str())).string());
+            // Sparse bricks for "*.svol" files, or when requested for dense volumes
+            const bool sparse = volnode["sparse"].bool_value() || densityPath.extension() == ".svol";
+            if (sparse && voldata.sequence) {
+                FatalError("Volume sequences of sparse bricks are not supported!");
+            }
+            // Storage format of the textures ("float32", "float16", "unorm16" or "unorm8")
+            voldata.format = parseVolumeFormat(volnode["format"].string_value());
+            // Black body emission is precomputed unless "emission" is disabled
+            voldata.emission = volnode["emission"].is_null() || volnode["emission"].bool_value();
+
+            Timer loadTimer;
+            loadTimer.start();
+            if (sparse) {
+                const int brickSize = volnode["brickSize"].is_null() ? 8 : volnode["brickSize"].int_value();
+                auto loadSparse = [&](const fs::path &path) {
+                    auto volume = std::make_shared<SparseVolume>();
+                    if (path.extension() == ".svol") {
+                        volume->load(path.string());
+                    } else {
+                        volume->convert(path.string(), brickSize);
+                    }
+                    // Empty bricks are decoded as zero, so the normalized range starts from zero
+                    const VolumeEncoding encoding(voldata.format, 0.0f, volume->maxValue());
+                    volume->upload(encoding);
+                    return std::make_pair(volume, encoding);
+                };
+
+                std::tie(voldata.sparseDensity, voldata.densityEncoding) = loadSparse(densityPath);
+                std::tie(voldata.sparseTemperature, voldata.temperatureEncoding) = loadSparse(temperaturePath);
+                const glm::ivec3 sizeD = voldata.sparseDensity->size();
+                const glm::ivec3 sizeT = voldata.sparseTemperature->size();
+                if (sizeD.x != sizeT.x || sizeD.y != sizeT.y || sizeD.z != sizeT.z ||
+                    voldata.sparseDensity->brickSize() != voldata.sparseTemperature->brickSize()) {
+                    FatalError("Sparse density and temperature must have the same resolution and brick size!");
+                }
+                voldata.size = sizeD;
+                voldata.maxValue = voldata.sparseDensity->maxValue();
 
-                GLuint texId;
-                glGenTextures(1, &texId);
-                glBindTexture(GL_TEXTURE_3D, texId);
-                glTexStorage3D(GL_TEXTURE_3D, 1, GL_R32F, volume.size_x, volume.size_y, volume.size_z);
-                glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, volume.size_x, volume.size_y, volume.size_z, GL_RED,
-                                GL_FLOAT, volume.data);
+                // Bricks also serve as the cells of the majorant grid
+                voldata.majorant = std::make_shared<Volume>(voldata.sparseDensity->majorantGrid());
+                voldata.majorantCellSize = voldata.sparseDensity->brickSize();
+            } else {
+                // Payloads stay memory-mapped until the volumes are packed into the atlases
+                voldata.density = std::make_shared<Volume>();
+                voldata.density->load(densityPath.string());
+                voldata.temperature = std::make_shared<Volume>();
+                voldata.temperature->load(temperaturePath.string());
+
+                const Volume &density = *voldata.density;
+                const Volume &temperature = *voldata.temperature;
+                if (density.size_x != temperature.size_x || density.size_y != temperature.size_y ||
+                    density.size_z != temperature.size_z) {
+                    FatalError("Density and temperature must have the same resolution!");
+                }
+                voldata.size = glm::ivec3(density.size_x, density.size_y, density.size_z);
+                voldata.maxValue = density.maxValue;
+                Info("Density: min = %f, max = %f", density.minValue, density.maxValue);
 
-                voldata.temperatureTex = texId;
+                // Coarse majorant grid for delta tracking (zero cell size gives the global majorant)
+                if (!volnode["majorantCellSize"].is_null()) {
+                    voldata.majorantCellSize = volnode["majorantCellSize"].int_value();
+                }
+                if (voldata.majorantCellSize <= 0) {
+                    voldata.majorantCellSize = std::max(voldata.size.x, std::max(voldata.size.y, voldata.size.z));
+                }
+                voldata.majorant = std::make_shared<Volume>(density.majorantGrid(voldata.majorantCellSize));
             }
+            voldata.majorantSize = glm::ivec3(voldata.majorant->size_x, voldata.majorant->size_y,
+                                              voldata.majorant->size_z);
+
+            Info("Volume loaded: %.3f sec, peak RSS = %.1f MB", loadTimer.count(),
+                 peakResidentMemory() / (1024.0 * 1024.0));
+
+            // Textures are created by "packVolumes" once all the media are known
+            mtrl.texIds = glm::vec3((float)volumes.size(), 0.0f, 0.0f);
             volumes.push_back(voldata);
-            mtrl.texIds = glm::vec3(baseIndex, baseIndex + 1, 0.0);
         } else {
             FatalError("Unsupported material: %s", material.c_str());
         }
         materials.push_back(mtrl);
 
-        // Triangles
+        // Triangles (meshes are loaded after all the shapes are parsed)
         const std::string type = shapes[i]["type"].string_value();
         if (type == "obj") {
             const std::string &objfile = shapes[i]["filename"].string_value();
-            Trimesh mesh((baseDirPath / fs::path(objfile.c_str())).string());
-
-            const int baseIndex = (int)vertices.size();
-            const int nVerts = mesh.vertices.size();
-            for (int i = 0; i < nVerts; i++) {
-                vertices.push_back(mesh.vertices[i]);
+            MeshJob job;
+            job.filename = (baseDirPath / fs::path(objfile.c_str())).string();
+            job.materialID = (int)materials.size() - 1;
+            job.emissive = glm::length(mtrl.emission) != 0.0f;
+            if (!shapes[i]["weldTolerance"].is_null()) {
+                job.weldTolerance = (float)shapes[i]["weldTolerance"].number_value();
             }
+            meshJobs.push_back(job);
+        }
+    }
 
-            const int nTris = mesh.indices.size() / 3;
-            for (int i = 0; i < nTris; i++) {
-                Triangle tri;
-                tri.indices.x = baseIndex + mesh.indices[i * 3 + 0];
-                tri.indices.y = baseIndex + mesh.indices[i * 3 + 1];
-                tri.indices.z = baseIndex + mesh.indices[i * 3 + 2];
-                tri.indices.w = materials.size() - 1;
-                triangles.push_back(tri);
-
-                indices.push_back(baseIndex + mesh.indices[i * 3 + 0]);
-                indices.push_back(baseIndex + mesh.indices[i * 3 + 1]);
-                indices.push_back(baseIndex + mesh.indices[i * 3 + 2]);
-
-                if (glm::length(mtrl.emission) != 0.0f) {
-                    lights.push_back(tri);
-                }
-            }
+    // Geometry is restored from the snapshot when neither the scene nor the meshes have changed
+    std::string snapshotFile = "";
+    uint64_t snapshotKey = hashString(jsonText);
+    bool restored = false;
+    if (snapshotCacheMode != BinaryCacheMode::Disabled && !snapshotCacheDir.empty()) {
+        for (const auto &job : meshJobs) {
+            snapshotKey = hashCombine(snapshotKey, fileStamp(job.filename));
+        }
+        snapshotFile = (fs::path(snapshotCacheDir) / fs::path(hashToString(snapshotKey) + ".scene")).string();
+        if (snapshotCacheMode == BinaryCacheMode::ReadWrite || snapshotCacheMode == BinaryCacheMode::ReadOnly) {
+            restored = loadSnapshot(snapshotFile, snapshotKey);
         }
     }
 
-    // Construct BVH
-    bvh.construct(vertices, indices);
+    if (!restored) {
+        buildGeometry(meshJobs);
+        if (!snapshotFile.empty() &&
+            (snapshotCacheMode == BinaryCacheMode::ReadWrite || snapshotCacheMode == BinaryCacheMode::Rebuild)) {
+            saveSnapshot(snapshotFile, snapshotKey);
+        }
+    }
+
+    // Shared atlases for all the media
+    if (!volumes.empty()) {
+        packVolumes();
+    }
+
+    // Transfer to OpenGL
     bvhTexBuffer = std::make_shared<TextureBuffer>(bvh.nodes.size() * sizeof(BVHNode), GL_RGB32F, GL_STATIC_DRAW);
     bvhTexBuffer->setData(bvh.nodes.data());
 
-    // Transfer to OpenGL
     vertTexBuffer = std::make_shared<TextureBuffer>(vertices.size() * sizeof(Vertex), GL_RGB32F, GL_STATIC_DRAW);
     vertTexBuffer->setData(vertices.data());
 
@@ -268,6 +629,22 @@ void Scene::parse(const std::string &filename) {
     lightTexBuffer = std::make_shared<TextureBuffer>(lights.size() * sizeof(Triangle), GL_RGBA32F, GL_STATIC_DRAW);
     lightTexBuffer->setData(lights.data());
 
+    triLightTexBuffer = std::make_shared<TextureBuffer>(triLightIndices.size() * sizeof(float), GL_R32F,
+                                                        GL_STATIC_DRAW);
+    triLightTexBuffer->setData(triLightIndices.data());
+
+    lightAliasTexBuffer = std::make_shared<TextureBuffer>(lightAlias.entries.size() * sizeof(AliasEntry), GL_RGBA32F,
+                                                          GL_STATIC_DRAW);
+    lightAliasTexBuffer->setData(lightAlias.entries.data());
+
+    lightBVHTexBuffer = std::make_shared<TextureBuffer>(lightBVH.nodes.size() * sizeof(LightBVHNode), GL_RGBA32F,
+                                                        GL_STATIC_DRAW);
+    lightBVHTexBuffer->setData(lightBVH.nodes.data());
+
+    lightLeafTexBuffer = std::make_shared<TextureBuffer>(lightBVH.leaves.size() * sizeof(float), GL_R32F,
+                                                         GL_STATIC_DRAW);
+    lightLeafTexBuffer->setData(lightBVH.leaves.data());
+
     // Check scene info
     Info("Scene setup OK!\n");
     Info("#vertex: %d", (int)vertices.size());
@@ -275,8 +652,497 @@ void Scene::parse(const std::string &filename) {
     Info("#BVH noede: %d", (int)bvh.nodes.size());
 }
 
+ShaderDefines Scene::shaderDefines() const {
+    bool hasDiffuse = false;
+    bool hasConductor = false;
+    for (const auto &mtrl : materials) {
+        const auto type = (MaterialType)(int)mtrl.type.x;
+        hasDiffuse |= type == MaterialType::Diffuse;
+        hasConductor |= type == MaterialType::Conductor;
+    }
+
+    ShaderDefines defines;
+    defines["ENABLE_DIFFUSE"] = hasDiffuse ? "1" : "0";
+    defines["ENABLE_CONDUCTOR"] = hasConductor ? "1" : "0";
+    defines["ENABLE_VOLUME"] = !volumes.empty() ? "1" : "0";
+    defines["ENABLE_SPARSE_VOLUME"] = !volumes.empty() && volumes[0].sparseDensity ? "1" : "0";
+    defines["ENABLE_EMISSION_VOLUME"] = !volumes.empty() && emissionVolume ? "1" : "0";
+    defines["ENABLE_MEDIUM_NEE"] = !volumes.empty() && mediumNEE ? "1" : "0";
+    defines["VOLUME_ATLASES"] = std::to_string(std::max(1, (int)densityAtlasTex.size()));
+    defines["ENABLE_ENVMAP"] = envmap ? "1" : "0";
+    defines["ENABLE_THIN_LENS"] = apertureRadius > 0.0f ? "1" : "0";
+    if (lightSampling == "uniform") {
+        defines["LIGHT_SAMPLER"] = "LIGHT_SAMPLER_UNIFORM";
+    } else if (lightSampling == "power") {
+        defines["LIGHT_SAMPLER"] = "LIGHT_SAMPLER_POWER";
+    } else if (lightSampling == "bvh") {
+        defines["LIGHT_SAMPLER"] = "LIGHT_SAMPLER_BVH";
+    }
+    if (triangleSampling == "area") {
+        defines["TRIANGLE_SAMPLER"] = "TRIANGLE_SAMPLER_AREA";
+    } else if (triangleSampling == "solidangle") {
+        defines["TRIANGLE_SAMPLER"] = "TRIANGLE_SAMPLER_SOLID_ANGLE";
+    }
+    if (directLighting == "restir") {
+        defines["DIRECT_LIGHTING"] = "DIRECT_LIGHTING_RESTIR";
+    }
+    if (russianRoulette == "adrrs") {
+        defines["RUSSIAN_ROULETTE"] = "RUSSIAN_ROULETTE_ADRRS";
+    }
+    defines["ENABLE_GUIDING"] = guiding ? "1" : "0";
+    defines["ENABLE_RADIANCE_CACHE"] = radianceCache ? "1" : "0";
+    if (samplerType == "sobol") {
+        defines["SAMPLER_TYPE"] = "SAMPLER_SOBOL";
+    } else if (samplerType == "bluenoise") {
+        defines["SAMPLER_TYPE"] = "SAMPLER_BLUE_NOISE";
+    }
+    if (useDouble) {
+        defines["USE_DOUBLE"] = "";
+    }
+    return defines;
+}
+
+int Scene::animationFrames() const {
+    int frames = 1;
+    for (const auto &v : volumes) {
+        if (v.sequence) {
+            frames = std::max(frames, v.sequence->numFrames());
+        }
+    }
+    return frames;
+}
+
+void Scene::updateVolumes() {
+    for (auto &v : volumes) {
+        if (v.sequence) {
+            v.sequence->update(densityAtlasTex[v.atlas], temperatureAtlasTex[v.atlas], majorantAtlasTex,
+                               v.backAtlasOrigin, v.backMajorantOrigin);
+        }
+    }
+}
+
+bool Scene::advanceVolumes() {
+    for (auto &v : volumes) {
+        if (v.sequence && v.sequence->hasNext() && !v.sequence->ready()) {
+            return false;
+        }
+    }
+
+    // Shorter sequences keep their last frames
+    for (auto &v : volumes) {
+        if (!v.sequence || !v.sequence->hasNext()) {
+            continue;
+        }
+
+        const VolumeSequence::Frame frame = v.sequence->swap();
+        std::swap(v.atlasOrigin, v.backAtlasOrigin);
+        std::swap(v.majorantOrigin, v.backMajorantOrigin);
+        v.maxValue = frame.maxValue;
+        v.emissionScale = frame.emissionScale;
+        v.densityEncoding = frame.densityEncoding;
+        v.temperatureEncoding = frame.temperatureEncoding;
+    }
+    uploadVolumeDescriptors();
+    return true;
+}
+
+void Scene::setSnapshotCache(const std::string &dirname, BinaryCacheMode mode) {
+    snapshotCacheDir = dirname;
+    snapshotCacheMode = mode;
+}
+
 // ---------------------------------------------------------------------------------------------------------------------
 // PRIVATE methods
 // ---------------------------------------------------------------------------------------------------------------------
 
+void Scene::buildGeometry(const std::vector<MeshJob> &meshJobs) {
+    // Load the mesh files concurrently
+    Timer meshTimer;
+    meshTimer.start();
+    std::vector<Trimesh> meshes(meshJobs.size());
+    const int numMeshes = (int)meshJobs.size();
+    omp_parallel_for (int m = 0; m < numMeshes; m++) {
+        meshes[m].load(meshJobs[m].filename, OBJParser::Native, meshJobs[m].weldTolerance);
+    }
+
+    // Memory saved by welding the face corners
+    size_t unweldedVertices = 0;
+    size_t weldedVertices = 0;
+    double weldTime = 0.0;
+    for (const auto &mesh : meshes) {
+        unweldedVertices += mesh.unweldedVertices;
+        weldedVertices += mesh.vertices.size();
+        weldTime += mesh.weldTime;
+    }
+    Info("Vertex welding: %d -> %d vertices (%.1f MB -> %.1f MB), %.3f sec in total", (int)unweldedVertices,
+         (int)weldedVertices, unweldedVertices * sizeof(Vertex) / (1024.0 * 1024.0),
+         weldedVertices * sizeof(Vertex) / (1024.0 * 1024.0), weldTime);
+
+    // Offsets of each mesh in the global arrays, so that they are filled in parallel in the order of the shapes
+    std::vector<size_t> vertexOffsets(numMeshes + 1, 0);
+    std::vector<size_t> triangleOffsets(numMeshes + 1, 0);
+    std::vector<size_t> lightOffsets(numMeshes + 1, 0);
+    for (int m = 0; m < numMeshes; m++) {
+        const size_t nTris = meshes[m].indices.size() / 3;
+        vertexOffsets[m + 1] = vertexOffsets[m] + meshes[m].vertices.size();
+        triangleOffsets[m + 1] = triangleOffsets[m] + nTris;
+        lightOffsets[m + 1] = lightOffsets[m] + (meshJobs[m].emissive ? nTris : 0);
+    }
+    vertices.resize(vertexOffsets[numMeshes]);
+    indices.resize(triangleOffsets[numMeshes] * 3);
+    triangles.resize(triangleOffsets[numMeshes]);
+    triLightIndices.resize(triangleOffsets[numMeshes]);
+    lights.resize(lightOffsets[numMeshes]);
+
+    omp_parallel_for (int m = 0; m < numMeshes; m++) {
+        const Trimesh &mesh = meshes[m];
+        const int baseIndex = (int)vertexOffsets[m];
+        std::copy(mesh.vertices.begin(), mesh.vertices.end(), vertices.begin() + vertexOffsets[m]);
+
+        const size_t nTris = mesh.indices.size() / 3;
+        for (size_t i = 0; i < nTris; i++) {
+            const size_t t = triangleOffsets[m] + i;
+            Triangle tri;
+            tri.indices.x = baseIndex + mesh.indices[i * 3 + 0];
+            tri.indices.y = baseIndex + mesh.indices[i * 3 + 1];
+            tri.indices.z = baseIndex + mesh.indices[i * 3 + 2];
+            tri.indices.w = meshJobs[m].materialID;
+            triangles[t] = tri;
+
+            indices[t * 3 + 0] = baseIndex + mesh.indices[i * 3 + 0];
+            indices[t * 3 + 1] = baseIndex + mesh.indices[i * 3 + 1];
+            indices[t * 3 + 2] = baseIndex + mesh.indices[i * 3 + 2];
+
+            if (meshJobs[m].emissive) {
+                const size_t l = lightOffsets[m] + i;
+                triLightIndices[t] = (float)l;
+                lights[l] = tri;
+            } else {
+                triLightIndices[t] = -1.0f;
+            }
+        }
+    }
+    Info("Meshes loaded: %d files, %d triangles, %.3f sec", numMeshes, (int)triangles.size(), meshTimer.count());
+
+    // Emitters are sampled proportionally to their power (area x luminance)
+    std::vector<double> lightWeights;
+    for (const auto &tri : lights) {
+        const glm::vec3 &v0 = vertices[(int)tri.indices.x].pos;
+        const glm::vec3 &v1 = vertices[(int)tri.indices.y].pos;
+        const glm::vec3 &v2 = vertices[(int)tri.indices.z].pos;
+        const glm::vec3 &e = materials[(int)tri.indices.w].emission;
+        const double area = 0.5 * glm::length(glm::cross(v1 - v0, v2 - v0));
+        const double luminance = 0.2126 * e.x + 0.7152 * e.y + 0.0722 * e.z;
+        lightWeights.push_back(area * luminance);
+    }
+    lightAlias.construct(lightWeights);
+
+    // Light BVH for many-light scenes
+    if (lightSampling == "bvh") {
+        std::vector<uint32_t> lightIndices;
+        for (const auto &tri : lights) {
+            lightIndices.push_back((uint32_t)tri.indices.x);
+            lightIndices.push_back((uint32_t)tri.indices.y);
+            lightIndices.push_back((uint32_t)tri.indices.z);
+        }
+        lightBVH.construct(vertices, lightIndices, lightWeights);
+        Info("Light BVH: %d nodes", (int)lightBVH.nodes.size());
+    }
+
+    // Construct BVH
+    bvh.construct(vertices, indices);
+}
+
+bool Scene::loadSnapshot(const std::string &filename, uint64_t key) {
+    if (!fs::exists(fs::path(filename.c_str()))) {
+        return false;
+    }
+
+    Timer timer;
+    timer.start();
+    MappedFile file;
+    try {
+        file.open(filename);
+    } catch (const std::runtime_error &e) {
+        Warn("%s", e.what());
+        return false;
+    }
+
+    const SnapshotHeader expected;
+    const size_t tableBytes = sizeof(SnapshotHeader) + SnapshotNumSections * sizeof(SnapshotSection);
+    if (file.size() < tableBytes) {
+        Warn("Scene snapshot is truncated: %s", filename.c_str());
+        return false;
+    }
+
+    const SnapshotHeader &header = *(const SnapshotHeader *)file.data();
+    if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version ||
+        header.numSections != SnapshotNumSections || header.key != key) {
+        Warn("Invalid scene snapshot: %s", filename.c_str());
+        return false;
+    }
+
+    const SnapshotSection *sections = (const SnapshotSection *)(file.data() + sizeof(SnapshotHeader));
+    const bool success = readSection(file, sections[SnapshotVertices], &vertices) &&
+                         readSection(file, sections[SnapshotIndices], &indices) &&
+                         readSection(file, sections[SnapshotTriangles], &triangles) &&
+                         readSection(file, sections[SnapshotLights], &lights) &&
+                         readSection(file, sections[SnapshotTriLightIndices], &triLightIndices) &&
+                         readSection(file, sections[SnapshotBVHNodes], &bvh.nodes) &&
+                         readSection(file, sections[SnapshotAliasEntries], &lightAlias.entries) &&
+                         readSection(file, sections[SnapshotLightBVHNodes], &lightBVH.nodes) &&
+                         readSection(file, sections[SnapshotLightLeaves], &lightBVH.leaves);
+    if (!success) {
+        // Drop the sections read so far, as the scene is rebuilt from the inputs. The light BVH in particular
+        // would otherwise survive when it is not rebuilt.
+        vertices.clear();
+        indices.clear();
+        triangles.clear();
+        lights.clear();
+        triLightIndices.clear();
+        bvh.nodes.clear();
+        lightAlias.entries.clear();
+        lightBVH.nodes.clear();
+        lightBVH.leaves.clear();
+        Warn("Scene snapshot is truncated: %s", filename.c_str());
+        return false;
+    }
+    lightAlias.total = header.lightPowerTotal;
+
+    Info("Scene snapshot loaded: %s (%.1f MB, %.3f sec)", filename.c_str(), file.size() / (1024.0 * 1024.0),
+         timer.count());
+    return true;
+}
+
+void Scene::saveSnapshot(const std::string &filename, uint64_t key) const {
+    SnapshotHeader header;
+    header.numSections = SnapshotNumSections;
+    header.key = key;
+    header.lightPowerTotal = lightAlias.total;
+
+    const std::pair<const void *, SnapshotSection> arrays[SnapshotNumSections] = {
+        { vertices.data(), { 0, vertices.size(), sizeof(Vertex) } },
+        { indices.data(), { 0, indices.size(), sizeof(uint32_t) } },
+        { triangles.data(), { 0, triangles.size(), sizeof(Triangle) } },
+        { lights.data(), { 0, lights.size(), sizeof(Triangle) } },
+        { triLightIndices.data(), { 0, triLightIndices.size(), sizeof(float) } },
+        { bvh.nodes.data(), { 0, bvh.nodes.size(), sizeof(BVHNode) } },
+        { lightAlias.entries.data(), { 0, lightAlias.entries.size(), sizeof(AliasEntry) } },
+        { lightBVH.nodes.data(), { 0, lightBVH.nodes.size(), sizeof(LightBVHNode) } },
+        { lightBVH.leaves.data(), { 0, lightBVH.leaves.size(), sizeof(float) } },
+    };
+
+    std::vector<SnapshotSection> sections(SnapshotNumSections);
+    uint64_t offset = sizeof(SnapshotHeader) + SnapshotNumSections * sizeof(SnapshotSection);
+    for (int i = 0; i < SnapshotNumSections; i++) {
+        sections[i] = arrays[i].second;
+        sections[i].offset = alignSnapshot(offset);
+        offset = sections[i].offset + sections[i].count * sections[i].stride;
+    }
+
+    // Write to a temporary file first not to leave a broken snapshot when interrupted
+    const fs::path filePath(filename.c_str());
+    const fs::path tempPath = fs::path((filename + ".tmp").c_str());
+    std::error_code err;
+    fs::create_directories(filePath.parent_path(), err);
+
+    std::ofstream writer(tempPath.string().c_str(), std::ios::binary);
+    if (writer.fail()) {
+        Warn("Failed to open file: %s", tempPath.string().c_str());
+        return;
+    }
+    writer.write((const char *)&header, sizeof(SnapshotHeader));
+    writer.write((const char *)sections.data(), sections.size() * sizeof(SnapshotSection));
+    for (int i = 0; i < SnapshotNumSections; i++) {
+        const std::vector<char> padding(sections[i].offset - (uint64_t)writer.tellp(), 0);
+        writer.write(padding.data(), padding.size());
+        writer.write((const char *)arrays[i].first, sections[i].count * sections[i].stride);
+    }
+    writer.close();
+
+    fs::rename(tempPath, filePath, err);
+    if (err) {
+        Warn("Failed to save scene snapshot: %s", filename.c_str());
+        return;
+    }
+    Info("Scene snapshot saved: %s", filename.c_str());
+}
+
+void Scene::packVolumes() {
+    // Sparse bricks keep the atlases of their own
+    bool sparse = false;
+    for (const auto &v : volumes) {
+        sparse = sparse || v.sparseDensity != nullptr;
+    }
+    if (sparse && volumes.size() > 1) {
+        FatalError("Sparse volumes cannot be combined with other media!");
+    }
+
+    // Each storage format has atlases of its own, so that a precise volume does not inflate the others.
+    // The atlases hold the precomputed emission unless a volume disables it.
+    std::vector<VolumeFormat> atlasFormats;
+    emissionVolume = !sparse;
+    for (auto &v : volumes) {
+        const auto it = std::find(atlasFormats.begin(), atlasFormats.end(), v.format);
+        v.atlas = (int)(it - atlasFormats.begin());
+        if (it == atlasFormats.end()) {
+            atlasFormats.push_back(v.format);
+        }
+        emissionVolume = emissionVolume && v.emission;
+    }
+
+    GLint maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxTextureSize);
+
+    size_t textureBytes = 0;
+    densityAtlasTex.clear();
+    temperatureAtlasTex.clear();
+    for (int a = 0; a < (int)atlasFormats.size() && !sparse; a++) {
+        const VolumeFormat format = atlasFormats[a];
+        const bool halfPrecision = format != VolumeFormat::Float32;
+
+        // Animated volumes have back regions to receive their next frames
+        std::vector<size_t> members;
+        std::vector<glm::ivec3> sizes, origins;
+        for (size_t i = 0; i < volumes.size(); i++) {
+            if (volumes[i].atlas != a) {
+                continue;
+            }
+            members.push_back(i);
+            sizes.push_back(volumes[i].size);
+            if (volumes[i].sequence) {
+                sizes.push_back(volumes[i].size);
+            }
+        }
+        const glm::ivec3 atlasSize = packAtlas(sizes, maxTextureSize, &origins);
+        if (atlasSize.x > maxTextureSize || atlasSize.y > maxTextureSize) {
+            FatalError("Volume atlas %d x %d x %d exceeds the maximum texture size %d!", atlasSize.x, atlasSize.y,
+                       atlasSize.z, maxTextureSize);
+        }
+
+        const VolumeEncoding atlasEncoding(format, 0.0f, 1.0f);
+        const GLenum emissionFormat = halfPrecision ? GL_RGB16F : GL_RGB32F;
+        densityAtlasTex.push_back(createAtlasTexture(atlasEncoding.internalFormat(), atlasSize));
+        temperatureAtlasTex.push_back(
+            createAtlasTexture(emissionVolume ? emissionFormat : atlasEncoding.internalFormat(), atlasSize));
+
+        const size_t voxels = (size_t)atlasSize.x * atlasSize.y * atlasSize.z;
+        const size_t emissionBytes = 3 * (halfPrecision ? sizeof(uint16_t) : sizeof(float));
+        textureBytes += voxels * atlasEncoding.bytesPerVoxel();
+        textureBytes += voxels * (emissionVolume ? emissionBytes : atlasEncoding.bytesPerVoxel());
+
+        for (size_t i = 0, k = 0; i < members.size(); i++) {
+            VolumeData &v = volumes[members[i]];
+            v.atlasOrigin = origins[k++];
+            if (v.sequence) {
+                v.backAtlasOrigin = origins[k++];
+            }
+
+            const Volume &density = *v.density;
+            v.densityEncoding = VolumeEncoding(format, density.minValue, density.maxValue);
+            uploadVolume(densityAtlasTex[a], v.atlasOrigin, density, GL_RED, v.densityEncoding.pixelType(),
+                         v.densityEncoding.bytesPerVoxel(), [&](const float *src, size_t count, void *dst) {
+                             v.densityEncoding.encode(src, count, density.channels, dst);
+                         });
+
+            const Volume &temperature = *v.temperature;
+            if (emissionVolume) {
+                v.emissionScale = uploadEmission(temperatureAtlasTex[a], v.atlasOrigin, temperature, 1.0e2f,
+                                                 halfPrecision);
+            } else {
+                v.temperatureEncoding = VolumeEncoding(format, temperature.minValue, temperature.maxValue);
+                uploadVolume(temperatureAtlasTex[a], v.atlasOrigin, temperature, GL_RED,
+                             v.temperatureEncoding.pixelType(), v.temperatureEncoding.bytesPerVoxel(),
+                             [&](const float *src, size_t count, void *dst) {
+                                 v.temperatureEncoding.encode(src, count, temperature.channels, dst);
+                             });
+            }
+        }
+    }
+    if (sparse) {
+        textureBytes += volumes[0].sparseDensity->textureBytes() + volumes[0].sparseTemperature->textureBytes();
+    }
+
+    // Majorant grids
+    std::vector<glm::ivec3> majorantSizes, majorantOrigins;
+    for (const auto &v : volumes) {
+        majorantSizes.push_back(v.majorantSize);
+        if (v.sequence) {
+            majorantSizes.push_back(v.majorantSize);
+        }
+    }
+    const glm::ivec3 majorantAtlasSize = packAtlas(majorantSizes, maxTextureSize, &majorantOrigins);
+    majorantAtlasTex = createAtlasTexture(GL_R32F, majorantAtlasSize);
+    textureBytes += (size_t)majorantAtlasSize.x * majorantAtlasSize.y * majorantAtlasSize.z * sizeof(float);
+
+    glBindTexture(GL_TEXTURE_3D, majorantAtlasTex);
+    for (size_t i = 0, k = 0; i < volumes.size(); i++) {
+        VolumeData &v = volumes[i];
+        Volume &majorant = *v.majorant;
+        v.majorantOrigin = majorantOrigins[k++];
+        if (v.sequence) {
+            v.backMajorantOrigin = majorantOrigins[k++];
+        }
+        const int numCells = majorant.size_x * majorant.size_y * majorant.size_z;
+
+        // Keep the majorants conservative against the rounding of reduced-precision formats
+        for (int c = 0; c < numCells; c++) {
+            if (majorant.data[c] > 0.0f) {
+                majorant.data[c] += v.densityEncoding.errorBound(majorant.data[c]);
+            }
+        }
+
+        glTexSubImage3D(GL_TEXTURE_3D, 0, v.majorantOrigin.x, v.majorantOrigin.y, v.majorantOrigin.z,
+                        majorant.size_x, majorant.size_y, majorant.size_z, GL_RED, GL_FLOAT, majorant.data);
+
+        // Ratio of the mean majorant to the global one (expected tentative collisions relative to a single majorant)
+        double sum = 0.0;
+        for (int c = 0; c < numCells; c++) {
+            sum += majorant.data[c];
+        }
+        Info("Majorant grid: %d x %d x %d, mean / max = %f", majorant.size_x, majorant.size_y, majorant.size_z,
+             v.maxValue > 0.0f ? sum / numCells / v.maxValue : 0.0);
+    }
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    // The payloads are on the GPU now, and the following frames are decoded in the background
+    for (auto &v : volumes) {
+        v.density.reset();
+        v.temperature.reset();
+        v.majorant.reset();
+        if (v.sequence) {
+            v.sequence->start(v.size, v.majorantCellSize, v.format, emissionVolume);
+        }
+    }
+    uploadVolumeDescriptors();
+
+    std::string formatNames;
+    for (const auto &format : atlasFormats) {
+        formatNames += (formatNames.empty() ? "" : ", ") + std::string(volumeFormatName(format));
+    }
+    Info("Volume atlases: %d volumes, %s, %.1f MB", (int)volumes.size(), formatNames.c_str(),
+         textureBytes / (1024.0 * 1024.0));
+}
+
+void Scene::uploadVolumeDescriptors() {
+    // Descriptors of the volumes (see "fetchVolume" in the shader)
+    std::vector<glm::vec4> descriptors;
+    for (const auto &v : volumes) {
+        descriptors.push_back(glm::vec4(v.bboxMin, v.maxValue));
+        descriptors.push_back(glm::vec4(v.bboxMax, v.emissionScale));
+        descriptors.push_back(glm::vec4(glm::vec3(v.atlasOrigin), (float)v.atlas));
+        descriptors.push_back(glm::vec4(glm::vec3(v.size), 0.0f));
+        descriptors.push_back(glm::vec4(glm::vec3(v.majorantOrigin), 0.0f));
+        descriptors.push_back(glm::vec4(glm::vec3(v.majorantSize), (float)v.majorantCellSize));
+        descriptors.push_back(glm::vec4(v.densityEncoding.scale, v.densityEncoding.offset,
+                                        v.temperatureEncoding.scale, v.temperatureEncoding.offset));
+    }
+
+    if (!volumeTexBuffer) {
+        volumeTexBuffer = std::make_shared<TextureBuffer>(descriptors.size() * sizeof(glm::vec4), GL_RGBA32F,
+                                                          GL_DYNAMIC_DRAW);
+    }
+    volumeTexBuffer->setData(descriptors.data());
+}
+
 }  // namespace glrt
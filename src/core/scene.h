@@ -8,8 +8,16 @@
 
 #include "api.h"
 #include "uncopyable.h"
+#include "shader_stage.h"
+#include "shader_program.h"
 #include "trimesh.h"
 #include "bvh.h"
+#include "alias_table.h"
+#include "light_bvh.h"
+#include "envmap.h"
+#include "sparse_volume.h"
+#include "volume_format.h"
+#include "volume_sequence.h"
 
 namespace glrt {
 
@@ -34,11 +42,29 @@ struct Material {
     glm::vec3 texIds = glm::vec3(0.0f);
 };
 
+//! Participating medium placed in the shared atlases of the scene
 struct VolumeData {
     glm::vec3 bboxMax, bboxMin;
     float maxValue = 0.0f;
-    GLuint densityTex = 0u;
-    GLuint temperatureTex = 0u;
+    float emissionScale = 1.0f;
+    glm::ivec3 size = glm::ivec3(0);
+    int atlas = 0;  //!< Index of the density and temperature atlases of "format"
+    glm::ivec3 atlasOrigin = glm::ivec3(0);  //!< First voxel in the atlases
+    glm::ivec3 majorantSize = glm::ivec3(1);
+    glm::ivec3 majorantOrigin = glm::ivec3(0);
+    int majorantCellSize = 8;
+    glm::ivec3 backAtlasOrigin = glm::ivec3(0);  //!< Regions receiving the next frame of "sequence"
+    glm::ivec3 backMajorantOrigin = glm::ivec3(0);
+    std::shared_ptr<VolumeSequence> sequence = nullptr;
+    VolumeFormat format = VolumeFormat::Float32;
+    bool emission = true;
+    std::shared_ptr<Volume> density = nullptr;  //!< Released once packed into the atlases
+    std::shared_ptr<Volume> temperature = nullptr;
+    std::shared_ptr<Volume> majorant = nullptr;
+    std::shared_ptr<SparseVolume> sparseDensity = nullptr;
+    std::shared_ptr<SparseVolume> sparseTemperature = nullptr;
+    VolumeEncoding densityEncoding;
+    VolumeEncoding temperatureEncoding;
 };
 
 class GLRT_API Scene : private Uncopyable {
@@ -49,26 +75,90 @@ public:
 
     void parse(const std::string &filename);
 
+    //! Macros to specialize the ray tracing shader for the materials and features in this scene
+    ShaderDefines shaderDefines() const;
+
+    //! Number of frames of the animated volumes (one for static scenes)
+    int animationFrames() const;
+    //! Upload the next frames of the animated volumes when they are decoded
+    void updateVolumes();
+    //! Switch the animated volumes to their next frames. Returns false if some of them are not uploaded yet
+    bool advanceVolumes();
+
+    //! Directory of the scene snapshots, which hold the processed geometry to skip mesh loading and BVH builds
+    static void setSnapshotCache(const std::string &dirname, BinaryCacheMode mode);
+
 private:
+    //! Mesh file of a shape, loaded once all the shapes are parsed
+    struct MeshJob {
+        std::string filename;
+        int materialID = 0;
+        bool emissive = false;
+        float weldTolerance = 0.0f;  //!< Negative to keep a vertex for each face corner
+    };
+
+    //! Load the meshes and build the BVH and the light sampling structures
+    void buildGeometry(const std::vector<MeshJob> &meshJobs);
+    bool loadSnapshot(const std::string &filename, uint64_t key);
+    void saveSnapshot(const std::string &filename, uint64_t key) const;
+
+    //! Pack the volumes into the shared atlases and upload their descriptors
+    void packVolumes();
+    void uploadVolumeDescriptors();
+
     int width, height;
     float apertureRadius, focalLength;
+    bool useDouble = false;
+    std::string lightSampling = "power";
+    std::string triangleSampling = "solidangle";
+    std::string directLighting = "nee";
+    bool guiding = false;
+    int guidingIterations = 6;
+    bool radianceCache = false;
+    int radianceCacheDepth = 1;
+    float radianceCacheCellSize = 0.0f;
+    std::string radianceCacheMode = "auto";
+    std::string russianRoulette = "throughput";
+    int maxSplit = 4;
+    bool mediumNEE = true;
+    std::string samplerType = "independent";
+    std::shared_ptr<Texture> blueNoiseTex;
+    bool adaptiveSampling = false;
+    int adaptiveMinSamples = 16;
+    float adaptiveThreshold = 0.01f;
+    std::shared_ptr<Envmap> envmap;
     glm::mat4 modelM, viewM, projM;
 
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
     std::vector<Triangle> triangles;
     std::vector<Triangle> lights;
+    std::vector<float> triLightIndices;
     std::vector<Material> materials;
 
     std::shared_ptr<TextureBuffer> vertTexBuffer;
     std::shared_ptr<TextureBuffer> triTexBuffer;
     std::shared_ptr<TextureBuffer> mtrlTexBuffer;
     std::shared_ptr<TextureBuffer> lightTexBuffer;
+    std::shared_ptr<TextureBuffer> triLightTexBuffer;
     std::shared_ptr<TextureBuffer> bvhTexBuffer;
+    std::shared_ptr<TextureBuffer> lightAliasTexBuffer;
+    std::shared_ptr<TextureBuffer> lightBVHTexBuffer;
+    std::shared_ptr<TextureBuffer> lightLeafTexBuffer;
 
     BVH bvh;
+    AliasTable lightAlias;
+    LightBVH lightBVH;
 
     std::vector<VolumeData> volumes;
+    std::vector<GLuint> densityAtlasTex;  //!< One for each storage format (see "VolumeData::atlas")
+    std::vector<GLuint> temperatureAtlasTex;  //!< Holds the precomputed emission with "emissionVolume"
+    GLuint majorantAtlasTex = 0u;
+    bool emissionVolume = false;
+    std::shared_ptr<TextureBuffer> volumeTexBuffer;
+
+    static std::string snapshotCacheDir;
+    static BinaryCacheMode snapshotCacheMode;
 
     friend class Window;
 };
@@ -0,0 +1,195 @@
+#define GLRT_API_EXPORT
+#include "sd_tree.h"
+
+#include <stack>
+#include <tuple>
+
+namespace glrt {
+
+namespace {
+
+glm::vec2 dirToCanonical(const glm::vec3 &dir) {
+    // Cylindrical mapping (cosine of polar angle, azimuth), which preserves area
+    const float cosTheta = std::max(-1.0f, std::min(dir.z, 1.0f));
+    float phi = std::atan2(dir.y, dir.x);
+    if (phi < 0.0f) {
+        phi += 2.0f * Pi;
+    }
+    const glm::vec2 p((cosTheta + 1.0f) * 0.5f, phi / (2.0f * Pi));
+    return glm::clamp(p, glm::vec2(0.0f), glm::vec2(1.0f - 1.0e-6f));
+}
+
+}  // anonymous namespace
+
+// ---------------------------------------------------------------------------------------------------------------------
+// DTree
+// ---------------------------------------------------------------------------------------------------------------------
+
+DTree::DTree()
+    : nodes_(1) {
+}
+
+void DTree::record(const glm::vec3 &dir, float weight) {
+    samples_ += 1;
+    if (!(weight > 0.0f) || std::isinf(weight)) {
+        return;
+    }
+
+    glm::vec2 p = dirToCanonical(dir);
+    int node = 0;
+    while (true) {
+        const int ix = p.x < 0.5f ? 0 : 1;
+        const int iy = p.y < 0.5f ? 0 : 1;
+        const int c = ix + 2 * iy;
+        nodes_[node].sums[c] += weight;
+        if (nodes_[node].children[c] == 0) {
+            break;
+        }
+
+        node = nodes_[node].children[c];
+        p = (p - glm::vec2((float)ix, (float)iy) * 0.5f) * 2.0f;
+    }
+}
+
+void DTree::build(const DTree &prev, float threshold, int maxDepth) {
+    nodes_.assign(1, Node());
+    samples_ = 0;
+
+    const float total = prev.total();
+    if (total <= 0.0f) {
+        return;
+    }
+
+    // (new node, old node or -1, energy of the node, depth)
+    std::stack<std::tuple<int, int, float, int>> stack;
+    stack.push(std::make_tuple(0, 0, total, 1));
+    while (!stack.empty()) {
+        int newId, oldId, depth;
+        float energy;
+        std::tie(newId, oldId, energy, depth) = stack.top();
+        stack.pop();
+
+        for (int c = 0; c < 4; c++) {
+            const float e = oldId >= 0 ? prev.nodes_[oldId].sums[c] : energy * 0.25f;
+            if (depth >= maxDepth || e / total <= threshold) {
+                continue;
+            }
+
+            const int childId = (int)nodes_.size();
+            nodes_.push_back(Node());
+            nodes_[newId].children[c] = childId;
+
+            const int oldChild = oldId >= 0 && prev.nodes_[oldId].children[c] != 0 ? prev.nodes_[oldId].children[c] : -1;
+            stack.push(std::make_tuple(childId, oldChild, e, depth + 1));
+        }
+    }
+}
+
+float DTree::total() const {
+    const auto &s = nodes_[0].sums;
+    return s[0] + s[1] + s[2] + s[3];
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// SDTree
+// ---------------------------------------------------------------------------------------------------------------------
+
+SDTree::SDTree(const glm::vec3 &bboxMin, const glm::vec3 &bboxMax) {
+    // Cubic bounds make the alternating midpoint splits isotropic
+    const glm::vec3 center = (bboxMin + bboxMax) * 0.5f;
+    const glm::vec3 extent = bboxMax - bboxMin;
+    const float size = std::max(extent.x, std::max(extent.y, extent.z)) * 0.5f * 1.01f + 1.0e-4f;
+    bboxMin_ = center - glm::vec3(size);
+    bboxMax_ = center + glm::vec3(size);
+
+    nodes.resize(1);
+    upload();
+}
+
+void SDTree::record(const glm::vec3 &pos, const glm::vec3 &dir, float weight) {
+    glm::vec3 bmin = bboxMin_;
+    glm::vec3 bmax = bboxMax_;
+    int node = 0;
+    while (nodes[node].child != 0) {
+        const int axis = nodes[node].axis;
+        const float mid = 0.5f * (bmin[axis] + bmax[axis]);
+        if (pos[axis] < mid) {
+            node = nodes[node].child;
+            bmax[axis] = mid;
+        } else {
+            node = nodes[node].child + 1;
+            bmin[axis] = mid;
+        }
+    }
+    nodes[node].building.record(dir, weight);
+}
+
+void SDTree::refine(int iter) {
+    // Subdivide the spatial leaves which collected many samples
+    const int maxSamples = (int)(12000.0 * std::sqrt(std::pow(2.0, iter)));
+    for (int i = 0; i < (int)nodes.size(); i++) {
+        if (nodes[i].child != 0) {
+            continue;
+        }
+
+        nodes[i].sampling = nodes[i].building;
+        if (nodes[i].sampling.samples() > maxSamples && nodes.size() < (1 << 20)) {
+            DTree dtree = nodes[i].sampling;
+            dtree.halveSamples();
+
+            const int child = (int)nodes.size();
+            const int axis = nodes[i].axis;
+            nodes[i].child = child;
+            for (int k = 0; k < 2; k++) {
+                Node n;
+                n.axis = (axis + 1) % 3;
+                n.sampling = dtree;
+                nodes.push_back(n);
+            }
+            // Children are visited later in this loop, and may be subdivided again
+            nodes[child].building = dtree;
+            nodes[child + 1].building = dtree;
+            nodes[i].sampling = DTree();
+            nodes[i].building = DTree();
+        }
+    }
+
+    // Adapt the directional trees to the learned distributions
+    for (auto &n : nodes) {
+        if (n.child == 0) {
+            n.building.build(n.sampling, 0.01f, 20);
+        }
+    }
+}
+
+void SDTree::upload() {
+    std::vector<SDTreeGPUNode> spatial(nodes.size());
+    std::vector<DTreeGPUNode> directional;
+    for (int i = 0; i < (int)nodes.size(); i++) {
+        const Node &n = nodes[i];
+        if (n.child != 0) {
+            spatial[i].values = glm::vec4((float)n.axis, (float)n.child, 0.0f, 0.0f);
+            continue;
+        }
+
+        const int offset = (int)directional.size();
+        spatial[i].values = glm::vec4(-1.0f, 0.0f, (float)offset, 0.0f);
+        for (const auto &dn : n.sampling.nodes()) {
+            DTreeGPUNode g;
+            g.sums = glm::vec4(dn.sums[0], dn.sums[1], dn.sums[2], dn.sums[3]);
+            for (int c = 0; c < 4; c++) {
+                g.children[c] = dn.children[c] != 0 ? (float)(offset + dn.children[c]) : 0.0f;
+            }
+            directional.push_back(g);
+        }
+    }
+
+    spatialBuffer_ = std::make_shared<TextureBuffer>(spatial.size() * sizeof(SDTreeGPUNode), GL_RGBA32F,
+                                                     GL_STATIC_DRAW);
+    spatialBuffer_->setData(spatial.data());
+    directionalBuffer_ = std::make_shared<TextureBuffer>(directional.size() * sizeof(DTreeGPUNode), GL_RGBA32F,
+                                                         GL_STATIC_DRAW);
+    directionalBuffer_->setData(directional.data());
+}
+
+}  // namespace glrt
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "api.h"
+#include "common.h"
+#include "texture_buffer.h"
+
+namespace glrt {
+
+//! Quadtree over the cylindrical mapping of the unit sphere (directional part of SD-tree)
+class GLRT_API DTree {
+public:
+    struct Node {
+        std::array<float, 4> sums = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+        std::array<int, 4> children = { { 0, 0, 0, 0 } };  // 0 means leaf
+    };
+
+    DTree();
+
+    void record(const glm::vec3 &dir, float weight);
+
+    //! Structure adapted to the energy of "prev", and statistics are cleared
+    void build(const DTree &prev, float threshold, int maxDepth);
+
+    float total() const;
+    int samples() const { return samples_; }
+    void halveSamples() { samples_ /= 2; }
+
+    const std::vector<Node> &nodes() const { return nodes_; }
+
+private:
+    std::vector<Node> nodes_;
+    int samples_ = 0;
+};
+
+struct SDTreeGPUNode {
+    glm::vec4 values;  // axis (-1 for a leaf), first child, directional root, unused
+};
+
+struct DTreeGPUNode {
+    glm::vec4 sums;
+    glm::vec4 children;
+};
+
+//! Spatial-directional tree for path guiding
+//! See "Practical Path Guiding for Efficient Light-Transport Simulation" by T. Muller et al., 2017.
+class GLRT_API SDTree {
+public:
+    SDTree(const glm::vec3 &bboxMin, const glm::vec3 &bboxMax);
+
+    void record(const glm::vec3 &pos, const glm::vec3 &dir, float weight);
+
+    //! Finish the learning iteration "iter", and refine the spatial and directional trees
+    void refine(int iter);
+
+    //! Transfer the sampling distribution to the texture buffers
+    void upload();
+
+    glm::vec3 bboxMin() const { return bboxMin_; }
+    glm::vec3 bboxMax() const { return bboxMax_; }
+    std::shared_ptr<TextureBuffer> spatialBuffer() const { return spatialBuffer_; }
+    std::shared_ptr<TextureBuffer> directionalBuffer() const { return directionalBuffer_; }
+
+private:
+    struct Node {
+        int axis = 0;
+        int child = 0;  // first child (the second is next), 0 means leaf
+        DTree sampling;
+        DTree building;
+    };
+
+    glm::vec3 bboxMin_, bboxMax_;
+    std::vector<Node> nodes;
+    std::shared_ptr<TextureBuffer> spatialBuffer_ = nullptr;
+    std::shared_ptr<TextureBuffer> directionalBuffer_ = nullptr;
+};
+
+}  // namespace glrt
@@ -1,9 +1,30 @@
 #define GLRT_API_EXPORT
 #include "shader_program.h"
 
+#include <cstring>
+#include <fstream>
+#include <experimental/filesystem>
+
 #include <glm/gtc/type_ptr.hpp>
 
 #include "common.h"
+#include "hash.h"
+
+namespace fs = std::experimental::filesystem;
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Program binary file
+// ---------------------------------------------------------------------------------------------------------------------
+
+struct ProgramBinaryHeader {
+    char magic[8] = { 'G', 'L', 'R', 'T', 'P', 'R', 'G', '\0' };
+    uint32_t version = 1;
+    uint32_t format = 0;
+    uint64_t length = 0;
+};
+
+std::string ShaderProgram::cacheDir = "";
+BinaryCacheMode ShaderProgram::cacheMode = BinaryCacheMode::Disabled;
 
 // ---------------------------------------------------------------------------------------------------------------------
 // PUBLIC methods
@@ -23,6 +44,9 @@ void ShaderProgram::attachShader(const ShaderStage &shader) { glAttachShader(pro
 
 void ShaderProgram::link() {
     // Link
+    if (binaryCacheAvailable()) {
+        glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
     glLinkProgram(programId);
 
     // Check status
@@ -50,6 +74,125 @@ void ShaderProgram::link() {
     glUseProgram(0);
 }
 
+void ShaderProgram::build(const std::vector<std::pair<std::string, ShaderType>> &files,
+                          const ShaderDefines &defines) {
+    if (programId == 0) {
+        create();
+    }
+
+    // Sources are loaded up front because they are part of the cache key
+    std::vector<std::string> sources;
+    uint64_t key = glrt::hashString(ShaderStage::definesKey(defines));
+    for (const auto &file : files) {
+        sources.push_back(ShaderStage::preprocess(ShaderStage::loadSource(file.first), defines));
+        key = glrt::hashCombine(key, glrt::hashString(sources.back()));
+        key = glrt::hashCombine(key, (uint64_t)file.second);
+    }
+
+    // Binaries are valid only for the driver which produced them
+    const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+    for (GLenum name : driverStrings) {
+        const char *str = (const char *)glGetString(name);
+        key = glrt::hashCombine(key, glrt::hashString(str ? str : ""));
+    }
+
+    std::string cacheFile = "";
+    if (binaryCacheAvailable()) {
+        cacheFile = (fs::path(cacheDir) / fs::path(glrt::hashToString(key) + ".bin")).string();
+        if (cacheMode == BinaryCacheMode::ReadWrite || cacheMode == BinaryCacheMode::ReadOnly) {
+            if (loadBinary(cacheFile)) {
+                Info("Program binary loaded: %s", cacheFile.c_str());
+                return;
+            }
+        }
+    }
+
+    // Fallback to compilation from source
+    for (size_t i = 0; i < files.size(); i++) {
+        attachShader(ShaderStage::fromSource(sources[i], files[i].second));
+    }
+    link();
+
+    if (!cacheFile.empty() &&
+        (cacheMode == BinaryCacheMode::ReadWrite || cacheMode == BinaryCacheMode::Rebuild)) {
+        saveBinary(cacheFile);
+    }
+}
+
+bool ShaderProgram::loadBinary(const std::string &filename) {
+    std::ifstream reader(filename.c_str(), std::ios::binary);
+    if (reader.fail()) {
+        return false;
+    }
+
+    const ProgramBinaryHeader expected;
+    ProgramBinaryHeader header;
+    reader.read((char *)&header, sizeof(ProgramBinaryHeader));
+    if (reader.fail() || std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+        header.version != expected.version || header.length == 0) {
+        Warn("Invalid program binary: %s", filename.c_str());
+        return false;
+    }
+
+    std::vector<char> binary(header.length);
+    reader.read(binary.data(), (std::streamsize)header.length);
+    if (reader.fail()) {
+        Warn("Program binary is truncated: %s", filename.c_str());
+        return false;
+    }
+
+    // The driver rejects binaries of other versions, which shows up as a link failure
+    glProgramBinary(programId, (GLenum)header.format, binary.data(), (GLsizei)header.length);
+
+    GLint linkStatus;
+    glGetProgramiv(programId, GL_LINK_STATUS, &linkStatus);
+    if (linkStatus == GL_FALSE) {
+        Warn("Program binary is rejected by the driver: %s", filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void ShaderProgram::saveBinary(const std::string &filename) const {
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        Warn("Program binary is not available!");
+        return;
+    }
+
+    GLenum format;
+    std::vector<char> binary(length);
+    glGetProgramBinary(programId, length, nullptr, &format, binary.data());
+
+    ProgramBinaryHeader header;
+    header.format = (uint32_t)format;
+    header.length = (uint64_t)length;
+
+    // Write to a temporary file first not to leave a broken binary when interrupted
+    const fs::path filePath(filename.c_str());
+    const fs::path tempPath = fs::path((filename + ".tmp").c_str());
+    std::error_code err;
+    fs::create_directories(filePath.parent_path(), err);
+
+    std::ofstream writer(tempPath.string().c_str(), std::ios::binary);
+    if (writer.fail()) {
+        Warn("Failed to open file: %s", tempPath.string().c_str());
+        return;
+    }
+    writer.write((const char *)&header, sizeof(ProgramBinaryHeader));
+    writer.write(binary.data(), length);
+    writer.close();
+
+    fs::rename(tempPath, filePath, err);
+    if (err) {
+        Warn("Failed to save program binary: %s", filename.c_str());
+        return;
+    }
+    Info("Program binary saved: %s", filename.c_str());
+}
+
 void ShaderProgram::start() const { glUseProgram(programId); }
 
 void ShaderProgram::end() const { glUseProgram(0); }
@@ -155,6 +298,22 @@ void ShaderProgram::setMatrix4x4(const std::string &name, const glm::mat4 &m) {
     }
 }
 
+void ShaderProgram::setBinaryCache(const std::string &dirname, BinaryCacheMode mode) {
+    cacheDir = dirname;
+    cacheMode = mode;
+}
+
 // ---------------------------------------------------------------------------------------------------------------------
 // PRIVATE methods
 // ---------------------------------------------------------------------------------------------------------------------
+
+bool ShaderProgram::binaryCacheAvailable() {
+    if (cacheMode == BinaryCacheMode::Disabled || cacheDir.empty()) {
+        return false;
+    }
+
+    // Some drivers do not support any binary formats
+    GLint numFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+    return numFormats > 0;
+}
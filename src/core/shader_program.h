@@ -7,11 +7,21 @@
 
 #include <glm/glm.hpp>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "api.h"
 #include "common.h"
 #include "shader_stage.h"
 
+//! Policy for the on-disk cache of linked program binaries
+enum class BinaryCacheMode : int {
+    Disabled,   //!< Always compile from source
+    ReadWrite,  //!< Load a matching binary if any, otherwise compile and store it
+    ReadOnly,   //!< Load a matching binary if any, but never write new ones
+    Rebuild     //!< Ignore existing binaries and overwrite them with fresh ones
+};
+
 /**
  *ShaderProgram wraps shader stages into a program.
  */
@@ -24,6 +34,10 @@ public:
     void create();
     void attachShader(const ShaderStage &shader);
     void link();
+    void build(const std::vector<std::pair<std::string, ShaderType>> &files,
+               const ShaderDefines &defines = ShaderDefines());
+    bool loadBinary(const std::string &filename);
+    void saveBinary(const std::string &filename) const;
     void start() const;
     void end() const;
 
@@ -43,9 +57,17 @@ public:
     void setUniform4fv(const std::string &name, const glm::vec4 *v, size_t size);
     void setMatrix4x4(const std::string &name, const glm::mat4 &m);
 
+    static void setBinaryCache(const std::string &dirname, BinaryCacheMode mode);
+
 private:
+    // PRIVATE methods
+    static bool binaryCacheAvailable();
+
     // PRIVATE parameters
     GLuint programId = 0;
+
+    static std::string cacheDir;
+    static BinaryCacheMode cacheMode;
 };
 
 #endif  // SHADER_PROGRAM_H
@@ -95,15 +95,34 @@ ShaderStage::~ShaderStage() {
     }
 }
 
-ShaderStage ShaderStage::fromFile(const std::string &filename, ShaderType type) {
+ShaderStage ShaderStage::fromFile(const std::string &filename, ShaderType type, const ShaderDefines &defines) {
+    ShaderStage shader;
+    shader.compile(preprocess(loadSource(filename), defines), type);
+    return std::move(shader);
+}
+
+ShaderStage ShaderStage::fromFile(const std::string &dirname, const std::string &filename, ShaderType type,
+                                  const ShaderDefines &defines) {
+    ShaderStage shader;
+    shader.compile(preprocess(loadSource(dirname, filename), defines), type);
+    return std::move(shader);
+}
+
+ShaderStage ShaderStage::fromSource(const std::string &source, ShaderType type, const ShaderDefines &defines) {
+    ShaderStage shader;
+    shader.compile(preprocess(source, defines), type);
+    return std::move(shader);
+}
+
+std::string ShaderStage::loadSource(const std::string &filename) {
     // Full source file path
     auto &parser = ArgumentParser::getInstance();
     const std::string appPath = parser.getExecutablePath();
     const std::string shaderDir = fs::canonical(fs::path(appPath.c_str()).parent_path() / fs::path("../shaders")).string();
-    return ShaderStage::fromFile(shaderDir, filename, type);
+    return ShaderStage::loadSource(shaderDir, filename);
 }
 
-ShaderStage ShaderStage::fromFile(const std::string &dirname, const std::string &filename, ShaderType type) {
+std::string ShaderStage::loadSource(const std::string &dirname, const std::string &filename) {
     // Load source file
     const std::string shaderFile = fs::absolute(fs::path(dirname) / fs::path(filename.c_str())).string();
     std::ifstream reader(shaderFile.c_str());
@@ -118,17 +137,40 @@ ShaderStage ShaderStage::fromFile(const std::string &dirname, const std::string
     code.assign(std::istreambuf_iterator<char>(reader), std::istreambuf_iterator<char>());
     reader.close();
 
-    // Compile
-    ShaderStage shader;
-    shader.compile(code, type);
+    return code;
+}
 
-    return std::move(shader);
+std::string ShaderStage::preprocess(const std::string &source, const ShaderDefines &defines) {
+    if (defines.empty()) {
+        return source;
+    }
+
+    std::string block;
+    for (const auto &it : defines) {
+        block += "#define " + it.first + " " + it.second + "\n";
+    }
+
+    // GLSL requires "#version" to be the first directive, so macros go right after it.
+    const size_t versionPos = source.find("#version");
+    if (versionPos == std::string::npos) {
+        return block + source;
+    }
+
+    const size_t lineEnd = source.find('\n', versionPos);
+    if (lineEnd == std::string::npos) {
+        return source + "\n" + block;
+    }
+
+    return source.substr(0, lineEnd + 1) + block + source.substr(lineEnd + 1);
 }
 
-ShaderStage ShaderStage::fromSource(const std::string &source, ShaderType type) {
-    ShaderStage shader;
-    shader.compile(source, type);
-    return std::move(shader);
+std::string ShaderStage::definesKey(const ShaderDefines &defines) {
+    // std::map is ordered, so the same set of macros always gives the same key.
+    std::string key;
+    for (const auto &it : defines) {
+        key += it.first + "=" + it.second + ";";
+    }
+    return key;
 }
 
 void ShaderStage::compile(const std::string &source, ShaderType type) {
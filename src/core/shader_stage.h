@@ -5,6 +5,7 @@
 #ifndef SHADER_STAGE_H
 #define SHADER_STAGE_H
 
+#include <map>
 #include <string>
 
 #include "api.h"
@@ -20,6 +21,9 @@ enum class ShaderType : int {
     Compute = GL_COMPUTE_SHADER
 };
 
+//! Preprocessor macros (name -> value) which are injected right after the "#version" directive.
+using ShaderDefines = std::map<std::string, std::string>;
+
 //! ShaderStage manages the process in each shader stage.
 class GLRT_API ShaderStage {
 public:
@@ -28,9 +32,16 @@ public:
     ShaderStage &operator=(ShaderStage &&shader) noexcept;
     virtual ~ShaderStage();
 
-    static ShaderStage fromFile(const std::string &dirname, const std::string &filename, ShaderType type);
-    static ShaderStage fromFile(const std::string &filename, ShaderType type);
-    static ShaderStage fromSource(const std::string &source, ShaderType type);
+    static ShaderStage fromFile(const std::string &dirname, const std::string &filename, ShaderType type,
+                                const ShaderDefines &defines = ShaderDefines());
+    static ShaderStage fromFile(const std::string &filename, ShaderType type,
+                                const ShaderDefines &defines = ShaderDefines());
+    static ShaderStage fromSource(const std::string &source, ShaderType type,
+                                  const ShaderDefines &defines = ShaderDefines());
+    static std::string loadSource(const std::string &dirname, const std::string &filename);
+    static std::string loadSource(const std::string &filename);
+    static std::string preprocess(const std::string &source, const ShaderDefines &defines);
+    static std::string definesKey(const ShaderDefines &defines);
     void compile(const std::string &source, ShaderType type);
 
     inline GLuint operator()() const { return shaderId; }
@@ -0,0 +1,288 @@
+#define GLRT_API_EXPORT
+#include "sparse_volume.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+namespace glrt {
+
+SparseVolume::SparseVolume() {}
+
+SparseVolume::~SparseVolume() { release(); }
+
+void SparseVolume::build(const Volume &volume, int brickSize, float threshold) {
+    bboxMin_ = volume.bboxMin;
+    bboxMax_ = volume.bboxMax;
+    const glm::ivec3 size(volume.size_x, volume.size_y, volume.size_z);
+    build(size, brickSize, threshold, [&](int z, float *slice) {
+        for (int i = 0; i < size.x * size.y; i++) {
+            slice[i] = volume.data[(z * size.x * size.y + i) * volume.channels];
+        }
+    });
+}
+
+void SparseVolume::convert(const std::string &filename, int brickSize, float threshold) {
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        throw std::runtime_error("Failed to open file: " + filename);
+    }
+
+    // Same header as "Volume::load"
+    char header[4] = {0};
+    fread(header, sizeof(char), 3, fp);
+    if (std::strcmp(header, "VOL") != 0) {
+        fclose(fp);
+        throw std::runtime_error("Invalid indetifier: " + std::string(header));
+    }
+
+    char version;
+    int identifier;
+    fread(&version, sizeof(char), 1, fp);
+    fread(&identifier, sizeof(int), 1, fp);
+    if (version != 3 || identifier != 1) {
+        fclose(fp);
+        throw std::runtime_error("Currently support only version 3 with float32 types!");
+    }
+
+    glm::ivec3 size;
+    int channels;
+    fread(&size.x, sizeof(int), 1, fp);
+    fread(&size.y, sizeof(int), 1, fp);
+    fread(&size.z, sizeof(int), 1, fp);
+    fread(&channels, sizeof(int), 1, fp);
+    fread(&bboxMin_, sizeof(float), 3, fp);
+    fread(&bboxMax_, sizeof(float), 3, fp);
+    const long dataOffset = ftell(fp);
+
+    // Only one slice of the dense volume is in memory at a time
+    std::vector<float> buffer((size_t)size.x * size.y * channels);
+    build(size, brickSize, threshold, [&](int z, float *slice) {
+        const long offset = dataOffset + (long)z * (long)buffer.size() * (long)sizeof(float);
+        fseek(fp, offset, SEEK_SET);
+        if (fread(buffer.data(), sizeof(float), buffer.size(), fp) != buffer.size()) {
+            fclose(fp);
+            throw std::runtime_error("Unexpected end of file: " + filename);
+        }
+        for (int i = 0; i < size.x * size.y; i++) {
+            slice[i] = buffer[i * channels];
+        }
+    });
+
+    fclose(fp);
+}
+
+void SparseVolume::build(const glm::ivec3 &size, int brickSize, float threshold, const SliceReader &readSlice) {
+    release();
+    size_ = size;
+    brickSize_ = std::max(1, brickSize);
+    gridSize_ = (size + glm::ivec3(brickSize_ - 1)) / glm::ivec3(brickSize_);
+    maxValue_ = 0.0f;
+    indirection.assign((size_t)gridSize_.x * gridSize_.y * gridSize_.z, -1);
+    bricks.clear();
+    brickMax.clear();
+
+    // Slices of one brick layer with the apron (clamped at the volume boundary)
+    const int B = brickSize_;
+    const int A = B + 2;
+    const int sliceSize = size.x * size.y;
+    std::vector<float> slices((size_t)A * sliceSize);
+    std::vector<float> brick(A * A * A);
+
+    for (int bz = 0; bz < gridSize_.z; bz++) {
+        for (int k = 0; k < A; k++) {
+            const int z = std::min(std::max(bz * B + k - 1, 0), size.z - 1);
+            readSlice(z, &slices[(size_t)k * sliceSize]);
+        }
+
+        for (int by = 0; by < gridSize_.y; by++) {
+            for (int bx = 0; bx < gridSize_.x; bx++) {
+                float maxValue = 0.0f;
+                for (int k = 0; k < A; k++) {
+                    for (int j = 0; j < A; j++) {
+                        const int y = std::min(std::max(by * B + j - 1, 0), size.y - 1);
+                        for (int i = 0; i < A; i++) {
+                            const int x = std::min(std::max(bx * B + i - 1, 0), size.x - 1);
+                            const float v = slices[(size_t)k * sliceSize + y * size.x + x];
+                            brick[(k * A + j) * A + i] = v;
+                            maxValue = std::max(maxValue, v);
+                        }
+                    }
+                }
+
+                if (maxValue > threshold) {
+                    indirection[(bz * gridSize_.y + by) * gridSize_.x + bx] = (int)brickMax.size();
+                    bricks.insert(bricks.end(), brick.begin(), brick.end());
+                    brickMax.push_back(maxValue);
+                    maxValue_ = std::max(maxValue_, maxValue);
+                }
+            }
+        }
+    }
+
+    Info("Sparse volume: %d / %d bricks, %.1f MB (dense: %.1f MB)", numBricks(), (int)indirection.size(),
+         memoryBytes() / (1024.0 * 1024.0), (double)size.x * size.y * size.z * sizeof(float) / (1024.0 * 1024.0));
+}
+
+void SparseVolume::load(const std::string &filename) {
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        throw std::runtime_error("Failed to open file: " + filename);
+    }
+
+    char header[4] = {0};
+    fread(header, sizeof(char), 3, fp);
+    if (std::strcmp(header, "SVL") != 0) {
+        fclose(fp);
+        throw std::runtime_error("Invalid indetifier: " + std::string(header));
+    }
+
+    char version;
+    fread(&version, sizeof(char), 1, fp);
+    if (version != 1) {
+        fclose(fp);
+        throw std::runtime_error("Invalid version: " + std::to_string((int)version));
+    }
+
+    release();
+    int count;
+    fread(&size_, sizeof(int), 3, fp);
+    fread(&brickSize_, sizeof(int), 1, fp);
+    fread(&bboxMin_, sizeof(float), 3, fp);
+    fread(&bboxMax_, sizeof(float), 3, fp);
+    fread(&count, sizeof(int), 1, fp);
+    gridSize_ = (size_ + glm::ivec3(brickSize_ - 1)) / glm::ivec3(brickSize_);
+
+    const int A = brickSize_ + 2;
+    indirection.resize((size_t)gridSize_.x * gridSize_.y * gridSize_.z);
+    bricks.resize((size_t)count * A * A * A);
+    brickMax.resize(count);
+    fread(indirection.data(), sizeof(int), indirection.size(), fp);
+    fread(brickMax.data(), sizeof(float), brickMax.size(), fp);
+    if (fread(bricks.data(), sizeof(float), bricks.size(), fp) != bricks.size()) {
+        fclose(fp);
+        throw std::runtime_error("Unexpected end of file: " + filename);
+    }
+    fclose(fp);
+
+    maxValue_ = 0.0f;
+    for (float v : brickMax) {
+        maxValue_ = std::max(maxValue_, v);
+    }
+}
+
+void SparseVolume::save(const std::string &filename) const {
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        throw std::runtime_error("Failed to open file: " + filename);
+    }
+
+    const char *header = "SVL";
+    fwrite(header, sizeof(char), 3, fp);
+
+    const char version = 1;
+    fwrite(&version, sizeof(char), 1, fp);
+
+    const int count = numBricks();
+    fwrite(&size_, sizeof(int), 3, fp);
+    fwrite(&brickSize_, sizeof(int), 1, fp);
+    fwrite(&bboxMin_, sizeof(float), 3, fp);
+    fwrite(&bboxMax_, sizeof(float), 3, fp);
+    fwrite(&count, sizeof(int), 1, fp);
+
+    fwrite(indirection.data(), sizeof(int), indirection.size(), fp);
+    fwrite(brickMax.data(), sizeof(float), brickMax.size(), fp);
+    fwrite(bricks.data(), sizeof(float), bricks.size(), fp);
+
+    fclose(fp);
+}
+
+void SparseVolume::upload(const VolumeEncoding &encoding) {
+    release();
+
+    // Atlas of bricks within the maximum size of 3D textures
+    const int A = brickSize_ + 2;
+    GLint maxSize;
+    glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxSize);
+    const int count = std::max(numBricks(), 1);
+    const int perAxis = std::max(1, (int)maxSize / A);
+    atlasBricks_.x = std::min(count, perAxis);
+    atlasBricks_.y = std::min((count + atlasBricks_.x - 1) / atlasBricks_.x, perAxis);
+    atlasBricks_.z = (count + atlasBricks_.x * atlasBricks_.y - 1) / (atlasBricks_.x * atlasBricks_.y);
+    if (atlasBricks_.z > perAxis) {
+        FatalError("Too many bricks for a brick atlas: %d", count);
+    }
+
+    glGenTextures(1, &indirectionTexId);
+    glBindTexture(GL_TEXTURE_3D, indirectionTexId);
+    glTexStorage3D(GL_TEXTURE_3D, 1, GL_R32I, gridSize_.x, gridSize_.y, gridSize_.z);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, gridSize_.x, gridSize_.y, gridSize_.z, GL_RED_INTEGER, GL_INT,
+                    indirection.data());
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // Each brick is encoded and copied into its slot
+    glGenTextures(1, &atlasTexId);
+    glBindTexture(GL_TEXTURE_3D, atlasTexId);
+    glTexStorage3D(GL_TEXTURE_3D, 1, encoding.internalFormat(), atlasBricks_.x * A, atlasBricks_.y * A,
+                   atlasBricks_.z * A);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    std::vector<char> encoded(A * A * A * encoding.bytesPerVoxel());
+    for (int b = 0; b < numBricks(); b++) {
+        const int sx = b % atlasBricks_.x;
+        const int sy = (b / atlasBricks_.x) % atlasBricks_.y;
+        const int sz = b / (atlasBricks_.x * atlasBricks_.y);
+        encoding.encode(&bricks[(size_t)b * A * A * A], A * A * A, 1, encoded.data());
+        glTexSubImage3D(GL_TEXTURE_3D, 0, sx * A, sy * A, sz * A, A, A, A, GL_RED, encoding.pixelType(),
+                        encoded.data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    textureBytes_ = indirection.size() * sizeof(int) +
+                    (size_t)atlasBricks_.x * atlasBricks_.y * atlasBricks_.z * A * A * A * encoding.bytesPerVoxel();
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void SparseVolume::bind(GLuint indirectionUnit, GLuint atlasUnit) const {
+    glActiveTexture(GL_TEXTURE0 + indirectionUnit);
+    glBindTexture(GL_TEXTURE_3D, indirectionTexId);
+    glActiveTexture(GL_TEXTURE0 + atlasUnit);
+    glBindTexture(GL_TEXTURE_3D, atlasTexId);
+}
+
+Volume SparseVolume::majorantGrid() const {
+    Volume grid(gridSize_.x, gridSize_.y, gridSize_.z, 1);
+    grid.range(bboxMin_, bboxMax_);
+    for (size_t i = 0; i < indirection.size(); i++) {
+        grid.data[i] = indirection[i] >= 0 ? brickMax[indirection[i]] : 0.0f;
+    }
+    grid.maxValue = maxValue_;
+    return grid;
+}
+
+size_t SparseVolume::textureBytes() const {
+    return textureBytes_;
+}
+
+size_t SparseVolume::memoryBytes() const {
+    return indirection.size() * sizeof(int) + bricks.size() * sizeof(float);
+}
+
+void SparseVolume::release() {
+    if (indirectionTexId != 0) {
+        glDeleteTextures(1, &indirectionTexId);
+        indirectionTexId = 0;
+    }
+
+    if (atlasTexId != 0) {
+        glDeleteTextures(1, &atlasTexId);
+        atlasTexId = 0;
+    }
+}
+
+}  // namespace glrt
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <glm/glm.hpp>
+
+#include "api.h"
+#include "common.h"
+#include "uncopyable.h"
+#include "volume.h"
+#include "volume_format.h"
+
+namespace glrt {
+
+//! Sparse volume made of fixed-size bricks. Only the bricks with a voxel above the threshold are stored,
+//! and each of them has a one-voxel apron so that trilinear lookups in the atlas match the dense volume.
+//! The indirection grid stores the brick index in the atlas, or -1 for empty bricks.
+class GLRT_API SparseVolume : private Uncopyable {
+public:
+    SparseVolume();
+    virtual ~SparseVolume();
+
+    //! Build from a dense volume (the first channel is used)
+    void build(const Volume &volume, int brickSize = 8, float threshold = 0.0f);
+    //! Build from a dense "*.vol" file, reading only a few slices at a time
+    void convert(const std::string &filename, int brickSize = 8, float threshold = 0.0f);
+
+    void load(const std::string &filename);
+    void save(const std::string &filename) const;
+
+    //! Upload the indirection grid (R32I) and the brick atlas (stored with "encoding") as 3D textures
+    void upload(const VolumeEncoding &encoding = VolumeEncoding());
+    void bind(GLuint indirectionUnit, GLuint atlasUnit) const;
+
+    //! Maximum value of each brick including its apron (zero for empty bricks)
+    Volume majorantGrid() const;
+
+    glm::ivec3 size() const { return size_; }
+    glm::ivec3 gridSize() const { return gridSize_; }
+    glm::ivec3 atlasBricks() const { return atlasBricks_; }
+    int brickSize() const { return brickSize_; }
+    int numBricks() const { return (int)brickMax.size(); }
+    float maxValue() const { return maxValue_; }
+    glm::vec3 bboxMin() const { return bboxMin_; }
+    glm::vec3 bboxMax() const { return bboxMax_; }
+    //! Memory of the indirection grid and the bricks in bytes
+    size_t memoryBytes() const;
+    //! GPU memory of the uploaded textures in bytes
+    size_t textureBytes() const;
+
+private:
+    using SliceReader = std::function<void(int z, float *slice)>;
+    void build(const glm::ivec3 &size, int brickSize, float threshold, const SliceReader &readSlice);
+    void release();
+
+    glm::ivec3 size_ = glm::ivec3(0);
+    glm::ivec3 gridSize_ = glm::ivec3(0);
+    glm::ivec3 atlasBricks_ = glm::ivec3(0);
+    int brickSize_ = 8;
+    float maxValue_ = 0.0f;
+    glm::vec3 bboxMin_ = glm::vec3(0.0f);
+    glm::vec3 bboxMax_ = glm::vec3(1.0f);
+    std::vector<int> indirection;
+    std::vector<float> bricks;
+    std::vector<float> brickMax;
+
+    GLuint indirectionTexId = 0;
+    GLuint atlasTexId = 0;
+    size_t textureBytes_ = 0;
+};
+
+}  // namespace glrt
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+
+#include "api.h"
+
+namespace glrt {
+
+//! Peak resident set size (peak working set on Windows) of this process in bytes
+GLRT_API size_t peakResidentMemory();
+
+}  // namespace glrt
@@ -1,17 +1,74 @@
 #define GLRT_API_EXPORT
 #include "trimesh.h"
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
 #include <experimental/filesystem>
 
 #include <tiny_obj_loader.h>
 #include <tinyply.h>
 
+#include "hash.h"
+#include "obj_reader.h"
+#include "timer.h"
+
 namespace fs = std::experimental::filesystem;
 
 namespace glrt {
 
+namespace {
+
+// Attributes compared by the welding, as the bits of the floats (positions are replaced by their cells
+// of the tolerance if it is positive)
+struct WeldKey {
+    bool operator==(const WeldKey &k) const { return std::equal(values, values + 9, k.values); }
+
+    uint32_t values[9];
+};
+
+WeldKey weldKey(const Vertex &v, float tolerance) {
+    const float attribs[9] = { v.pos.x,    v.pos.y,    v.pos.z, v.normal.x, v.normal.y,
+                               v.normal.z, v.uv.x,     v.uv.y,  v.uv.z };
+    WeldKey key;
+    for (int i = 0; i < 9; i++) {
+        if (i < 3 && tolerance > 0.0f) {
+            const double cell = std::floor((double)attribs[i] / tolerance);
+            key.values[i] = (uint32_t)(int32_t)std::max(std::min(cell, (double)INT32_MAX), (double)INT32_MIN);
+        } else {
+            // Adding zero turns -0 into +0
+            const float value = attribs[i] + 0.0f;
+            std::memcpy(&key.values[i], &value, sizeof(float));
+        }
+    }
+    return key;
+}
+
+// Sort runs in parallel, and then merge them pairwise in parallel
+template <typename T>
+void parallelSort(std::vector<T> &items) {
+    const int64_t n = (int64_t)items.size();
+    const int64_t runSize = std::max((int64_t)1 << 16, (n + omp_get_max_threads() - 1) / omp_get_max_threads());
+    const int numRuns = (int)((n + runSize - 1) / runSize);
+    omp_parallel_for (int r = 0; r < numRuns; r++) {
+        std::sort(items.begin() + r * runSize, items.begin() + std::min(n, (r + 1) * runSize));
+    }
+
+    for (int64_t width = runSize; width < n; width *= 2) {
+        const int numMerges = (int)((n + 2 * width - 1) / (2 * width));
+        omp_parallel_for (int m = 0; m < numMerges; m++) {
+            const int64_t lo = m * 2 * width;
+            const int64_t mid = std::min(n, lo + width);
+            const int64_t hi = std::min(n, lo + 2 * width);
+            std::inplace_merge(items.begin() + lo, items.begin() + mid, items.begin() + hi);
+        }
+    }
+}
+
+}  // anonymous namespace
+
 Trimesh::Trimesh() {
 }
 
@@ -19,7 +76,7 @@ Trimesh::Trimesh(const std::string &filename) {
     load(filename);
 }
 
-void Trimesh::load(const std::string &filename) {
+void Trimesh::load(const std::string &filename, OBJParser parser, float weldTolerance) {
     // Load a new mesh
     std::string extension = fs::path(filename.c_str()).extension().string();
     std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
@@ -27,7 +84,11 @@ void Trimesh::load(const std::string &filename) {
     bool hasNorm = false;
     bool hasUV = false;
     if (extension == ".obj") {
-        loadOBJ(filename, &hasNorm, &hasUV);
+        if (parser == OBJParser::TinyObj) {
+            loadTinyOBJ(filename, &hasNorm, &hasUV);
+        } else {
+            loadOBJ(filename, &hasNorm, &hasUV);
+        }
     } else if (extension == ".ply") {
         loadPLY(filename, &hasNorm, &hasUV);
     } else {
@@ -63,6 +124,15 @@ void Trimesh::load(const std::string &filename) {
         }
     }
 
+    // Merge the corners which are shared by the faces (after the normals, so that flat shading is kept)
+    unweldedVertices = vertices.size();
+    if (weldTolerance >= 0.0f) {
+        Timer timer;
+        timer.start();
+        weld(weldTolerance);
+        weldTime = timer.count();
+    }
+
     // Compute tangents and binormals using UV coordinates
     if (hasUV) {
         // Initialize tangents and binormals 
@@ -110,7 +180,90 @@ void Trimesh::load(const std::string &filename) {
     }
 }
 
+void Trimesh::weld(float tolerance) {
+    const int64_t n = (int64_t)vertices.size();
+    if (n == 0) {
+        return;
+    }
+
+    // Sort by the hash of the keys. Ties are ordered by the index, so the first corner of each vertex comes first
+    std::vector<WeldKey> keys(n);
+    std::vector<std::pair<uint64_t, uint32_t>> order(n);
+    omp_parallel_for (int64_t i = 0; i < n; i++) {
+        keys[i] = weldKey(vertices[i], tolerance);
+        uint64_t h = 0;
+        for (int k = 0; k < 9; k++) {
+            h = hashCombine(h, keys[i].values[k]);
+        }
+        order[i] = std::make_pair(h, (uint32_t)i);
+    }
+    parallelSort(order);
+
+    // Representative (the first corner with the same key) of each corner. The sorted list is split for the
+    // threads at the boundaries of the hash values, and the keys are compared within them against collisions.
+    std::vector<uint32_t> representative(n);
+    const int numBlocks = std::max(1, omp_get_max_threads() * 4);
+    std::vector<int64_t> blockStarts(numBlocks + 1, n);
+    blockStarts[0] = 0;
+    for (int b = 1; b < numBlocks; b++) {
+        int64_t s = std::max(blockStarts[b - 1], n * b / numBlocks);
+        while (s > 0 && s < n && order[s].first == order[s - 1].first) {
+            s++;
+        }
+        blockStarts[b] = s;
+    }
+
+    omp_parallel_for (int b = 0; b < numBlocks; b++) {
+        int64_t groupStart = blockStarts[b];
+        for (int64_t s = blockStarts[b]; s < blockStarts[b + 1]; s++) {
+            if (order[s].first != order[groupStart].first) {
+                groupStart = s;
+            }
+
+            const uint32_t i = order[s].second;
+            representative[i] = i;
+            for (int64_t t = groupStart; t < s; t++) {
+                const uint32_t j = order[t].second;
+                if (representative[j] == j && keys[j] == keys[i]) {
+                    representative[i] = j;
+                    break;
+                }
+            }
+        }
+    }
+
+    // New indices of the representatives in the original order
+    std::vector<uint32_t> newIndex(n);
+    uint32_t numUnique = 0;
+    for (int64_t i = 0; i < n; i++) {
+        if (representative[i] == (uint32_t)i) {
+            newIndex[i] = numUnique++;
+        }
+    }
+
+    std::vector<Vertex> welded(numUnique);
+    omp_parallel_for (int64_t i = 0; i < n; i++) {
+        if (representative[i] == (uint32_t)i) {
+            welded[newIndex[i]] = vertices[i];
+        }
+    }
+
+    const int64_t numIndices = (int64_t)indices.size();
+    omp_parallel_for (int64_t k = 0; k < numIndices; k++) {
+        indices[k] = newIndex[representative[indices[k]]];
+    }
+    vertices.swap(welded);
+}
+
 void Trimesh::loadOBJ(const std::string &filename, bool *hasNorm, bool *hasUV) {
+    try {
+        readOBJ(filename, &vertices, &indices, hasNorm, hasUV);
+    } catch (const std::runtime_error &e) {
+        FatalError("Failed to load *.obj file: %s (%s)", filename.c_str(), e.what());
+    }
+}
+
+void Trimesh::loadTinyOBJ(const std::string &filename, bool *hasNorm, bool *hasUV) {
     // Resolve mtl file location
     fs::path path(filename);
     const std::string absname = fs::absolute(path).string();
@@ -130,8 +283,7 @@ void Trimesh::loadOBJ(const std::string &filename, bool *hasNorm, bool *hasUV) {
         FatalError("Failed to load *.obj file: %s", filename.c_str());
     }
 
-    // Traverse triangles
-    std::unordered_map<Vertex, uint32_t> uniqueVertices;
+    // Traverse triangles (shared corners are merged by "weld")
     vertices.clear();
     indices.clear();
 
@@ -177,12 +329,6 @@ void Trimesh::loadOBJ(const std::string &filename, bool *hasNorm, bool *hasUV) {
                 vertex.normal = normal;
                 vertex.uv = uv;
 
-                //if (uniqueVertices.count(vertex) == 0) {
-                //    uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
-                //    vertices.push_back(vertex);
-                //}
-                //indices.push_back(uniqueVertices[vertex]);
-
                 vertices.push_back(vertex);
                 indices.push_back(vertices.size() - 1);
             }
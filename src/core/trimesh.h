@@ -11,6 +11,7 @@
 
 #include "api.h"
 #include "common.h"
+#include "hash.h"
 
 struct Vertex {
     bool operator==(const Vertex& v) const {
@@ -29,11 +30,10 @@ namespace std {
 template <>
 struct hash<Vertex> {
     size_t operator()(const Vertex &v) const {
-        size_t h = 0;
-        h = hash<glm::vec3>()(v.pos) ^ (h << 1);
-        h = hash<glm::vec3>()(v.normal) ^ (h << 1);
-        h = hash<glm::vec2>()(v.uv) ^ (h << 1);
-        return h;
+        uint64_t h = hash<glm::vec3>()(v.pos);
+        h = glrt::hashCombine(h, hash<glm::vec3>()(v.normal));
+        h = glrt::hashCombine(h, hash<glm::vec3>()(v.uv));
+        return (size_t)h;
     }
 };
 
@@ -41,17 +41,30 @@ struct hash<Vertex> {
 
 namespace glrt {
 
+enum class OBJParser : int {
+    Native,   //!< Parallel reader on the memory-mapped file
+    TinyObj   //!< tinyobjloader (kept for comparison)
+};
+
 class GLRT_API Trimesh {
 public:
     Trimesh();
     Trimesh(const std::string &filename);
-    void load(const std::string &filename);
+    //! Load a mesh, whose corners are welded unless "weldTolerance" is negative (see "weld")
+    void load(const std::string &filename, OBJParser parser = OBJParser::Native, float weldTolerance = 0.0f);
+
+    //! Merge the vertices with the same position, normal and texture coordinates. With a positive tolerance,
+    //! the positions are snapped to cells of that size, so that nearby vertices in the same cell are merged.
+    void weld(float tolerance = 0.0f);
 
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
+    size_t unweldedVertices = 0;  //!< Number of vertices before welding
+    double weldTime = 0.0;
 
 private:
     void loadOBJ(const std::string &filename, bool *hasNorm, bool *hasUV);
+    void loadTinyOBJ(const std::string &filename, bool *hasNorm, bool *hasUV);
     void loadPLY(const std::string &filename, bool *hasNorm, bool *hasUV);
 };
 
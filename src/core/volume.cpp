@@ -2,9 +2,13 @@
 #include "volume.h"
 
 #include <cstdio>
+#include <cstdint>
 #include <algorithm>
 #include <stdexcept>
 
+#include "common.h"
+#include "volume_format.h"
+
 namespace glrt {
 
 Volume::Volume() {
@@ -34,9 +38,12 @@ Volume &Volume::operator=(const Volume &vol) {
     this->bboxMax = vol.bboxMax;
 
     this->channels = vol.channels;
+    this->minValue = vol.minValue;
+    this->maxValue = vol.maxValue;
+    this->histogram = vol.histogram;
 
     release();
-    data = new float[size_x * size_y * size_z];
+    data = new float[size_x * size_y * size_z * channels];
     std::memcpy(data, vol.data, sizeof(float) * size_x * size_y * size_z * channels);
 
     return *this;
@@ -58,49 +65,129 @@ void Volume::resize(int size_x, int size_y, int size_z, int channels) {
 }
 
 void Volume::load(const std::string &filename) {
-    FILE *fp = fopen(filename.c_str(), "rb");
-    if (!fp) {
-        throw std::runtime_error("Failed to open file: " + filename);
+    auto file = std::make_shared<MappedFile>(filename);
+    const char *ptr = file->data();
+    const size_t headerSize = 3 + 1 + sizeof(int) * 5 + sizeof(float) * 6;
+    if (file->size() < headerSize) {
+        throw std::runtime_error("Invalid volume file: " + filename);
     }
 
     char header[4] = {0};
-    fread(header, sizeof(char), 3, fp);
+    std::memcpy(header, ptr, 3);
     if (std::strcmp(header, "VOL") != 0) {
         throw std::runtime_error("Invalid indetifier: " + std::string(header));
     }
 
-    char version;
-    fread(&version, sizeof(char), 1, fp);
+    const char version = ptr[3];
     if (version != 3) {
         char msg[256];
         sprintf(msg, "Invalid version: %d", (int) version);
         throw std::runtime_error(std::string(msg));
     }
 
+    // Encoding: 1 = float32, 2 = float16, 3 = uint8 (normalized to [0, 1])
     int identifier;
-    fread(&identifier, sizeof(int), 1, fp);
-    if (identifier != 1) {
-        throw std::runtime_error("Currently support only float32 types!\n");
+    std::memcpy(&identifier, ptr + 4, sizeof(int));
+    if (identifier < 1 || identifier > 3) {
+        throw std::runtime_error("Currently support only float32, float16 and uint8 types!\n");
     }
 
-    fread(&size_x, sizeof(int), 1, fp);
-    fread(&size_y, sizeof(int), 1, fp);
-    fread(&size_z, sizeof(int), 1, fp);
-    fread(&channels, sizeof(int), 1, fp);
+    std::memcpy(&size_x, ptr + 8, sizeof(int));
+    std::memcpy(&size_y, ptr + 12, sizeof(int));
+    std::memcpy(&size_z, ptr + 16, sizeof(int));
+    std::memcpy(&channels, ptr + 20, sizeof(int));
+    std::memcpy(&bboxMin, ptr + 24, sizeof(float) * 3);
+    std::memcpy(&bboxMax, ptr + 36, sizeof(float) * 3);
 
-    fread(&bboxMin, sizeof(float), 3, fp);
-    fread(&bboxMax, sizeof(float), 3, fp);
+    const size_t count = (size_t)size_x * size_y * size_z * channels;
+    const size_t bytesPerValue = identifier == 1 ? 4 : identifier == 2 ? 2 : 1;
+    if (file->size() < headerSize + count * bytesPerValue) {
+        throw std::runtime_error("Unexpected end of file: " + filename);
+    }
 
     release();
-    data = new float[size_x * size_y * size_z * channels];
-    fread(data, sizeof(float), size_x * size_y * size_z * channels, fp);
+    if (identifier == 1) {
+        // The payload starts at a 4-byte boundary and is used in place
+        mapping = file;
+        data = reinterpret_cast<float *>(file->data() + headerSize);
+    } else {
+        // Reduced-precision payloads are decoded into floats
+        data = new float[count];
+        const char *payload = ptr + headerSize;
+        omp_parallel_for (int64_t i = 0; i < (int64_t)count; i++) {
+            if (identifier == 2) {
+                uint16_t h;
+                std::memcpy(&h, payload + i * 2, sizeof(uint16_t));
+                data[i] = halfToFloat(h);
+            } else {
+                data[i] = (uint8_t)payload[i] / 255.0f;
+            }
+        }
+    }
 
-    maxValue = -1.0e10f;
-    for (int i = 0; i < size_x * size_y * size_z * channels; i++) {
-        maxValue = std::max(maxValue, data[i]);
+    computeStatistics();
+}
+
+void Volume::computeStatistics(int bins) {
+    const int64_t count = (int64_t)size_x * size_y * size_z * channels;
+    const int numChunks = 256;
+    const int64_t chunkSize = (count + numChunks - 1) / numChunks;
+
+    // Min and max with independent lanes so that the inner loop is vectorized
+    const int lanes = 8;
+    std::vector<float> chunkMin(numChunks, 1.0e20f), chunkMax(numChunks, -1.0e20f);
+    omp_parallel_for (int c = 0; c < numChunks; c++) {
+        const int64_t begin = std::min(c * chunkSize, count);
+        const int64_t end = std::min(begin + chunkSize, count);
+        float laneMin[lanes], laneMax[lanes];
+        for (int k = 0; k < lanes; k++) {
+            laneMin[k] = 1.0e20f;
+            laneMax[k] = -1.0e20f;
+        }
+
+        int64_t i = begin;
+        for (; i + lanes <= end; i += lanes) {
+            for (int k = 0; k < lanes; k++) {
+                laneMin[k] = std::min(laneMin[k], data[i + k]);
+                laneMax[k] = std::max(laneMax[k], data[i + k]);
+            }
+        }
+        for (; i < end; i++) {
+            laneMin[0] = std::min(laneMin[0], data[i]);
+            laneMax[0] = std::max(laneMax[0], data[i]);
+        }
+
+        for (int k = 0; k < lanes; k++) {
+            chunkMin[c] = std::min(chunkMin[c], laneMin[k]);
+            chunkMax[c] = std::max(chunkMax[c], laneMax[k]);
+        }
     }
 
-    fclose(fp);
+    minValue = *std::min_element(chunkMin.begin(), chunkMin.end());
+    maxValue = *std::max_element(chunkMax.begin(), chunkMax.end());
+    if (count == 0) {
+        minValue = maxValue = 0.0f;
+    }
+
+    // Histogram accumulated per chunk and merged afterwards
+    std::vector<size_t> chunkHist((size_t)numChunks * bins, 0);
+    const float scale = maxValue > minValue ? bins / (maxValue - minValue) : 0.0f;
+    omp_parallel_for (int c = 0; c < numChunks; c++) {
+        const int64_t begin = std::min(c * chunkSize, count);
+        const int64_t end = std::min(begin + chunkSize, count);
+        size_t *hist = &chunkHist[(size_t)c * bins];
+        for (int64_t i = begin; i < end; i++) {
+            const int b = std::min((int)((data[i] - minValue) * scale), bins - 1);
+            hist[b] += 1;
+        }
+    }
+
+    histogram.assign(bins, 0);
+    for (int c = 0; c < numChunks; c++) {
+        for (int b = 0; b < bins; b++) {
+            histogram[b] += chunkHist[(size_t)c * bins + b];
+        }
+    }
 }
 
 void Volume::save(const std::string &filename) const {
@@ -131,4 +218,42 @@ void Volume::save(const std::string &filename) const {
     fclose(fp);
 }
 
+Volume Volume::majorantGrid(int cellSize) const {
+    if (cellSize <= 0) {
+        cellSize = std::max(size_x, std::max(size_y, size_z));
+    }
+
+    const int gx = (size_x + cellSize - 1) / cellSize;
+    const int gy = (size_y + cellSize - 1) / cellSize;
+    const int gz = (size_z + cellSize - 1) / cellSize;
+    Volume grid(gx, gy, gz, 1);
+    grid.range(bboxMin, bboxMax);
+
+    for (int z = 0; z < gz; z++) {
+        for (int y = 0; y < gy; y++) {
+            for (int x = 0; x < gx; x++) {
+                const int x0 = std::max(x * cellSize - 1, 0);
+                const int y0 = std::max(y * cellSize - 1, 0);
+                const int z0 = std::max(z * cellSize - 1, 0);
+                const int x1 = std::min((x + 1) * cellSize + 1, size_x);
+                const int y1 = std::min((y + 1) * cellSize + 1, size_y);
+                const int z1 = std::min((z + 1) * cellSize + 1, size_z);
+
+                float maxValue = 0.0f;
+                for (int vz = z0; vz < z1; vz++) {
+                    for (int vy = y0; vy < y1; vy++) {
+                        for (int vx = x0; vx < x1; vx++) {
+                            maxValue = std::max(maxValue, data[((vz * size_y + vy) * size_x + vx) * channels]);
+                        }
+                    }
+                }
+                grid(x, y, z, 0) = maxValue;
+                grid.maxValue = std::max(grid.maxValue, maxValue);
+            }
+        }
+    }
+
+    return grid;
+}
+
 }  // namespace glrt
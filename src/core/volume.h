@@ -3,10 +3,13 @@
 #include <cstdio>
 #include <cstring>
 #include <string>
+#include <vector>
+#include <memory>
 
 #include <glm/glm.hpp>
 
 #include "api.h"
+#include "mapped_file.h"
 
 namespace glrt {
 
@@ -26,26 +29,41 @@ struct GLRT_API Volume {
     }
 
     void release() {
-        if (data) {
+        if (mapping) {
+            mapping.reset();
+        } else if (data) {
             delete[] data;
-            data = nullptr;
         }
+        data = nullptr;
     }
 
     void range(const glm::vec3 &bboxMin, const glm::vec3 &bboxMax);
 
     void resize(int size_x, int size_y, int size_z, int channels);
 
+    //! Load "*.vol" file. The payload is memory-mapped instead of being copied
     void load(const std::string &filename);
 
     void save(const std::string &filename) const;
 
+    //! Maximum of the first channel over blocks of "cellSize" voxels (dilated by one voxel for trilinear lookups).
+    //! Non-positive "cellSize" gives a single cell with the global maximum
+    Volume majorantGrid(int cellSize) const;
+
+    //! Minimum, maximum and histogram between them (parallel reduction over chunks)
+    void computeStatistics(int bins = 256);
+
     int size_x, size_y, size_z;
     int channels;
     glm::vec3 bboxMin;
     glm::vec3 bboxMax;
+    float minValue = 0.0f;
     float maxValue = 0.0f;
+    std::vector<size_t> histogram;
     float *data = nullptr;
+
+private:
+    std::shared_ptr<MappedFile> mapping = nullptr;
 };
 
 }  // namespace glrt
@@ -0,0 +1,241 @@
+#define GLRT_API_EXPORT
+#include "volume_format.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+namespace glrt {
+
+VolumeEncoding::VolumeEncoding(VolumeFormat format, float minValue, float maxValue)
+    : format(format) {
+    if (format == VolumeFormat::UNorm16 || format == VolumeFormat::UNorm8) {
+        scale = std::max(maxValue - minValue, 1.0e-20f);
+        offset = minValue;
+    }
+}
+
+void VolumeEncoding::encode(const float *src, size_t count, int stride, void *dst) const {
+    switch (format) {
+    case VolumeFormat::Float32: {
+        float *out = (float *)dst;
+        if (stride == 1) {
+            std::memcpy(out, src, count * sizeof(float));
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                out[i] = src[i * stride];
+            }
+        }
+        break;
+    }
+
+    case VolumeFormat::Float16: {
+        uint16_t *out = (uint16_t *)dst;
+        for (size_t i = 0; i < count; i++) {
+            out[i] = floatToHalf(src[i * stride]);
+        }
+        break;
+    }
+
+    case VolumeFormat::UNorm16: {
+        uint16_t *out = (uint16_t *)dst;
+        for (size_t i = 0; i < count; i++) {
+            const float t = std::min(std::max((src[i * stride] - offset) / scale, 0.0f), 1.0f);
+            out[i] = (uint16_t)(t * 65535.0f + 0.5f);
+        }
+        break;
+    }
+
+    case VolumeFormat::UNorm8: {
+        uint8_t *out = (uint8_t *)dst;
+        for (size_t i = 0; i < count; i++) {
+            const float t = std::min(std::max((src[i * stride] - offset) / scale, 0.0f), 1.0f);
+            out[i] = (uint8_t)(t * 255.0f + 0.5f);
+        }
+        break;
+    }
+    }
+}
+
+float VolumeEncoding::errorBound(float value) const {
+    switch (format) {
+    case VolumeFormat::Float16:
+        return std::abs(value) / 1024.0f + 6.0e-8f;
+    case VolumeFormat::UNorm16:
+        return scale / 65535.0f;
+    case VolumeFormat::UNorm8:
+        return scale / 255.0f;
+    default:
+        return 0.0f;
+    }
+}
+
+GLenum VolumeEncoding::internalFormat() const {
+    switch (format) {
+    case VolumeFormat::Float16:
+        return GL_R16F;
+    case VolumeFormat::UNorm16:
+        return GL_R16;
+    case VolumeFormat::UNorm8:
+        return GL_R8;
+    default:
+        return GL_R32F;
+    }
+}
+
+GLenum VolumeEncoding::pixelType() const {
+    switch (format) {
+    case VolumeFormat::Float16:
+        return GL_HALF_FLOAT;
+    case VolumeFormat::UNorm16:
+        return GL_UNSIGNED_SHORT;
+    case VolumeFormat::UNorm8:
+        return GL_UNSIGNED_BYTE;
+    default:
+        return GL_FLOAT;
+    }
+}
+
+size_t VolumeEncoding::bytesPerVoxel() const {
+    switch (format) {
+    case VolumeFormat::Float16:
+    case VolumeFormat::UNorm16:
+        return 2;
+    case VolumeFormat::UNorm8:
+        return 1;
+    default:
+        return 4;
+    }
+}
+
+VolumeFormat parseVolumeFormat(const std::string &name) {
+    if (name == "float16") {
+        return VolumeFormat::Float16;
+    } else if (name == "unorm16") {
+        return VolumeFormat::UNorm16;
+    } else if (name == "unorm8") {
+        return VolumeFormat::UNorm8;
+    } else if (name != "float32" && !name.empty()) {
+        Warn("Unknown volume format: %s (float32 is used instead)", name.c_str());
+    }
+    return VolumeFormat::Float32;
+}
+
+const char *volumeFormatName(VolumeFormat format) {
+    switch (format) {
+    case VolumeFormat::Float16:
+        return "float16";
+    case VolumeFormat::UNorm16:
+        return "unorm16";
+    case VolumeFormat::UNorm8:
+        return "unorm8";
+    default:
+        return "float32";
+    }
+}
+
+glm::vec3 blackBody(double T) {
+    static const double lambdas[3] = { 6.10e-7, 5.50e-7, 4.50e-7 };
+    const double h = 6.6260e-34;
+    const double c = 2.9979e8;
+    const double k = 1.3806e-23;
+
+    glm::vec3 ret(0.0f);
+    if (T <= 0.0) {
+        return ret;
+    }
+
+    for (int ch = 0; ch < 3; ch++) {
+        const double l = lambdas[ch];
+        const double l5 = (l * l) * (l * l) * l;
+        ret[ch] = (float)std::max(0.0, (2.0 * h * c * c) / (l5 * (std::exp((h * c) / (l * k * T)) - 1.0)));
+    }
+    return ret;
+}
+
+float encodeEmission(const float *src, size_t count, int stride, float temperatureScale, float maxValue,
+                     bool halfPrecision, void *dst) {
+    const glm::vec3 maxEmission = blackBody((double)maxValue * temperatureScale);
+    const float scale = std::max(maxEmission.x, std::max(maxEmission.y, maxEmission.z));
+    const float invScale = scale > 0.0f ? 1.0f / scale : 0.0f;
+
+    omp_parallel_for (int64_t i = 0; i < (int64_t)count; i++) {
+        const glm::vec3 L = blackBody((double)src[i * stride] * temperatureScale) * invScale;
+        for (int ch = 0; ch < 3; ch++) {
+            if (halfPrecision) {
+                ((uint16_t *)dst)[i * 3 + ch] = floatToHalf(L[ch]);
+            } else {
+                ((float *)dst)[i * 3 + ch] = L[ch];
+            }
+        }
+    }
+    return scale;
+}
+
+float halfToFloat(uint16_t h) {
+    const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+
+    uint32_t bits;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            // Subnormal
+            exponent = 127 - 15 + 1;
+            while ((mantissa & 0x400) == 0) {
+                mantissa <<= 1;
+                exponent -= 1;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    } else if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float f;
+    std::memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+uint16_t floatToHalf(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(float));
+    const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    const int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) {
+        // Inf or NaN
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        // Subnormal (round to nearest)
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint16_t h = (uint16_t)(mantissa >> shift);
+        if ((mantissa >> (shift - 1)) & 1) {
+            h += 1;
+        }
+        return sign | h;
+    }
+
+    // Round to nearest (carry into the exponent is correct)
+    uint16_t h = sign | (uint16_t)(exponent << 10) | (uint16_t)(mantissa >> 13);
+    if (mantissa & 0x1000) {
+        h += 1;
+    }
+    return h;
+}
+
+}  // namespace glrt
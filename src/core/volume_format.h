@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "api.h"
+#include "common.h"
+
+namespace glrt {
+
+//! Storage formats of volume textures. The normalized integer formats store (v - min) / (max - min),
+//! and the shader decodes them with "scale" and "offset" (v = texel * scale + offset).
+enum class VolumeFormat : int {
+    Float32 = 0,
+    Float16 = 1,
+    UNorm16 = 2,
+    UNorm8 = 3
+};
+
+struct GLRT_API VolumeEncoding {
+    VolumeEncoding() {}
+    VolumeEncoding(VolumeFormat format, float minValue, float maxValue);
+
+    //! Encode "count" voxels taken with "stride" floats from "src" into "dst"
+    void encode(const float *src, size_t count, int stride, void *dst) const;
+    //! Upper bound of the absolute error after decoding a value not larger than "value"
+    float errorBound(float value) const;
+
+    GLenum internalFormat() const;
+    GLenum pixelType() const;
+    size_t bytesPerVoxel() const;
+
+    VolumeFormat format = VolumeFormat::Float32;
+    float scale = 1.0f;
+    float offset = 0.0f;
+};
+
+GLRT_API VolumeFormat parseVolumeFormat(const std::string &name);
+GLRT_API const char *volumeFormatName(VolumeFormat format);
+
+//! Black body radiation by Planck's law at the wavelengths of the RGB primaries (same as the shader)
+GLRT_API glm::vec3 blackBody(double T);
+//! Encode the black body emission of "count" temperatures (multiplied by "temperatureScale") taken with "stride"
+//! floats from "src" as RGB texels (half floats if "halfPrecision"). Emission is normalized by the one at
+//! "maxValue", which is the maximum since Planck's law increases with the temperature, and the factor is returned
+GLRT_API float encodeEmission(const float *src, size_t count, int stride, float temperatureScale, float maxValue,
+                              bool halfPrecision, void *dst);
+GLRT_API float halfToFloat(uint16_t h);
+GLRT_API uint16_t floatToHalf(float f);
+
+}  // namespace glrt
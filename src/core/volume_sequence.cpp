@@ -0,0 +1,257 @@
+#define GLRT_API_EXPORT
+#include "volume_sequence.h"
+
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+namespace glrt {
+
+VolumeSequence::VolumeSequence(const std::string &densityPattern, const std::string &temperaturePattern,
+                               int firstFrame, int numFrames)
+    : densityPattern(densityPattern)
+    , temperaturePattern(temperaturePattern)
+    , firstFrame(firstFrame)
+    , numFrames_(numFrames) {
+    if (numFrames_ < 1) {
+        FatalError("Volume sequence must have at least one frame!");
+    }
+}
+
+VolumeSequence::~VolumeSequence() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    cond.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    if (fence) {
+        glDeleteSync(fence);
+    }
+    if (stagingBuf != 0u) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuf);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &stagingBuf);
+    }
+}
+
+void VolumeSequence::start(const glm::ivec3 &size, int majorantCellSize, VolumeFormat format, bool emission) {
+    this->size = size;
+    this->majorantCellSize = majorantCellSize;
+    this->format = format;
+    this->emission = emission;
+
+    const size_t voxels = (size_t)size.x * size.y * size.z;
+    const size_t bytesPerVoxel = VolumeEncoding(format, 0.0f, 1.0f).bytesPerVoxel();
+    const size_t emissionBytes = 3 * (format != VolumeFormat::Float32 ? sizeof(uint16_t) : sizeof(float));
+    densityBytes = voxels * bytesPerVoxel;
+    temperatureBytes = voxels * (emission ? emissionBytes : bytesPerVoxel);
+
+    // Persistent mapping needs OpenGL 4.4, and the frames are decoded into host memory otherwise
+    persistent = GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage;
+    if (persistent) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &stagingBuf);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuf);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, densityBytes + temperatureBytes, nullptr, flags);
+        staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, densityBytes + temperatureBytes, flags);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    } else {
+        fallback.resize(densityBytes + temperatureBytes);
+        staging = fallback.data();
+    }
+
+    worker = std::thread(&VolumeSequence::run, this);
+    if (hasNext()) {
+        request(current + 1);
+    }
+}
+
+void VolumeSequence::update(GLuint densityTex, GLuint temperatureTex, GLuint majorantTex,
+                            const glm::ivec3 &atlasOrigin, const glm::ivec3 &majorantOrigin) {
+    State s;
+    std::string message;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        s = state;
+        message = error;
+    }
+
+    if (s == State::Failed) {
+        FatalError("Failed to decode frame of the volume sequence: %s", message.c_str());
+    } else if (s == State::Decoded) {
+        // Offsets in the staging buffer, or pointers to the host memory without persistent mapping
+        auto source = [&](size_t offset) -> const void * {
+            return persistent ? (const void *)(uintptr_t)offset : (const void *)(fallback.data() + offset);
+        };
+        const bool halfPrecision = format != VolumeFormat::Float32;
+        const GLenum temperatureFormat = emission ? GL_RGB : GL_RED;
+        const GLenum temperatureType = emission ? (halfPrecision ? GL_HALF_FLOAT : GL_FLOAT)
+                                                : decoded.temperatureEncoding.pixelType();
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, persistent ? stagingBuf : 0u);
+        glBindTexture(GL_TEXTURE_3D, densityTex);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, atlasOrigin.x, atlasOrigin.y, atlasOrigin.z, size.x, size.y, size.z, GL_RED,
+                        decoded.densityEncoding.pixelType(), source(0));
+        glBindTexture(GL_TEXTURE_3D, temperatureTex);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, atlasOrigin.x, atlasOrigin.y, atlasOrigin.z, size.x, size.y, size.z,
+                        temperatureFormat, temperatureType, source(densityBytes));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        glBindTexture(GL_TEXTURE_3D, majorantTex);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, majorantOrigin.x, majorantOrigin.y, majorantOrigin.z, majorant.size_x,
+                        majorant.size_y, majorant.size_z, GL_RED, GL_FLOAT, majorant.data);
+        glBindTexture(GL_TEXTURE_3D, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        // The staging buffer is reused only after the copies have finished
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        state = State::Uploading;
+    } else if (s == State::Uploading) {
+        const GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            glDeleteSync(fence);
+            fence = nullptr;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            state = State::Uploaded;
+        }
+    }
+}
+
+bool VolumeSequence::ready() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return state == State::Uploaded;
+}
+
+VolumeSequence::Frame VolumeSequence::swap() {
+    if (!ready()) {
+        FatalError("Next frame of the volume sequence is not uploaded yet!");
+    }
+
+    const Frame frame = decoded;
+    current += 1;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        state = State::Idle;
+    }
+
+    if (hasNext()) {
+        request(current + 1);
+    }
+    return frame;
+}
+
+std::string VolumeSequence::densityPath(int frame) const {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), densityPattern.c_str(), firstFrame + frame);
+    return std::string(buf);
+}
+
+std::string VolumeSequence::temperaturePath(int frame) const {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), temperaturePattern.c_str(), firstFrame + frame);
+    return std::string(buf);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// PRIVATE methods
+// ---------------------------------------------------------------------------------------------------------------------
+
+void VolumeSequence::request(int frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requested = frame;
+        state = State::Decoding;
+    }
+    cond.notify_all();
+}
+
+void VolumeSequence::run() {
+    while (true) {
+        int frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&] { return quit || requested >= 0; });
+            if (quit) {
+                return;
+            }
+            frame = requested;
+            requested = -1;
+        }
+
+        // Errors are reported on the GL thread, which can shut the renderer down
+        std::string message;
+        try {
+            decode(frame);
+        } catch (const std::exception &e) {
+            message = e.what();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (message.empty()) {
+            state = State::Decoded;
+        } else {
+            error = message;
+            state = State::Failed;
+        }
+    }
+}
+
+void VolumeSequence::decode(int frame) {
+    Volume density, temperature;
+    density.load(densityPath(frame));
+    temperature.load(temperaturePath(frame));
+    if (density.size_x != size.x || density.size_y != size.y || density.size_z != size.z ||
+        temperature.size_x != size.x || temperature.size_y != size.y || temperature.size_z != size.z) {
+        throw std::runtime_error("Different resolution from the first frame: " + densityPath(frame));
+    }
+
+    Frame result;
+    result.index = frame;
+    result.maxValue = density.maxValue;
+
+    // Density is encoded in parallel over the chunks
+    const int64_t voxels = (int64_t)size.x * size.y * size.z;
+    const int64_t chunkSize = 1 << 20;
+    const int numChunks = (int)((voxels + chunkSize - 1) / chunkSize);
+    char *dst = (char *)staging;
+    result.densityEncoding = VolumeEncoding(format, density.minValue, density.maxValue);
+    const size_t bytesPerVoxel = result.densityEncoding.bytesPerVoxel();
+    omp_parallel_for (int c = 0; c < numChunks; c++) {
+        const int64_t begin = c * chunkSize;
+        const int64_t count = std::min(chunkSize, voxels - begin);
+        result.densityEncoding.encode(density.data + begin * density.channels, count, density.channels,
+                                      dst + begin * bytesPerVoxel);
+    }
+
+    if (emission) {
+        result.emissionScale = encodeEmission(temperature.data, voxels, temperature.channels, 1.0e2f,
+                                              temperature.maxValue, format != VolumeFormat::Float32,
+                                              dst + densityBytes);
+    } else {
+        result.temperatureEncoding = VolumeEncoding(format, temperature.minValue, temperature.maxValue);
+        result.temperatureEncoding.encode(temperature.data, voxels, temperature.channels, dst + densityBytes);
+    }
+
+    // Keep the majorants conservative against the rounding as the scene does
+    majorant = density.majorantGrid(majorantCellSize);
+    const int numCells = majorant.size_x * majorant.size_y * majorant.size_z;
+    for (int i = 0; i < numCells; i++) {
+        if (majorant.data[i] > 0.0f) {
+            majorant.data[i] += result.densityEncoding.errorBound(majorant.data[i]);
+        }
+    }
+
+    decoded = result;
+}
+
+}  // namespace glrt
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <glm/glm.hpp>
+
+#include "api.h"
+#include "common.h"
+#include "uncopyable.h"
+#include "volume.h"
+#include "volume_format.h"
+
+namespace glrt {
+
+//! Frames of an animated dense volume, whose file names are given by printf-style patterns (e.g., "fire_%04d.vol").
+//! While the current frame is rendered, the next one is decoded on a background thread into a persistently mapped
+//! staging buffer, and uploaded into the back regions of the atlases. The regions are swapped by the scene.
+class GLRT_API VolumeSequence : private Uncopyable {
+public:
+    //! Decoded frame with the parameters for the shader
+    struct Frame {
+        int index = -1;
+        float maxValue = 0.0f;
+        float emissionScale = 1.0f;
+        VolumeEncoding densityEncoding;
+        VolumeEncoding temperatureEncoding;
+    };
+
+    VolumeSequence(const std::string &densityPattern, const std::string &temperaturePattern, int firstFrame,
+                   int numFrames);
+    virtual ~VolumeSequence();
+
+    //! Start decoding the second frame (the first one is loaded by the scene) with the formats of the atlases
+    void start(const glm::ivec3 &size, int majorantCellSize, VolumeFormat format, bool emission);
+
+    //! Upload the decoded frame into the back regions when it is ready (called every render frame on the GL thread)
+    void update(GLuint densityTex, GLuint temperatureTex, GLuint majorantTex, const glm::ivec3 &atlasOrigin,
+                const glm::ivec3 &majorantOrigin);
+
+    //! Whether the next frame is on the GPU
+    bool ready();
+    //! Whether there is a frame after the current one
+    bool hasNext() const { return current + 1 < numFrames_; }
+    //! Hand the uploaded frame over, and start decoding the one after it
+    Frame swap();
+
+    int numFrames() const { return numFrames_; }
+    std::string densityPath(int frame) const;
+    std::string temperaturePath(int frame) const;
+
+private:
+    enum class State { Idle, Decoding, Decoded, Uploading, Uploaded, Failed };
+
+    void run();
+    void decode(int frame);
+    void request(int frame);
+
+    std::string densityPattern, temperaturePattern;
+    int firstFrame = 0;
+    int numFrames_ = 1;
+    int current = 0;
+
+    glm::ivec3 size = glm::ivec3(0);
+    int majorantCellSize = 8;
+    VolumeFormat format = VolumeFormat::Float32;
+    bool emission = true;
+    size_t densityBytes = 0, temperatureBytes = 0;
+
+    GLuint stagingBuf = 0u;
+    void *staging = nullptr;
+    bool persistent = false;
+    std::vector<char> fallback;
+    GLsync fence = nullptr;
+
+    Frame decoded;
+    Volume majorant;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cond;
+    State state = State::Idle;
+    int requested = -1;
+    bool quit = false;
+    std::string error;  //!< Message of the exception thrown by the worker
+};
+
+}  // namespace glrt
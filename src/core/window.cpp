@@ -2,8 +2,10 @@
 #include "window.h"
 
 #include <random>
+#include <limits>
 #include <experimental/filesystem>
 
+#include <stb_image.h>
 #include <stb_image_write.h>
 
 #include <glm/gtx/string_cast.hpp>
@@ -17,6 +19,7 @@
 #include "vertex_array_object.h"
 #include "framebuffer_object.h"
 #include "shader_program.h"
+#include "texture.h"
 #include "texture_buffer.h"
 
 namespace fs = std::experimental::filesystem;
@@ -115,8 +118,15 @@ void Window::mainloop(const std::shared_ptr<Scene> &scene, double fps) {
     glfwGetFramebufferSize(window_, &renderBufferWidth, &renderBufferHeight);
     glViewport(0, 0, renderBufferWidth, renderBufferHeight);
 
+    // Animated volumes advance when the sample budget of each frame is reached
+    if (scene->animationFrames() > 1 && maxSamples <= 0 && targetRMSE <= 0.0) {
+        Warn("Animated volumes need \"--max-spp\" or \"--target-rmse\" to advance frames!");
+    }
+
     // Mainloop
     timer.start();
+    renderTimer.start();
+    statsOverhead = 0.0;
     double duration = 1.0;
     while (glfwWindowShouldClose(window_) == GLFW_FALSE) {
         // Handle events
@@ -154,7 +164,13 @@ void Window::mainloop(const std::shared_ptr<Scene> &scene, double fps) {
             glfwGetFramebufferSize(window_, &screenWidth, &screenHeight);
             glViewport(0, 0, screenWidth, screenHeight);
 
-            render();
+            if (updateAnimation()) {
+                render();
+                updateGuiding();
+                updateRadianceCache();
+                updateSampling();
+                updateStatistics();
+            }
 
             ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
@@ -178,6 +194,27 @@ void Window::mainloop(const std::shared_ptr<Scene> &scene, double fps) {
     glfwTerminate();
 }
 
+void Window::setReference(const std::string &filename) {
+    int w, h, c;
+    float *data = stbi_loadf(filename.c_str(), &w, &h, &c, STBI_rgb);
+    if (!data) {
+        FatalError("Failed to load reference image: %s", filename.c_str());
+    }
+
+    refWidth = w;
+    refHeight = h;
+    reference.assign(data, data + w * h * 3);
+    stbi_image_free(data);
+}
+
+void Window::setStatsFile(const std::string &filename) {
+    statsWriter.open(filename.c_str(), std::ios::out);
+    if (statsWriter.fail()) {
+        FatalError("Failed to open file: %s", filename.c_str());
+    }
+    statsWriter << "frame,spp,time,rmse,efficiency,steps" << std::endl;
+}
+
 // ---------------------------------------------------------------------------------------------------------------------
 // PROTECTED methods
 // ---------------------------------------------------------------------------------------------------------------------
@@ -198,28 +235,53 @@ void Window::initialize() {
 
     // Shader
     screenProgram = std::make_shared<ShaderProgram>();
-    screenProgram->create();
-    screenProgram->attachShader(ShaderStage::fromFile("screen.vert", ShaderType::Vertex));
-    screenProgram->attachShader(ShaderStage::fromFile("screen.frag", ShaderType::Fragment));
-    screenProgram->link();
-
-    rtProgram = std::make_shared<ShaderProgram>();
-    rtProgram->create();
-    rtProgram->attachShader(ShaderStage::fromFile("raytrace.vert", ShaderType::Vertex));
-    rtProgram->attachShader(ShaderStage::fromFile("raytrace.frag", ShaderType::Fragment));
-    rtProgram->link();
+    screenProgram->build({ { "screen.vert", ShaderType::Vertex }, { "screen.frag", ShaderType::Fragment } });
+
+    rtProgram = raytraceProgram(scene->shaderDefines());
+
+    // Path guiding is learned over the whole scene
+    if (scene->guiding) {
+        glm::vec3 bboxMin(1.0e20f), bboxMax(-1.0e20f);
+        for (const auto &v : scene->vertices) {
+            bboxMin = glm::min(bboxMin, v.pos);
+            bboxMax = glm::max(bboxMax, v.pos);
+        }
+        sdTree = std::make_shared<SDTree>(bboxMin, bboxMax);
+        guideIteration = 0;
+        guideFrames = 0;
+    }
+
+    // Radiance cache (toggled with "C" key)
+    if (scene->radianceCache) {
+        float cellSize = scene->radianceCacheCellSize;
+        if (cellSize <= 0.0f) {
+            glm::vec3 bboxMin(1.0e20f), bboxMax(-1.0e20f);
+            for (const auto &v : scene->vertices) {
+                bboxMin = glm::min(bboxMin, v.pos);
+                bboxMax = glm::max(bboxMax, v.pos);
+            }
+            cellSize = glm::length(bboxMax - bboxMin) / 256.0f;
+        }
+        radianceCache = std::make_shared<RadianceCache>(cellSize);
+        // Batch renders saving "output.hdr" default to the unbiased final quality
+        if (scene->radianceCacheMode == "auto") {
+            cacheEnabled = maxSamples <= 0 && targetRMSE <= 0.0;
+        } else {
+            cacheEnabled = scene->radianceCacheMode == "preview";
+        }
+        cacheFrames = 0;
+        Info("Radiance cache: cell size = %f, %s", cellSize, cacheEnabled ? "preview" : "final");
+    }
 }
 
 void Window::render() {
-    static int select = 0;
     select ^= 0x1;
 
     rtProgram->start();
     fbo[select]->bind();
     vao->bind();
 
-    GLenum bufs[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
-    glDrawBuffers(2, bufs);
+    fbo[select]->setRenderTargets(0, (int)fbo[select]->numTextures());
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -236,7 +298,12 @@ void Window::render() {
     rtProgram->setUniform1f("u_apertureRadius", scene->apertureRadius);
     rtProgram->setUniform1f("u_focalLength", scene->focalLength);
     rtProgram->setUniform2f("u_seed", glm::vec2(dist(mt), dist(mt)));
-    rtProgram->setUniform1i("u_nSamples", 1);
+    rtProgram->setUniform1i("u_nSamples", samplesPerCycle);
+    rtProgram->setUniform1i("u_adaptive", scene->adaptiveSampling ? 1 : 0);
+    rtProgram->setUniform1i("u_adaptiveMinSamples", scene->adaptiveMinSamples);
+    rtProgram->setUniform1f("u_adaptiveThreshold", scene->adaptiveThreshold);
+    rtProgram->setUniform1f("u_meanError", meanError);
+    rtProgram->setUniform1i("u_maxSplit", scene->maxSplit);
     rtProgram->setUniform2f("u_windowSize", glm::vec2((float)width(), (float)height()));
 
     rtProgram->setUniform1i("u_nTris", (int)scene->triangles.size());
@@ -264,26 +331,109 @@ void Window::render() {
     scene->lightTexBuffer->bind(5);
     rtProgram->setUniform1i("u_lightBuffer", 5);
 
+    scene->triLightTexBuffer->bind(13);
+    rtProgram->setUniform1i("u_triLightBuffer", 13);
+
+    scene->lightAliasTexBuffer->bind(10);
+    rtProgram->setUniform1i("u_lightAliasBuffer", 10);
+
+    scene->lightBVHTexBuffer->bind(11);
+    rtProgram->setUniform1i("u_lightBVHBuffer", 11);
+
+    scene->lightLeafTexBuffer->bind(12);
+    rtProgram->setUniform1i("u_lightLeafBuffer", 12);
+
     // BVH
     scene->bvhTexBuffer->bind(6);
     rtProgram->setUniform1i("u_bvhBuffer", 6);
 
-    // Volume textures
+    // Volume atlases and the descriptors telling where each volume is placed in them
     if (!scene->volumes.empty()) {
-        rtProgram->setUniform1i("u_hasVolume", 1);
-        rtProgram->setUniform3f("u_bboxMin", scene->volumes[0].bboxMin);
-        rtProgram->setUniform3f("u_bboxMax", scene->volumes[0].bboxMax);
-        rtProgram->setUniform1f("u_densityMax", scene->volumes[0].maxValue);
+        scene->volumeTexBuffer->bind(25);
+        rtProgram->setUniform1i("u_volumeBuffer", 25);
+
+        const auto &sparseDensity = scene->volumes[0].sparseDensity;
+        const auto &sparseTemperature = scene->volumes[0].sparseTemperature;
+        if (sparseDensity) {
+            // Brick atlases take the places of the dense ones
+            sparseDensity->bind(23, 7);
+            sparseTemperature->bind(24, 8);
+            rtProgram->setUniform1i("u_densityIndirection", 23);
+            rtProgram->setUniform1i("u_temperatureIndirection", 24);
+            rtProgram->setUniform3i("u_densityAtlasBricks", sparseDensity->atlasBricks());
+            rtProgram->setUniform3i("u_temperatureAtlasBricks", sparseTemperature->atlasBricks());
+            rtProgram->setUniform1i("u_brickSize", sparseDensity->brickSize());
+        } else {
+            // The atlases of the first format take units 7 and 8, and those of the others the free ones from 26
+            for (size_t a = 0; a < scene->densityAtlasTex.size(); a++) {
+                const int densityUnit = a == 0 ? 7 : 24 + (int)a * 2;
+                const int temperatureUnit = densityUnit == 7 ? 8 : densityUnit + 1;
+                glActiveTexture(GL_TEXTURE0 + densityUnit);
+                glBindTexture(GL_TEXTURE_3D, scene->densityAtlasTex[a]);
+                glActiveTexture(GL_TEXTURE0 + temperatureUnit);
+                glBindTexture(GL_TEXTURE_3D, scene->temperatureAtlasTex[a]);
+                rtProgram->setUniform1i("u_densityTex[" + std::to_string(a) + "]", densityUnit);
+                rtProgram->setUniform1i("u_temperatureTex[" + std::to_string(a) + "]", temperatureUnit);
+            }
+        }
+        rtProgram->setUniform1i("u_densityTex[0]", 7);
+        rtProgram->setUniform1i("u_temperatureTex[0]", 8);
+
+        glActiveTexture(GL_TEXTURE22);
+        glBindTexture(GL_TEXTURE_3D, scene->majorantAtlasTex);
+        rtProgram->setUniform1i("u_majorantTex", 22);
+    }
+
+    // Environment map (selected with the same probability as all the area lights)
+    if (scene->envmap) {
+        scene->envmap->bind(14, 15);
+        rtProgram->setUniform1i("u_envmap", 14);
+        rtProgram->setUniform1i("u_envDistrib", 15);
+        rtProgram->setUniform1f("u_envSelectPmf", scene->lights.empty() ? 1.0f : 0.5f);
+    }
+
+    // Reservoirs and G-buffer of the previous frame
+    if (scene->directLighting == "restir") {
+        glActiveTexture(GL_TEXTURE16);
+        glBindTexture(GL_TEXTURE_2D, fbo[select ^ 0x1]->textureId(restirAttachment + 0));
+        rtProgram->setUniform1i("u_prevReservoir", 16);
+
+        glActiveTexture(GL_TEXTURE17);
+        glBindTexture(GL_TEXTURE_2D, fbo[select ^ 0x1]->textureId(restirAttachment + 1));
+        rtProgram->setUniform1i("u_prevGbufPos", 17);
+
+        glActiveTexture(GL_TEXTURE18);
+        glBindTexture(GL_TEXTURE_2D, fbo[select ^ 0x1]->textureId(restirAttachment + 2));
+        rtProgram->setUniform1i("u_prevGbufNorm", 18);
+    }
+
+    // Path guiding
+    if (sdTree) {
+        sdTree->spatialBuffer()->bind(19);
+        rtProgram->setUniform1i("u_guideSpatialBuffer", 19);
+
+        sdTree->directionalBuffer()->bind(20);
+        rtProgram->setUniform1i("u_guideDirBuffer", 20);
+
+        rtProgram->setUniform3f("u_guideBboxMin", sdTree->bboxMin());
+        rtProgram->setUniform3f("u_guideBboxMax", sdTree->bboxMax());
+        rtProgram->setUniform1f("u_guideFraction", 0.5f);
+    }
 
-        glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_3D, scene->volumes[0].densityTex);
-        rtProgram->setUniform1i("u_densityTex", 7);
+    // Radiance cache
+    if (radianceCache) {
+        radianceCache->buffer()->bind(21);
+        rtProgram->setUniform1i("u_cacheBuffer", 21);
+        rtProgram->setUniform1i("u_cacheTableSize", radianceCache->tableSize());
+        rtProgram->setUniform1f("u_cacheCellSize", radianceCache->cellSize());
+        rtProgram->setUniform1i("u_cacheDepth", scene->radianceCacheDepth);
+        rtProgram->setUniform1i("u_cacheEnabled", cacheEnabled ? 1 : 0);
+    }
 
-        glActiveTexture(GL_TEXTURE8);
-        glBindTexture(GL_TEXTURE_3D, scene->volumes[0].temperatureTex);
-        rtProgram->setUniform1i("u_temperatureTex", 8);
-    } else {
-        rtProgram->setUniform1i("u_hasVolume", 0);
+    // Sampler
+    if (scene->blueNoiseTex) {
+        scene->blueNoiseTex->bind(9);
+        rtProgram->setUniform1i("u_blueNoise", 9);
     }
 
     // Draw
@@ -349,6 +499,13 @@ void Window::keyboardDefault(int key, int scancode, int action, int mods) {
     // ImGui
     ImGui_ImplGlfw_KeyCallback(window_, key, scancode, action, mods);
 
+    // Toggle between the biased preview with the radiance cache and the unbiased rendering
+    if (key == GLFW_KEY_C && action == GLFW_PRESS && radianceCache) {
+        cacheEnabled = !cacheEnabled;
+        Info("Radiance cache: %s", cacheEnabled ? "on" : "off");
+        resetBuffer();
+    }
+
     // Custom
     keyboard(key, scancode, action, mods);
 }
@@ -364,22 +521,323 @@ void Window::cursorPosDefault(double xpos, double ypos) {
 }
 
 void Window::resetBuffer() {
+    frames = 0;
     fbo[0] = std::make_shared<FramebufferObject>(width(), height(), GL_RGB32F, GL_RGB, GL_FLOAT);
-    fbo[0]->addColorAttachment(width(), height(), GL_R32F, GL_RED, GL_FLOAT);
+    fbo[0]->addColorAttachment(width(), height(), GL_RGB32F, GL_RGB, GL_FLOAT);
     fbo[1] = std::make_shared<FramebufferObject>(width(), height(), GL_RGB32F, GL_RGB, GL_FLOAT);
-    fbo[1]->addColorAttachment(width(), height(), GL_R32F, GL_RED, GL_FLOAT);
+    fbo[1]->addColorAttachment(width(), height(), GL_RGB32F, GL_RGB, GL_FLOAT);
+    meanError = 0.0f;
+
+    // Reservoirs, G-buffer positions and normals for ReSTIR
+    restirAttachment = -1;
+    if (scene && scene->directLighting == "restir") {
+        restirAttachment = (int)fbo[0]->numTextures();
+        for (int i = 0; i < 2; i++) {
+            fbo[i]->addColorAttachment(width(), height(), GL_RGBA32F, GL_RGBA, GL_FLOAT);
+            fbo[i]->addColorAttachment(width(), height(), GL_RGBA32F, GL_RGBA, GL_FLOAT);
+            fbo[i]->addColorAttachment(width(), height(), GL_RGBA32F, GL_RGBA, GL_FLOAT);
+        }
+    }
+
+    // Path vertices recorded for learning the guiding distribution
+    guideAttachment = -1;
+    if (scene && scene->guiding) {
+        guideAttachment = (int)fbo[0]->numTextures();
+        for (int i = 0; i < 2; i++) {
+            fbo[i]->addColorAttachment(width(), height(), GL_RGBA32F, GL_RGBA, GL_FLOAT);
+            fbo[i]->addColorAttachment(width(), height(), GL_RGBA32F, GL_RGBA, GL_FLOAT);
+        }
+    }
+
+    // Diffuse vertices recorded for updating the radiance cache
+    cacheAttachment = -1;
+    if (scene && scene->radianceCache) {
+        cacheAttachment = (int)fbo[0]->numTextures();
+        for (int i = 0; i < 2; i++) {
+            fbo[i]->addColorAttachment(width(), height(), GL_RGBA32F, GL_RGBA, GL_FLOAT);
+            fbo[i]->addColorAttachment(width(), height(), GL_RGBA32F, GL_RGBA, GL_FLOAT);
+        }
+    }
 
-    GLenum bufs[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
     fbo[0]->bind();
-    glDrawBuffers(2, bufs);
+    fbo[0]->setRenderTargets(0, (int)fbo[0]->numTextures());
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     fbo[0]->unbind();
     fbo[1]->bind();
-    glDrawBuffers(2, bufs);
+    fbo[1]->setRenderTargets(0, (int)fbo[1]->numTextures());
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     fbo[0]->unbind();
 }
 
+std::shared_ptr<ShaderProgram> Window::raytraceProgram(const ShaderDefines &defines) {
+    // Each define set is compiled only once, and the variant is reused afterwards
+    const std::string key = ShaderStage::definesKey(defines);
+    const auto it = rtPrograms.find(key);
+    if (it != rtPrograms.end()) {
+        return it->second;
+    }
+
+    Info("Compile ray tracing shader: %s", key.c_str());
+    auto program = std::make_shared<ShaderProgram>();
+    program->build({ { "raytrace.vert", ShaderType::Vertex }, { "raytrace.frag", ShaderType::Fragment } }, defines);
+
+    rtPrograms[key] = program;
+    return program;
+}
+
+double Window::readRadiance(std::vector<float> &rgb) const {
+    // Read the accumulated radiance and sample counts of the latest frame
+    const int w = width();
+    const int h = height();
+    std::vector<float> sum(w * h * 3), count(w * h);
+    glBindTexture(GL_TEXTURE_2D, fbo[select]->textureId(0));
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, sum.data());
+    glBindTexture(GL_TEXTURE_2D, fbo[select]->textureId(1));
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, count.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Mean radiance from top to bottom (as image files)
+    double spp = 0.0;
+    rgb.resize(w * h * 3);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const int src = (h - y - 1) * w + x;
+            const float n = count[src];
+            for (int c = 0; c < 3; c++) {
+                rgb[(y * w + x) * 3 + c] = n > 0.0f ? sum[src * 3 + c] / n : 0.0f;
+            }
+            spp += n;
+        }
+    }
+    return spp / (w * h);
+}
+
+double Window::readTrackingSteps() const {
+    // Mean number of delta tracking steps (cell visits and tentative collisions) per sample
+    const int w = width();
+    const int h = height();
+    std::vector<float> count(w * h), steps(w * h);
+    glBindTexture(GL_TEXTURE_2D, fbo[select]->textureId(1));
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, count.data());
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_BLUE, GL_FLOAT, steps.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    double totalCount = 0.0, totalSteps = 0.0;
+    for (int i = 0; i < w * h; i++) {
+        totalCount += count[i];
+        totalSteps += steps[i];
+    }
+    return totalCount > 0.0 ? totalSteps / totalCount : 0.0;
+}
+
+void Window::saveRadiance(const std::string &filename) const {
+    std::vector<float> rgb;
+    readRadiance(rgb);
+    stbi_write_hdr(filename.c_str(), width(), height(), 3, rgb.data());
+    Info("Save: %s", filename.c_str());
+}
+
+void Window::updateStatistics() {
+    frames += 1;
+    bool finished = maxSamples > 0 && frames * samplesPerCycle >= maxSamples;
+    const bool logFrame = (frames & (frames - 1)) == 0 || finished;
+    const bool checkTarget = targetRMSE > 0.0 && !reference.empty() && frames % 8 == 0;
+
+    if ((statsWriter.is_open() && logFrame) || checkTarget) {
+        // Read back is excluded from the render time for fair equal-time comparisons
+        Timer overhead;
+        overhead.start();
+        glFinish();
+        const double elapsed = renderTimer.count() - statsOverhead;
+
+        std::vector<float> rgb;
+        const double spp = readRadiance(rgb);
+
+        double rmse = std::numeric_limits<double>::quiet_NaN();
+        if (!reference.empty()) {
+            if (refWidth == width() && refHeight == height()) {
+                double sse = 0.0;
+                for (size_t i = 0; i < rgb.size(); i++) {
+                    const double diff = rgb[i] - reference[i];
+                    sse += diff * diff;
+                }
+                rmse = std::sqrt(sse / rgb.size());
+            } else {
+                Warn("Reference size %d x %d does not match %d x %d!", refWidth, refHeight, width(), height());
+            }
+        }
+
+        if (checkTarget && rmse <= targetRMSE) {
+            Info("Target RMSE %f reached: %.3f sec, %.1f spp", rmse, elapsed, spp);
+            finished = true;
+        }
+
+        if (statsWriter.is_open() && (logFrame || finished)) {
+            // Efficiency as the inverse of MSE times render time
+            const double efficiency = 1.0 / (rmse * rmse * elapsed);
+            const double steps = readTrackingSteps();
+            statsWriter << frames << "," << spp << "," << elapsed << "," << rmse << "," << efficiency << "," << steps
+                        << std::endl;
+        }
+        statsOverhead += overhead.count();
+    }
+
+    if (finished) {
+        if (!scene->volumes.empty()) {
+            // Tracking throughput tells the bandwidth saved by reduced-precision volume formats
+            const double steps = readTrackingSteps();
+            const double elapsed = renderTimer.count() - statsOverhead;
+            const double samples = (double)frames * samplesPerCycle * width() * height();
+            Info("Volume tracking: %.2f steps per sample, %.1f M steps/sec", steps,
+                 steps * samples / std::max(elapsed, 1.0e-6) * 1.0e-6);
+        }
+
+        const int numFrames = scene->animationFrames();
+        if (numFrames > 1) {
+            char filename[256];
+            snprintf(filename, sizeof(filename), "output_%04d.hdr", animationFrame);
+            saveRadiance(filename);
+            if (animationFrame + 1 < numFrames) {
+                // Rendering resumes once the next frame is on the GPU
+                animationPending = true;
+                animationRenderTime = renderTimer.count() - statsOverhead;
+                waitTimer.start();
+                return;
+            }
+        } else {
+            saveRadiance("output.hdr");
+        }
+        glfwSetWindowShouldClose(window_, GLFW_TRUE);
+    }
+}
+
+bool Window::updateAnimation() {
+    scene->updateVolumes();
+    if (!animationPending) {
+        return true;
+    }
+
+    if (!scene->advanceVolumes()) {
+        return false;
+    }
+
+    Info("Animation frame %d: render %.3f sec, wait for volumes %.3f sec", animationFrame, animationRenderTime,
+         waitTimer.count());
+
+    animationPending = false;
+    animationFrame += 1;
+    resetBuffer();
+    renderTimer.reset();
+    statsOverhead = 0.0;
+    return true;
+}
+
+void Window::updateSampling() {
+    if (!scene->adaptiveSampling || frames % 8 != 0) {
+        return;
+    }
+
+    // Read back the first and second moments of all the pixels
+    const int w = width();
+    const int h = height();
+    std::vector<float> sum(w * h * 3), moments(w * h * 2);
+    glBindTexture(GL_TEXTURE_2D, fbo[select]->textureId(0));
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, sum.data());
+    glBindTexture(GL_TEXTURE_2D, fbo[select]->textureId(1));
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_FLOAT, moments.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Mean relative error of the pixels which are not converged yet (same as "relativeError" in the shader)
+    double total = 0.0;
+    int active = 0;
+    for (int i = 0; i < w * h; i++) {
+        const double n = moments[i * 2 + 0];
+        if (n < std::max(scene->adaptiveMinSamples, 2)) {
+            continue;
+        }
+
+        const double lum = 0.2126 * sum[i * 3 + 0] + 0.7152 * sum[i * 3 + 1] + 0.0722 * sum[i * 3 + 2];
+        const double mean = lum / n;
+        const double var = std::max(moments[i * 2 + 1] / n - mean * mean, 0.0) * n / (n - 1.0);
+        const double error = std::sqrt(var / n) / (mean + 1.0e-2);
+        if (error >= scene->adaptiveThreshold) {
+            total += error;
+            active += 1;
+        }
+    }
+    meanError = active > 0 ? (float)(total / active) : 0.0f;
+}
+
+void Window::updateGuiding() {
+    if (!sdTree || guideIteration >= scene->guidingIterations) {
+        return;
+    }
+
+    // Read back the path vertices recorded in the latest frame
+    const int w = width();
+    const int h = height();
+    std::vector<float> rec0(w * h * 4), rec1(w * h * 4);
+    glBindTexture(GL_TEXTURE_2D, fbo[select]->textureId(guideAttachment + 0));
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, rec0.data());
+    glBindTexture(GL_TEXTURE_2D, fbo[select]->textureId(guideAttachment + 1));
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, rec1.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (int i = 0; i < w * h; i++) {
+        if (rec1[i * 4 + 3] > 0.0f) {
+            const glm::vec3 pos(rec0[i * 4 + 0], rec0[i * 4 + 1], rec0[i * 4 + 2]);
+            const glm::vec3 dir(rec1[i * 4 + 0], rec1[i * 4 + 1], rec1[i * 4 + 2]);
+            sdTree->record(pos, dir, rec0[i * 4 + 3]);
+        }
+    }
+
+    // Iteration "k" takes 2^k frames, and then the distribution is refined
+    guideFrames += 1;
+    if (guideFrames >= (1 << guideIteration)) {
+        sdTree->refine(guideIteration);
+        sdTree->upload();
+        Info("Path guiding: iteration %d finished", guideIteration + 1);
+        guideIteration += 1;
+        guideFrames = 0;
+    }
+}
+
+void Window::updateRadianceCache() {
+    // The cache is updated only in the preview mode
+    if (!radianceCache || !cacheEnabled) {
+        return;
+    }
+
+    // Only one band of rows is read back in each frame, so the stall is a fraction of a full readback
+    // while the whole image is still covered over "cacheReadbackBands" frames
+    const int w = width();
+    const int h = height();
+    const int band = cacheFrames % cacheReadbackBands;
+    const int y0 = h * band / cacheReadbackBands;
+    const int rows = h * (band + 1) / cacheReadbackBands - y0;
+    std::vector<float> rec0(w * rows * 4), rec1(w * rows * 4);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo[select]->getId());
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + cacheAttachment + 0);
+    glReadPixels(0, y0, w, rows, GL_RGBA, GL_FLOAT, rec0.data());
+    glReadBuffer(GL_COLOR_ATTACHMENT0 + cacheAttachment + 1);
+    glReadPixels(0, y0, w, rows, GL_RGBA, GL_FLOAT, rec1.data());
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+    for (int i = 0; i < w * rows; i++) {
+        if (rec1[i * 4 + 3] > 0.0f) {
+            const glm::vec3 pos(rec0[i * 4 + 0], rec0[i * 4 + 1], rec0[i * 4 + 2]);
+            const glm::vec3 value(rec1[i * 4 + 0], rec1[i * 4 + 1], rec1[i * 4 + 2]);
+            radianceCache->record(pos, (int)rec0[i * 4 + 3] - 1, value);
+        }
+    }
+
+    // Uploading the whole table is costly, so do it less often as the cache converges
+    cacheFrames += 1;
+    if ((cacheFrames & (cacheFrames - 1)) == 0 || cacheFrames % 16 == 0) {
+        radianceCache->upload();
+    }
+}
+
 void Window::saveCurrentFrame(const std::string &filename, bool overwrite) const {
     // Read pixels
     const int w = width();
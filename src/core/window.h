@@ -2,12 +2,17 @@
 
 #include <string>
 #include <memory>
+#include <fstream>
+#include <vector>
+#include <unordered_map>
 
 #include "api.h"
 #include "common.h"
 #include "event.h"
 #include "timer.h"
 #include "scene.h"
+#include "sd_tree.h"
+#include "radiance_cache.h"
 
 namespace glrt {
 
@@ -16,6 +21,17 @@ public:
     Window();
     void mainloop(const std::shared_ptr<Scene> &scene, double fps = -1.0);
 
+    //! Reference image (*.hdr) to measure RMSE of the progressive estimate against
+    void setReference(const std::string &filename);
+    //! CSV file to which frame, spp, render time, RMSE, efficiency and volume tracking steps are written
+    void setStatsFile(const std::string &filename);
+    //! Save the mean radiance as "output.hdr" and quit after this many samples (zero means no limit)
+    void setMaxSamples(int spp) { maxSamples = spp; }
+    //! Save the mean radiance as "output.hdr" and quit once RMSE gets below this value (requires a reference)
+    void setTargetRMSE(double rmse) { targetRMSE = rmse; }
+    //! Number of samples per pixel in each frame
+    void setSamplesPerCycle(int spp) { samplesPerCycle = std::max(1, spp); }
+
     inline int width() const {
         int width, height;
         glfwGetFramebufferSize(window_, &width, &height);
@@ -42,6 +58,15 @@ private:
     void cursorPosDefault(double xpos, double ypos);
 
     void resetBuffer();
+    double readRadiance(std::vector<float> &rgb) const;
+    double readTrackingSteps() const;
+    void saveRadiance(const std::string &filename) const;
+    void updateStatistics();
+    void updateSampling();
+    void updateGuiding();
+    void updateRadianceCache();
+    bool updateAnimation();
+    std::shared_ptr<ShaderProgram> raytraceProgram(const ShaderDefines &defines);
     void saveCurrentFrame(const std::string &filename, bool overwrite = true) const;
 
     GLFWwindow *window_;
@@ -51,9 +76,39 @@ private:
     std::shared_ptr<FramebufferObject> fbo[2] = { 0 };
     std::shared_ptr<ShaderProgram> screenProgram = nullptr;
     std::shared_ptr<ShaderProgram> rtProgram = nullptr;
+    std::unordered_map<std::string, std::shared_ptr<ShaderProgram>> rtPrograms;
+    int select = 0;
     int trials = 0;
     Timer timer;
 
+    int frames = 0;
+    int maxSamples = 0;
+    double targetRMSE = 0.0;
+    int samplesPerCycle = 1;
+    float meanError = 0.0f;
+    Timer renderTimer;
+    double statsOverhead = 0.0;
+    std::ofstream statsWriter;
+    std::vector<float> reference;
+    int refWidth = 0, refHeight = 0;
+
+    int restirAttachment = -1;
+    int guideAttachment = -1;
+    std::shared_ptr<SDTree> sdTree = nullptr;
+    int guideIteration = 0;
+    int guideFrames = 0;
+
+    int cacheAttachment = -1;
+    std::shared_ptr<RadianceCache> radianceCache = nullptr;
+    bool cacheEnabled = false;
+    int cacheFrames = 0;
+    static const int cacheReadbackBands = 8;
+
+    int animationFrame = 0;
+    bool animationPending = false;
+    double animationRenderTime = 0.0;
+    Timer waitTimer;
+
     std::shared_ptr<Scene> scene = nullptr;
 };
 
@@ -4,13 +4,36 @@
 #include "core/window.h"
 #include "core/argparse.h"
 #include "core/scene.h"
+#include "core/shader_program.h"
 using namespace glrt;
 
+// Mode of the shader and scene caches ("readwrite" for an unknown name)
+BinaryCacheMode parseCacheMode(const std::string &name) {
+    if (name == "readonly") {
+        return BinaryCacheMode::ReadOnly;
+    } else if (name == "rebuild") {
+        return BinaryCacheMode::Rebuild;
+    } else if (name == "off") {
+        return BinaryCacheMode::Disabled;
+    } else if (name != "readwrite") {
+        Warn("Unknown cache mode: %s", name.c_str());
+    }
+    return BinaryCacheMode::ReadWrite;
+}
+
 int main(int argc, char **argv) {
     // Parse command line arguments
     ArgumentParser &parser = ArgumentParser::getInstance();
     parser.addArgument("-i", "--input", "", true, "Input XML file");
     parser.addArgument("-s", "--sample-per-cycle", "4", false,"Samples per cycle");
+    parser.addArgument("", "--shader-cache", "", false, "Directory of compiled shader binaries (default: next to shaders)");
+    parser.addArgument("", "--shader-cache-mode", "readwrite", false, "Shader cache mode: readwrite, readonly, rebuild or off");
+    parser.addArgument("", "--scene-cache", "", false, "Directory of scene snapshots (default: next to shaders)");
+    parser.addArgument("", "--scene-cache-mode", "readwrite", false, "Scene cache mode: readwrite, readonly, rebuild or off");
+    parser.addArgument("", "--reference", "", false, "Reference image (*.hdr) for RMSE measurement");
+    parser.addArgument("", "--stats", "", false, "CSV file to write convergence statistics");
+    parser.addArgument("", "--max-spp", "0", false, "Stop and save \"output.hdr\" after this many samples per pixel");
+    parser.addArgument("", "--target-rmse", "0", false, "Stop and save \"output.hdr\" once RMSE to the reference gets below this value");
     if (!parser.parse(argc, argv)) {
         std::cout << parser.helpText() << std::endl;
         return 1;
@@ -19,8 +42,33 @@ int main(int argc, char **argv) {
     // Parameters
     const std::string filename = parser.getString("input");
 
+    // Shader binary cache
+    std::string cacheDir = parser.getString("shader-cache");
+    if (cacheDir.empty()) {
+        cacheDir = (fs::path(parser.getExecutablePath().c_str()).parent_path() / fs::path("../shader_cache")).string();
+    }
+
+    ShaderProgram::setBinaryCache(cacheDir, parseCacheMode(parser.getString("shader-cache-mode")));
+
+    // Scene snapshot cache
+    std::string sceneCacheDir = parser.getString("scene-cache");
+    if (sceneCacheDir.empty()) {
+        sceneCacheDir = (fs::path(parser.getExecutablePath().c_str()).parent_path() / fs::path("../scene_cache")).string();
+    }
+
+    Scene::setSnapshotCache(sceneCacheDir, parseCacheMode(parser.getString("scene-cache-mode")));
+
     // Initialize window
     auto window = std::make_unique<Window>();
+    if (!parser.getString("reference").empty()) {
+        window->setReference(parser.getString("reference"));
+    }
+    if (!parser.getString("stats").empty()) {
+        window->setStatsFile(parser.getString("stats"));
+    }
+    window->setMaxSamples(parser.getInt("max-spp"));
+    window->setTargetRMSE(parser.getDouble("target-rmse"));
+    window->setSamplesPerCycle(parser.getInt("sample-per-cycle"));
 
     // Parse scene JSON
     auto scene = std::make_shared<Scene>();
@@ -1,9 +1,101 @@
 #version 410
 #extension GL_ARB_gpu_shader_fp64 : enable
 
+// ----------------------------------------------------------------------------
+// Scene features (the host program specializes them per scene)
+// ----------------------------------------------------------------------------
+#ifndef ENABLE_VOLUME
 #define ENABLE_VOLUME 0
+#endif
+
+#ifndef ENABLE_SPARSE_VOLUME
+#define ENABLE_SPARSE_VOLUME 0
+#endif
+
+#ifndef ENABLE_EMISSION_VOLUME
+#define ENABLE_EMISSION_VOLUME 0
+#endif
+
+#ifndef VOLUME_ATLASES
+#define VOLUME_ATLASES 1
+#endif
+
+#ifndef ENABLE_MEDIUM_NEE
+#define ENABLE_MEDIUM_NEE 0
+#endif
+
+#ifndef ENABLE_DIFFUSE
+#define ENABLE_DIFFUSE 1
+#endif
+
+#ifndef ENABLE_CONDUCTOR
+#define ENABLE_CONDUCTOR 1
+#endif
+
+#ifndef ENABLE_ENVMAP
+#define ENABLE_ENVMAP 0
+#endif
+
+#ifndef ENABLE_THIN_LENS
+#define ENABLE_THIN_LENS 1
+#endif
+
+#define LIGHT_SAMPLER_UNIFORM 0
+#define LIGHT_SAMPLER_POWER 1
+#define LIGHT_SAMPLER_BVH 2
+#ifndef LIGHT_SAMPLER
+#define LIGHT_SAMPLER LIGHT_SAMPLER_POWER
+#endif
+
+#define TRIANGLE_SAMPLER_AREA 0
+#define TRIANGLE_SAMPLER_SOLID_ANGLE 1
+#ifndef TRIANGLE_SAMPLER
+#define TRIANGLE_SAMPLER TRIANGLE_SAMPLER_SOLID_ANGLE
+#endif
+
+#define DIRECT_LIGHTING_NEE 0
+#define DIRECT_LIGHTING_RESTIR 1
+#ifndef DIRECT_LIGHTING
+#define DIRECT_LIGHTING DIRECT_LIGHTING_NEE
+#endif
+
+#ifndef RESTIR_CANDIDATES
+#define RESTIR_CANDIDATES 8
+#endif
+
+#ifndef RESTIR_SPATIAL_NEIGHBORS
+#define RESTIR_SPATIAL_NEIGHBORS 3
+#endif
+
+#ifndef RESTIR_SPATIAL_RADIUS
+#define RESTIR_SPATIAL_RADIUS 16.0
+#endif
+
+#ifndef RESTIR_MAX_HISTORY
+#define RESTIR_MAX_HISTORY 20
+#endif
+
+#ifndef ENABLE_GUIDING
+#define ENABLE_GUIDING 0
+#endif
+
+#ifndef ENABLE_RADIANCE_CACHE
+#define ENABLE_RADIANCE_CACHE 0
+#endif
+
+#define RUSSIAN_ROULETTE_THROUGHPUT 0
+#define RUSSIAN_ROULETTE_ADRRS 1
+#ifndef RUSSIAN_ROULETTE
+#define RUSSIAN_ROULETTE RUSSIAN_ROULETTE_THROUGHPUT
+#endif
+
+#define SAMPLER_INDEPENDENT 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+#ifndef SAMPLER_TYPE
+#define SAMPLER_TYPE SAMPLER_INDEPENDENT
+#endif
 
-//#define USE_DOUBLE
 #ifdef USE_DOUBLE
 #define Float double
 #define Vec2 dvec2
@@ -22,6 +114,32 @@ const Float EPS = 1.0e-4;
 
 layout(location = 0) out vec4 out_color;
 layout(location = 1) out vec4 out_count;
+#if DIRECT_LIGHTING == DIRECT_LIGHTING_RESTIR
+layout(location = 2) out vec4 out_reservoir;
+layout(location = 3) out vec4 out_gbufPos;
+layout(location = 4) out vec4 out_gbufNorm;
+#endif
+#if ENABLE_GUIDING
+#if DIRECT_LIGHTING == DIRECT_LIGHTING_RESTIR
+layout(location = 5) out vec4 out_guideRecord0;
+layout(location = 6) out vec4 out_guideRecord1;
+#else
+layout(location = 2) out vec4 out_guideRecord0;
+layout(location = 3) out vec4 out_guideRecord1;
+#endif
+#endif
+#if ENABLE_RADIANCE_CACHE
+#if DIRECT_LIGHTING == DIRECT_LIGHTING_RESTIR
+layout(location = 5) out vec4 out_cacheRecord0;
+layout(location = 6) out vec4 out_cacheRecord1;
+#elif ENABLE_GUIDING
+layout(location = 4) out vec4 out_cacheRecord0;
+layout(location = 5) out vec4 out_cacheRecord1;
+#else
+layout(location = 2) out vec4 out_cacheRecord0;
+layout(location = 3) out vec4 out_cacheRecord1;
+#endif
+#endif
 
 // ----------------------------------------------------------------------------
 // Material types
@@ -47,6 +165,15 @@ uniform vec2 u_seed;
 uniform int u_maxDepth = 16;
 uniform int u_nSamples = 16;
 
+// Adaptive sampling
+uniform int u_adaptive = 0;
+uniform int u_adaptiveMinSamples = 16;
+uniform float u_adaptiveThreshold = 0.01;
+uniform float u_meanError = 0.0;
+#if SAMPLER_TYPE == SAMPLER_BLUE_NOISE
+uniform sampler2D u_blueNoise;
+#endif
+
 // Frame
 uniform vec2 u_windowSize;
 uniform sampler2D u_framebuffer;
@@ -62,14 +189,29 @@ uniform samplerBuffer u_bvhBuffer;
 // Light source
 uniform int u_nLights;
 uniform samplerBuffer u_lightBuffer;
+uniform samplerBuffer u_triLightBuffer;
 
-// Volume
-uniform bool u_hasVolume = false;
-uniform float u_densityMax = 1.0;
-uniform vec3 u_bboxMin = vec3(0.0);
-uniform vec3 u_bboxMax = vec3(1.0);
-uniform sampler3D u_densityTex;
-uniform sampler3D u_temperatureTex;
+#if ENABLE_ENVMAP
+uniform sampler2D u_envmap;
+uniform sampler2D u_envDistrib;
+uniform float u_envSelectPmf;
+#endif
+uniform samplerBuffer u_lightAliasBuffer;
+uniform samplerBuffer u_lightBVHBuffer;
+uniform samplerBuffer u_lightLeafBuffer;
+
+// Volume (a pair of atlases per storage format, and "u_volumeBuffer" tells where each volume is placed)
+uniform samplerBuffer u_volumeBuffer;
+uniform sampler3D u_densityTex[VOLUME_ATLASES];
+uniform sampler3D u_temperatureTex[VOLUME_ATLASES];  // Precomputed emission with ENABLE_EMISSION_VOLUME
+uniform sampler3D u_majorantTex;
+#if ENABLE_SPARSE_VOLUME
+uniform isampler3D u_densityIndirection;
+uniform isampler3D u_temperatureIndirection;
+uniform ivec3 u_densityAtlasBricks;
+uniform ivec3 u_temperatureAtlasBricks;
+uniform int u_brickSize = 8;
+#endif
 
 // Constant parameters
 const Float PI = 3.1415926535897932384626433832795;
@@ -93,21 +235,121 @@ struct Intersection {
     Vec3 norm;
     Float tHit;
     int mtrl;
+    int triID;
 };
 
+Float luminance(in Vec3 L) {
+    return dot(L, Vec3(0.2126, 0.7152, 0.0722));
+}
+
 // ----------------------------------------------------------------------------
 // Random number generator
 // ----------------------------------------------------------------------------
 
 Vec2 randState;
+uint pixelSeed;
+uint sampleIndex;
+int sampleDim;
+bool hasNextSample;
+Float nextSample;
+
+uint hashUint(uint x) {
+    // "lowbias32" by C. Wellons
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+uint hashCombine(uint seed, uint v) {
+    return seed ^ (hashUint(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+float uintToFloat(uint x) {
+    return float(x >> 8) * (1.0 / 16777216.0);
+}
+
+// Sample dimensions are consumed in pairs, each of which is a separately
+// randomized 2D point set indexed by the accumulated sample count.
+void startSample(uint index) {
+    sampleIndex = index;
+    sampleDim = 0;
+    hasNextSample = false;
+}
+
+#if SAMPLER_TYPE == SAMPLER_SOBOL
+uint sobolSecondDim(uint index) {
+    // See "Efficient Multidimensional Sampling" by T. Kollig and A. Keller, 2002.
+    uint r = 0u;
+    for (uint v = 1u << 31; index != 0u; index >>= 1, v ^= v >> 1) {
+        if ((index & 1u) != 0u) {
+            r ^= v;
+        }
+    }
+    return r;
+}
+
+uint laineKarrasPermutation(uint x, uint seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+uint nestedUniformScramble(uint x, uint seed) {
+    // See "Practical Hash-based Owen Scrambling" by B. Burley in JCGT, 2020.
+    x = bitfieldReverse(x);
+    x = laineKarrasPermutation(x, seed);
+    x = bitfieldReverse(x);
+    return x;
+}
+
+vec2 sample2D(int pair) {
+    uint seed = hashCombine(pixelSeed, uint(pair));
+    uint index = nestedUniformScramble(sampleIndex, seed);
+    uint x = nestedUniformScramble(bitfieldReverse(index), hashCombine(seed, 0x5bd1e995u));
+    uint y = nestedUniformScramble(sobolSecondDim(index), hashCombine(seed, 0x27d4eb2fu));
+    return vec2(uintToFloat(x), uintToFloat(y));
+}
+#elif SAMPLER_TYPE == SAMPLER_BLUE_NOISE
+vec2 sample2D(int pair) {
+    // Blue-noise offsets (toroidally shifted per dimension pair) rotate
+    // the R2 sequence, so errors are distributed as blue noise on screen.
+    ivec2 size = textureSize(u_blueNoise, 0);
+    uint h = hashUint(uint(pair));
+    ivec2 pixel = (ivec2(gl_FragCoord.xy) + ivec2(h & 0xffffu, h >> 16)) % size;
+    vec2 noise = texelFetch(u_blueNoise, pixel, 0).xy;
+
+    uvec2 offset = uvec2(noise * 16777215.0) << 8;
+    uvec2 r2 = uvec2(3242174889u, 2447445414u) * sampleIndex + offset;
+    return vec2(uintToFloat(r2.x), uintToFloat(r2.y));
+}
+#endif
 
 Float rand() {
+    #if SAMPLER_TYPE == SAMPLER_INDEPENDENT
     Float a = 12.9898;
     Float b = 78.233;
     Float c = 43758.5453;
     randState.x = fract(sin(float(dot(randState.xy - u_seed, Vec2(a, b)))) * c);
     randState.y = fract(sin(float(dot(randState.xy - u_seed, Vec2(a, b)))) * c);
     return randState.x;
+    #else
+    if (hasNextSample) {
+        hasNextSample = false;
+        return nextSample;
+    }
+
+    vec2 u = sample2D(sampleDim);
+    sampleDim += 1;
+    nextSample = Float(u.y);
+    hasNextSample = true;
+    return Float(u.x);
+    #endif
 }
 
 // ----------------------------------------------------------------------------
@@ -141,14 +383,238 @@ Vec3 blackBody(Float T) {
     return Vec3(R, G, B);
 }
 
-Float densityLookup(in Vec3 pos) {
-    Vec3 uvw = (pos - u_bboxMin) / (u_bboxMax - u_bboxMin);
-    return texture(u_densityTex, vec3(uvw)).x;
+// ----------------------------------------------------------------------------
+// Volumes
+// ----------------------------------------------------------------------------
+
+const int VOLUME_STRIDE = 7;
+
+struct VolumeInfo {
+    Vec3 bboxMin;
+    Vec3 bboxMax;
+    int atlas;  // Index of the atlases of the storage format
+    ivec3 atlasOrigin;
+    ivec3 size;
+    ivec3 majorantOrigin;
+    ivec3 majorantSize;
+    int majorantCellSize;  // Voxels along each side of a majorant cell (the last cells may stick out)
+    vec4 decode;  // value = texel * x + y for density, and texel * z + w for temperature
+    Float emissionScale;
+};
+
+VolumeInfo fetchVolume(int id) {
+    VolumeInfo vol;
+    vec4 v0 = texelFetch(u_volumeBuffer, id * VOLUME_STRIDE + 0);
+    vec4 v1 = texelFetch(u_volumeBuffer, id * VOLUME_STRIDE + 1);
+    vol.bboxMin = v0.xyz;
+    vol.bboxMax = v1.xyz;
+    vol.emissionScale = v1.w;
+    vec4 v2 = texelFetch(u_volumeBuffer, id * VOLUME_STRIDE + 2);
+    vol.atlasOrigin = ivec3(v2.xyz);
+    vol.atlas = int(v2.w);
+    vol.size = ivec3(texelFetch(u_volumeBuffer, id * VOLUME_STRIDE + 3).xyz);
+    vol.majorantOrigin = ivec3(texelFetch(u_volumeBuffer, id * VOLUME_STRIDE + 4).xyz);
+    vec4 v5 = texelFetch(u_volumeBuffer, id * VOLUME_STRIDE + 5);
+    vol.majorantSize = ivec3(v5.xyz);
+    vol.majorantCellSize = int(v5.w);
+    vol.decode = texelFetch(u_volumeBuffer, id * VOLUME_STRIDE + 6);
+    return vol;
+}
+
+// Trilinear lookup of the volume in a shared atlas (clamped to the edge of the volume)
+vec4 atlasLookup(in sampler3D atlas, in VolumeInfo vol, in Vec3 uvw) {
+    Vec3 p = clamp(uvw * Vec3(vol.size), Vec3(0.5), Vec3(vol.size) - 0.5) + Vec3(vol.atlasOrigin);
+    return textureLod(atlas, vec3(p / Vec3(textureSize(atlas, 0))), 0.0);
+}
+
+// Samplers are chosen with loop indices, as they cannot be indexed by the volume
+vec4 densityAtlasLookup(in VolumeInfo vol, in Vec3 uvw) {
+    for (int i = 1; i < VOLUME_ATLASES; i++) {
+        if (vol.atlas == i) {
+            return atlasLookup(u_densityTex[i], vol, uvw);
+        }
+    }
+    return atlasLookup(u_densityTex[0], vol, uvw);
+}
+
+vec4 temperatureAtlasLookup(in VolumeInfo vol, in Vec3 uvw) {
+    for (int i = 1; i < VOLUME_ATLASES; i++) {
+        if (vol.atlas == i) {
+            return atlasLookup(u_temperatureTex[i], vol, uvw);
+        }
+    }
+    return atlasLookup(u_temperatureTex[0], vol, uvw);
 }
 
-Float temperatureLookup(in Vec3 pos) {
-    Vec3 uvw = (pos - u_bboxMin) / (u_bboxMax - u_bboxMin);
-    return texture(u_temperatureTex, vec3(uvw)).x;
+#if ENABLE_SPARSE_VOLUME
+// Trilinear lookup in the brick atlas (empty bricks are zero including their aprons)
+Float sparseLookup(in isampler3D indirection, in sampler3D atlas, in ivec3 atlasBricks, in VolumeInfo vol,
+                   in Vec3 uvw) {
+    Vec3 q = clamp(uvw * Vec3(vol.size), Vec3(0.0), Vec3(vol.size) - 1.0e-3);
+    ivec3 brick = ivec3(q) / u_brickSize;
+    int index = texelFetch(indirection, brick, 0).x;
+    if (index < 0) {
+        return 0.0;
+    }
+
+    ivec3 slot = ivec3(index % atlasBricks.x, (index / atlasBricks.x) % atlasBricks.y,
+                       index / (atlasBricks.x * atlasBricks.y));
+    Vec3 p = Vec3(slot * (u_brickSize + 2)) + 1.0 + (q - Vec3(brick * u_brickSize));
+    return textureLod(atlas, vec3(p / Vec3(textureSize(atlas, 0))), 0.0).x;
+}
+#endif
+
+Float densityLookup(in VolumeInfo vol, in Vec3 pos) {
+    Vec3 uvw = (pos - vol.bboxMin) / (vol.bboxMax - vol.bboxMin);
+    #if ENABLE_SPARSE_VOLUME
+    Float texel = sparseLookup(u_densityIndirection, u_densityTex[0], u_densityAtlasBricks, vol, uvw);
+    #else
+    Float texel = densityAtlasLookup(vol, uvw).x;
+    #endif
+    return texel * vol.decode.x + vol.decode.y;
+}
+
+Float temperatureLookup(in VolumeInfo vol, in Vec3 pos) {
+    Vec3 uvw = (pos - vol.bboxMin) / (vol.bboxMax - vol.bboxMin);
+    #if ENABLE_SPARSE_VOLUME
+    Float texel = sparseLookup(u_temperatureIndirection, u_temperatureTex[0], u_temperatureAtlasBricks, vol, uvw);
+    #else
+    Float texel = temperatureAtlasLookup(vol, uvw).x;
+    #endif
+    return texel * vol.decode.z + vol.decode.w;
+}
+
+// Black body radiation at "pos"
+Vec3 emissionLookup(in VolumeInfo vol, in Vec3 pos) {
+    #if ENABLE_EMISSION_VOLUME
+    Vec3 uvw = (pos - vol.bboxMin) / (vol.bboxMax - vol.bboxMin);
+    return temperatureAtlasLookup(vol, uvw).rgb * vol.emissionScale;
+    #else
+    return blackBody(temperatureLookup(vol, pos) * 1.0e2);
+    #endif
+}
+
+// ----------------------------------------------------------------------------
+// Delta and ratio tracking
+// ----------------------------------------------------------------------------
+
+const int MAX_TRACKING_STEPS = 1024;
+const int TRACKING_COLLIDE = 0;
+const int TRACKING_ESCAPE = 1;
+const int TRACKING_ABORT = 2;
+
+// Transmittance below which ratio tracking is terminated by Russian roulette
+const Float RATIO_TRACKING_ROULETTE = 0.1;
+
+// Maximum number of media boundaries crossed by a shadow ray
+const int MAX_SHADOW_SEGMENTS = 8;
+
+// Scattering and absorption coefficients of the media (scaled by the density)
+const Float MEDIUM_SIGMA_S = 0.1;
+const Float MEDIUM_SIGMA_A = 0.06;
+
+// Cell visits and tentative collisions of the current sample (for statistics)
+int trackingSteps;
+
+// Tracking with the DDA traversal of the majorant grid, which skips empty cells.
+// Delta tracking returns TRACKING_COLLIDE with the distance "t" of a real collision before "tMax",
+// and ratio tracking ("ratio") multiplies "Tr" by the ratio of the null collision coefficients instead.
+int trackMedium(in Ray ray, in Float tMax, in Float sigT, in VolumeInfo vol, bool ratio, out Float t,
+                inout Float Tr) {
+    t = tMax;
+
+    // Clip the ray by the volume bounds. The ray never crosses the slabs which it is parallel to,
+    // so it misses the volume if the origin is outside of them
+    bvec3 parallel = lessThan(abs(ray.d), Vec3(1.0e-8));
+    for (int a = 0; a < 3; a++) {
+        if (parallel[a] && (ray.o[a] < vol.bboxMin[a] || ray.o[a] > vol.bboxMax[a])) {
+            return TRACKING_ESCAPE;
+        }
+    }
+    Vec3 invD = 1.0 / mix(ray.d, Vec3(1.0), parallel);
+    Vec3 t0 = (vol.bboxMin - ray.o) * invD;
+    Vec3 t1 = (vol.bboxMax - ray.o) * invD;
+    Vec3 tNear = mix(min(t0, t1), Vec3(-INFTY), parallel);
+    Vec3 tFar = mix(max(t0, t1), Vec3(INFTY), parallel);
+    Float tEnter = max(0.0, max(tNear.x, max(tNear.y, tNear.z)));
+    Float tExit = min(tMax, min(tFar.x, min(tFar.y, tFar.z)));
+    if (tEnter >= tExit) {
+        return TRACKING_ESCAPE;
+    }
+
+    // Initial cell and the distances to the next cell boundaries. Cells span the voxel blocks whose maximum
+    // is stored in the grid, so they are aligned with the voxels rather than dividing the bounds evenly
+    Vec3 cellWidth = (vol.bboxMax - vol.bboxMin) / Vec3(vol.size) * Float(vol.majorantCellSize);
+    Vec3 p = (ray.o + tEnter * ray.d - vol.bboxMin) / cellWidth;
+    ivec3 cell = clamp(ivec3(floor(p)), ivec3(0), vol.majorantSize - 1);
+    ivec3 cellStep = ivec3(sign(ray.d));
+    Vec3 tDelta = mix(abs(cellWidth * invD), Vec3(INFTY), parallel);
+    Vec3 boundary = vol.bboxMin + (Vec3(cell) + Vec3(greaterThan(ray.d, Vec3(0.0)))) * cellWidth;
+    Vec3 tNext = mix((boundary - ray.o) * invD, Vec3(INFTY), parallel);
+
+    Float tCurrent = tEnter;
+    for (int i = 0; i < MAX_TRACKING_STEPS; i++) {
+        trackingSteps += 1;
+        // Boundaries behind the current point (the entry point rounded into the previous cell) are skipped
+        Float tCell = max(tCurrent, min(tExit, min(tNext.x, min(tNext.y, tNext.z))));
+
+        Float majorant = texelFetch(u_majorantTex, vol.majorantOrigin + cell, 0).x;
+        if (majorant > 0.0) {
+            Float tTentative = tCurrent - log(float(max(EPS, 1.0 - rand()))) / (majorant * sigT);
+            if (tTentative < tCell) {
+                tCurrent = tTentative;
+                Float ratioReal = densityLookup(vol, ray.o + tCurrent * ray.d) / majorant;
+                if (ratio) {
+                    Tr *= max(0.0, 1.0 - ratioReal);
+                    if (Tr < RATIO_TRACKING_ROULETTE) {
+                        if (rand() * RATIO_TRACKING_ROULETTE >= Tr) {
+                            Tr = 0.0;
+                            return TRACKING_COLLIDE;
+                        }
+                        Tr = RATIO_TRACKING_ROULETTE;
+                    }
+                } else if (ratioReal > rand()) {
+                    t = tCurrent;
+                    return TRACKING_COLLIDE;
+                }
+                continue;
+            }
+        }
+
+        // Move to the next cell (free flights are memoryless)
+        if (tCell >= tExit) {
+            return TRACKING_ESCAPE;
+        }
+        tCurrent = tCell;
+        if (tNext.x <= tNext.y && tNext.x <= tNext.z) {
+            cell.x += cellStep.x;
+            tNext.x += tDelta.x;
+        } else if (tNext.y <= tNext.z) {
+            cell.y += cellStep.y;
+            tNext.y += tDelta.y;
+        } else {
+            cell.z += cellStep.z;
+            tNext.z += tDelta.z;
+        }
+
+        if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, vol.majorantSize))) {
+            return TRACKING_ESCAPE;
+        }
+    }
+    return TRACKING_ABORT;
+}
+
+int deltaTracking(in Ray ray, in Float tMax, in Float sigT, in VolumeInfo vol, out Float t) {
+    Float Tr = 1.0;
+    return trackMedium(ray, tMax, sigT, vol, false, t, Tr);
+}
+
+// Unbiased transmittance estimate between the origin and "tMax"
+Float ratioTracking(in Ray ray, in Float tMax, in Float sigT, in VolumeInfo vol) {
+    Float t;
+    Float Tr = 1.0;
+    int status = trackMedium(ray, tMax, sigT, vol, true, t, Tr);
+    return status == TRACKING_ABORT ? 0.0 : Tr;
 }
 
 // ----------------------------------------------------------------------------
@@ -278,6 +744,7 @@ bool intersect(in Ray ray, out Intersection isect) {
     isect.wo = -ray.d;
     isect.norm = Vec3(0.0);
     isect.mtrl = 0;
+    isect.triID = -1;
 
     bool hit = false;
     int pos = 0;
@@ -326,6 +793,7 @@ bool intersect(in Ray ray, out Intersection isect) {
                 isect.tHit = dist;
                 isect.norm = n;
                 isect.mtrl = int(texelFetch(u_triBuffer, index).w);
+                isect.triID = index;
                 hit = true;
             }
         }
@@ -334,9 +802,259 @@ bool intersect(in Ray ray, out Intersection isect) {
     return hit;
 }
 
-Vec3 sampleDirect(in Vec3 x, in Intersection isect) {
-    // Take sample vertex on an area light
-    int lightID = min(int(rand() * u_nLights), u_nLights - 1);
+#if LIGHT_SAMPLER == LIGHT_SAMPLER_BVH
+Float cosSubClamped(Float sinA, Float cosA, Float sinB, Float cosB) {
+    // cos(max(0, a - b))
+    if (cosA > cosB) return 1.0;
+    return cosA * cosB + sinA * sinB;
+}
+
+Float sinSubClamped(Float sinA, Float cosA, Float sinB, Float cosB) {
+    // sin(max(0, a - b))
+    if (cosA > cosB) return 0.0;
+    return sinA * cosB - cosA * sinB;
+}
+
+Float lightNodeImportance(int node, in Vec3 x, in Vec3 n, in Vec3 wr, Float exponent) {
+    vec4 t0 = texelFetch(u_lightBVHBuffer, node * 4 + 0);
+    vec4 t1 = texelFetch(u_lightBVHBuffer, node * 4 + 1);
+    vec4 t2 = texelFetch(u_lightBVHBuffer, node * 4 + 2);
+    Vec3 bboxMin = t0.xyz;
+    Vec3 bboxMax = t1.xyz;
+    Float power = t0.w;
+    Float cosThetaO = t1.w;
+    Float cosThetaE = t2.w;
+
+    // Squared distance (clamped for the points near or inside the box)
+    Vec3 pc = 0.5 * (bboxMin + bboxMax);
+    Float radius = 0.5 * length(bboxMax - bboxMin);
+    Float d2 = max(dot(x - pc, x - pc), radius * radius);
+    Vec3 wi = normalize(x - pc);
+
+    // Angle subtended by the bounding sphere
+    Float cosThetaB = -1.0;
+    if (dot(x - pc, x - pc) > radius * radius) {
+        Float sin2ThetaB = radius * radius / dot(x - pc, x - pc);
+        cosThetaB = sqrt(max(0.0, 1.0 - sin2ThetaB));
+    }
+    Float sinThetaB = sqrt(max(0.0, 1.0 - cosThetaB * cosThetaB));
+
+    // Minimum angle between the emission cone and the direction to "x"
+    Float cosThetaW = dot(t2.xyz, wi);
+    Float sinThetaW = sqrt(max(0.0, 1.0 - cosThetaW * cosThetaW));
+    Float sinThetaO = sqrt(max(0.0, 1.0 - cosThetaO * cosThetaO));
+    Float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    Float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    Float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE) {
+        return 0.0;
+    }
+
+    // Bound of the cosine at the receiver (none for the points in media, which have zero normals)
+    Float cosThetaPI = 1.0;
+    if (dot(n, n) > 0.0) {
+        Float cosThetaI = abs(dot(wi, n));
+        Float sinThetaI = sqrt(max(0.0, 1.0 - cosThetaI * cosThetaI));
+        cosThetaPI = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    }
+
+    // Glossy lobe around the mirror direction (floored to keep every light reachable)
+    Float lobe = 1.0;
+    if (exponent > 0.0) {
+        Float cosThetaR = dot(-wi, wr);
+        Float sinThetaR = sqrt(max(0.0, 1.0 - cosThetaR * cosThetaR));
+        Float cosThetaPR = cosSubClamped(sinThetaR, cosThetaR, sinThetaB, cosThetaB);
+        lobe = mix(0.1, 1.0, pow(float(max(cosThetaPR, 0.0)), float(exponent)));
+    }
+
+    return max(0.0, power * cosThetaP * cosThetaPI * lobe / d2);
+}
+
+void lightImportanceParams(in Intersection isect, out Vec3 wr, out Float exponent) {
+    wr = reflect(-isect.wo, isect.norm);
+    exponent = 0.0;
+    #if ENABLE_CONDUCTOR
+    int type = int(texelFetch(u_matBuffer, isect.mtrl * 6 + 0).x);
+    if (type == MTRL_CONDUCTOR) {
+        // Phong exponent roughly equivalent to the GGX roughness
+        Vec2 alpha = texelFetch(u_matBuffer, isect.mtrl * 6 + 4).xy;
+        Float a = max(0.5 * (alpha.x + alpha.y), 1.0e-3);
+        exponent = min(2.0 / (a * a) - 2.0, 1000.0);
+    }
+    #endif
+}
+
+int sampleLightBVH(in Float u, in Vec3 x, in Intersection isect, out Float pmf) {
+    Vec3 wr;
+    Float exponent;
+    lightImportanceParams(isect, wr, exponent);
+
+    // Stochastic traversal, the random number is reused at each level. The host keeps the tree
+    // within 64 levels (LightBVH::maxDepth).
+    int node = 0;
+    pmf = 1.0;
+    for (int depth = 0; depth < 64; depth++) {
+        int link = int(texelFetch(u_lightBVHBuffer, node * 4 + 3).x);
+        if (link < 0) {
+            return -link - 1;
+        }
+
+        int left = node + 1;
+        int right = link;
+        Float iL = lightNodeImportance(left, x, isect.norm, wr, exponent);
+        Float iR = lightNodeImportance(right, x, isect.norm, wr, exponent);
+        if (iL + iR <= 0.0) {
+            break;
+        }
+
+        Float pL = iL / (iL + iR);
+        if (u < pL) {
+            node = left;
+            u = min(u / pL, 1.0 - EPS);
+            pmf *= pL;
+        } else {
+            node = right;
+            u = min((u - pL) / (1.0 - pL), 1.0 - EPS);
+            pmf *= 1.0 - pL;
+        }
+    }
+
+    pmf = 0.0;
+    return -1;
+}
+
+Float lightBVHPmf(int lightID, in Vec3 x, in Intersection isect) {
+    Vec3 wr;
+    Float exponent;
+    lightImportanceParams(isect, wr, exponent);
+
+    // Walk up from the leaf with the same choices as the traversal
+    int node = int(texelFetch(u_lightLeafBuffer, lightID).x);
+    Float pmf = 1.0;
+    while (node != 0) {
+        int parent = int(texelFetch(u_lightBVHBuffer, node * 4 + 3).y);
+        int left = parent + 1;
+        int right = int(texelFetch(u_lightBVHBuffer, parent * 4 + 3).x);
+        Float iL = lightNodeImportance(left, x, isect.norm, wr, exponent);
+        Float iR = lightNodeImportance(right, x, isect.norm, wr, exponent);
+        if (iL + iR <= 0.0) {
+            return 0.0;
+        }
+        pmf *= (node == left ? iL : iR) / (iL + iR);
+        node = parent;
+    }
+    return pmf;
+}
+#endif
+
+Float lightSelectPmf(int lightID, in Vec3 x, in Intersection isect) {
+    #if LIGHT_SAMPLER == LIGHT_SAMPLER_BVH
+    return lightBVHPmf(lightID, x, isect);
+    #elif LIGHT_SAMPLER == LIGHT_SAMPLER_POWER
+    return texelFetch(u_lightAliasBuffer, lightID).z;
+    #else
+    return 1.0 / Float(u_nLights);
+    #endif
+}
+
+#if ENABLE_ENVMAP
+Vec2 envmapUV(in Vec3 dir) {
+    Float phi = atan(float(dir.z), float(dir.x));
+    if (phi < 0.0) {
+        phi += 2.0 * PI;
+    }
+    Float theta = acos(float(clamp(dir.y, -1.0, 1.0)));
+    return Vec2(phi / (2.0 * PI), theta / PI);
+}
+
+Vec3 envmapDirection(in Vec2 uv) {
+    Float theta = uv.y * PI;
+    Float phi = uv.x * 2.0 * PI;
+    Float sinTheta = sin(float(theta));
+    return Vec3(sinTheta * cos(float(phi)), cos(float(theta)), sinTheta * sin(float(phi)));
+}
+
+Vec3 envmapLookup(in Vec3 dir) {
+    return texture(u_envmap, vec2(envmapUV(dir))).rgb;
+}
+
+Vec3 sampleEnvmap(in Vec2 u, out Float pdf) {
+    ivec2 size = textureSize(u_envDistrib, 0);
+    int W = size.x - 1;
+    int H = size.y;
+
+    // Row from the marginal distribution (stored in the last column)
+    int lo = 0;
+    int hi = H - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (texelFetch(u_envDistrib, ivec2(W, mid), 0).x > u.y) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    int row = lo;
+    Float cdf0 = row > 0 ? texelFetch(u_envDistrib, ivec2(W, row - 1), 0).x : 0.0;
+    Float cdf1 = texelFetch(u_envDistrib, ivec2(W, row), 0).x;
+    Float dv = clamp((u.y - cdf0) / max(cdf1 - cdf0, 1.0e-8), 0.0, 1.0);
+
+    // Column from the conditional distribution of the row
+    lo = 0;
+    hi = W - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (texelFetch(u_envDistrib, ivec2(mid, row), 0).x > u.x) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    int col = lo;
+    cdf0 = col > 0 ? texelFetch(u_envDistrib, ivec2(col - 1, row), 0).x : 0.0;
+    cdf1 = texelFetch(u_envDistrib, ivec2(col, row), 0).x;
+    Float du = clamp((u.x - cdf0) / max(cdf1 - cdf0, 1.0e-8), 0.0, 1.0);
+
+    // Convert to the direction
+    Vec2 uv = Vec2((Float(col) + du) / Float(W), (Float(row) + dv) / Float(H));
+    Float sinTheta = sin(float(uv.y * PI));
+    Float pdfUV = texelFetch(u_envDistrib, ivec2(col, row), 0).y;
+    if (sinTheta <= 0.0 || pdfUV <= 0.0) {
+        pdf = 0.0;
+        return Vec3(0.0, 1.0, 0.0);
+    }
+
+    pdf = pdfUV / (2.0 * PI * PI * sinTheta);
+    return envmapDirection(uv);
+}
+
+Float envmapPdf(in Vec3 dir) {
+    ivec2 size = textureSize(u_envDistrib, 0);
+    int W = size.x - 1;
+    int H = size.y;
+
+    Vec2 uv = envmapUV(dir);
+    Float sinTheta = sqrt(max(0.0, 1.0 - dir.y * dir.y));
+    if (sinTheta <= 0.0) {
+        return 0.0;
+    }
+
+    int col = min(int(uv.x * Float(W)), W - 1);
+    int row = min(int(uv.y * Float(H)), H - 1);
+    Float pdfUV = texelFetch(u_envDistrib, ivec2(col, row), 0).y;
+    return pdfUV / (2.0 * PI * PI * sinTheta);
+}
+#endif
+
+Float envSelectPmf() {
+    #if ENABLE_ENVMAP
+    return u_envSelectPmf;
+    #else
+    return 0.0;
+    #endif
+}
+
+Triangle lightTriangle(int lightID) {
     Vec3 ijk = texelFetch(u_lightBuffer, lightID).xyz;
 
     Triangle tri;
@@ -346,60 +1064,771 @@ Vec3 sampleDirect(in Vec3 x, in Intersection isect) {
     tri.n[0] = texelFetch(u_vertBuffer, int(ijk.x) * 5 + 1).xyz;
     tri.n[1] = texelFetch(u_vertBuffer, int(ijk.y) * 5 + 1).xyz;
     tri.n[2] = texelFetch(u_vertBuffer, int(ijk.z) * 5 + 1).xyz;
+    return tri;
+}
+
+#if TRIANGLE_SAMPLER == TRIANGLE_SAMPLER_SOLID_ANGLE
+// Spherical triangles out of this range are sampled by area for numerical robustness
+const Float MIN_SPHERICAL_AREA = 3.0e-4;
+const Float MAX_SPHERICAL_AREA = 6.22;
+
+Float angleBetween(in Vec3 v1, in Vec3 v2) {
+    if (dot(v1, v2) < 0.0) {
+        return PI - 2.0 * asin(float(min(1.0, 0.5 * length(v1 + v2))));
+    }
+    return 2.0 * asin(float(min(1.0, 0.5 * length(v2 - v1))));
+}
+
+Float sphericalTriangleArea(in Triangle tri, in Vec3 x) {
+    // See "The Solid Angle of a Plane Triangle" by A. Van Oosterom and J. Strackee, 1983.
+    Vec3 a = normalize(tri.v[0] - x);
+    Vec3 b = normalize(tri.v[1] - x);
+    Vec3 c = normalize(tri.v[2] - x);
+    Float num = abs(dot(a, cross(b, c)));
+    Float den = 1.0 + dot(a, b) + dot(b, c) + dot(c, a);
+    return 2.0 * atan(float(num), float(den));
+}
+
+Vec3 sampleSphericalTriangle(in Triangle tri, in Vec3 x, in Vec2 u) {
+    // See "Stratified Sampling of Spherical Triangles" by J. Arvo, 1995.
+    Vec3 a = normalize(tri.v[0] - x);
+    Vec3 b = normalize(tri.v[1] - x);
+    Vec3 c = normalize(tri.v[2] - x);
+    Vec3 nab = normalize(cross(a, b));
+    Vec3 nbc = normalize(cross(b, c));
+    Vec3 nca = normalize(cross(c, a));
+
+    Float alpha = angleBetween(nab, -nca);
+    Float beta = angleBetween(nbc, -nab);
+    Float gamma = angleBetween(nca, -nbc);
+
+    // Sub-triangle with the sampled area
+    Float areaPi = mix(PI, alpha + beta + gamma, u.x);
+    Float sinAlpha = sin(float(alpha));
+    Float cosAlpha = cos(float(alpha));
+    Float sinPhi = sin(float(areaPi)) * cosAlpha - cos(float(areaPi)) * sinAlpha;
+    Float cosPhi = cos(float(areaPi)) * cosAlpha + sin(float(areaPi)) * sinAlpha;
+    Float k1 = cosPhi + cosAlpha;
+    Float k2 = sinPhi - sinAlpha * dot(a, b);
+    Float cosBp = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) / ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+    cosBp = clamp(cosBp, -1.0, 1.0);
+    Float sinBp = sqrt(max(0.0, 1.0 - cosBp * cosBp));
+    Vec3 cp = cosBp * a + sinBp * normalize(c - dot(c, a) * a);
+
+    // Direction on the arc between "b" and "cp"
+    Float cosTheta = 1.0 - u.y * (1.0 - dot(cp, b));
+    Float sinTheta = sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+    return cosTheta * b + sinTheta * normalize(cp - dot(cp, b) * b);
+}
+#endif
+
+Float lightDirectionPdf(in Triangle tri, in Vec3 x, Float dist, Float cosLight) {
+    // Density of a direction toward a chosen light (solid angle measure)
+    #if TRIANGLE_SAMPLER == TRIANGLE_SAMPLER_SOLID_ANGLE
+    Float solidAngle = sphericalTriangleArea(tri, x);
+    if (solidAngle >= MIN_SPHERICAL_AREA && solidAngle <= MAX_SPHERICAL_AREA) {
+        return 1.0 / solidAngle;
+    }
+    #endif
+    Float area = 0.5 * length(cross(tri.v[1] - tri.v[0], tri.v[2] - tri.v[0]));
+    return dist * dist / (area * cosLight);
+}
+
+Float powerHeuristic(Float pdfA, Float pdfB) {
+    Float a2 = pdfA * pdfA;
+    Float b2 = pdfB * pdfB;
+    return a2 + b2 > 0.0 ? a2 / (a2 + b2) : 0.0;
+}
+
+int sampleLight(in Float u, in Vec3 x, in Intersection isect, out Float pmf) {
+    #if LIGHT_SAMPLER == LIGHT_SAMPLER_BVH
+    return sampleLightBVH(u, x, isect, pmf);
+    #elif LIGHT_SAMPLER == LIGHT_SAMPLER_POWER
+    // Alias table built over emitter power
+    Float ux = u * Float(u_nLights);
+    int column = min(int(ux), u_nLights - 1);
+    vec4 entry = texelFetch(u_lightAliasBuffer, column);
+    int lightID = ux - Float(column) < entry.x ? column : int(entry.y);
+    pmf = texelFetch(u_lightAliasBuffer, lightID).z;
+    return lightID;
+    #else
+    pmf = 1.0 / Float(u_nLights);
+    return min(int(u * u_nLights), u_nLights - 1);
+    #endif
+}
+
+Vec3 evalBSDF(in Intersection isect, in Vec3 wi, out Float pdf) {
+    int type = int(texelFetch(u_matBuffer, isect.mtrl * 6 + 0).x);
+    Vec3 f = Vec3(0.0);
+    pdf = 0.0;
+    #if ENABLE_DIFFUSE
+    if (type == MTRL_DIFFUSE) {
+        f = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz / PI;
+        pdf = max(0.0, dot(isect.norm, wi)) / PI;
+    }
+    #endif
+    #if ENABLE_CONDUCTOR
+    if (type == MTRL_CONDUCTOR) {
+        Vec3 kappa = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz;
+        Vec3 eta = texelFetch(u_matBuffer, isect.mtrl * 6 + 3).xyz;
+        Vec2 alpha = texelFetch(u_matBuffer, isect.mtrl * 6 + 4).xy;
+
+        Vec3 w = isect.norm;
+        Vec3 u = cross(abs(w.x) > 0.1 ? Vec3(0.0, 1.0, 0.0) : Vec3(1.0, 0.0, 0.0), w);
+        Vec3 v = cross(w, u);
+        Vec3 wo = isect.wo;
+        Vec3 woLocal = Vec3(dot(u, wo), dot(v, wo), dot(w, wo));
+        Vec3 wiLocal = Vec3(dot(u, wi), dot(v, wi), dot(w, wi));
+        Vec3 F = fresnelConductor(max(0.0, wiLocal.z), eta, kappa);
+        f = F * microfacetGGXBRDF(wiLocal, woLocal, alpha);
+        Vec3 whLocal = normalize(wiLocal + woLocal);
+        pdf = weightedGGXPDF(wiLocal, woLocal, whLocal, alpha);
+    }
+    #endif
+    return f;
+}
+
+#if ENABLE_GUIDING
+// Density of the directions sampled at a surface vertex, where guiding is mixed with BSDF sampling
+Float scatteringPdf(in Vec3 x, in Intersection isect, in Vec3 wi, in Float bsdfPdf);
+#else
+Float scatteringPdf(in Vec3 x, in Intersection isect, in Vec3 wi, in Float bsdfPdf) {
+    return bsdfPdf;
+}
+#endif
+
+// Isotropic phase function (also the density of the directions sampled from it)
+const Float ISOTROPIC_PHASE = 1.0 / (4.0 * PI);
+
+// Transmittance of a shadow ray toward a light at "dist" (INFTY for the environment map). Opaque surfaces
+// block the ray, and the media on the way are crossed by ratio tracking ("volID" is the medium around the origin)
+Float shadowTransmittance(in Ray shadowRay, in Float dist, in int volID) {
+    Ray ray = shadowRay;
+    Float Tr = 1.0;
+    for (int i = 0; i < MAX_SHADOW_SEGMENTS; i++) {
+        Intersection temp;
+        bool isHit = intersect(ray, temp);
+
+        #if ENABLE_MEDIUM_NEE
+        if (volID >= 0) {
+            Tr *= ratioTracking(ray, isHit ? temp.tHit : min(dist, INFTY), MEDIUM_SIGMA_S + MEDIUM_SIGMA_A,
+                                fetchVolume(volID));
+            if (Tr <= 0.0) {
+                return 0.0;
+            }
+        }
+        #endif
+
+        if (!isHit) {
+            return dist >= INFTY ? Tr : 0.0;
+        }
+        if (abs(dist - temp.tHit) < EPS) {
+            return Tr;
+        }
+
+        #if ENABLE_MEDIUM_NEE
+        // Pass through the boundary of a medium
+        int type = int(texelFetch(u_matBuffer, temp.mtrl * 6 + 0).x);
+        if (type != MTRL_MEDIA || temp.tHit > dist) {
+            return 0.0;
+        }
+        volID = dot(-ray.d, temp.norm) >= EPS ? int(texelFetch(u_matBuffer, temp.mtrl * 6 + 5).x) : -1;
+        ray = Ray(ray.o + (temp.tHit + EPS) * ray.d, ray.d);
+        dist -= temp.tHit + EPS;
+        #else
+        return 0.0;
+        #endif
+    }
+    return 0.0;
+}
+
+#if ENABLE_ENVMAP
+Vec3 sampleDirectEnvmap(in Vec3 x, in Intersection isect) {
+    Float pdf;
+    Vec3 dir = sampleEnvmap(Vec2(rand(), rand()), pdf);
+    Float dot0 = dot(dir, isect.norm);
+    if (pdf <= 0.0 || dot0 <= 0.0) {
+        return Vec3(0.0);
+    }
+
+    // Cast shadow ray
+    Float Tr = shadowTransmittance(spawnRay(x, isect.norm, dir), INFTY, -1);
+    if (Tr <= 0.0) {
+        return Vec3(0.0);
+    }
+
+    Float bsdfPdf;
+    Vec3 f = evalBSDF(isect, dir, bsdfPdf);
+    pdf *= u_envSelectPmf;
+    return powerHeuristic(pdf, scatteringPdf(x, isect, dir, bsdfPdf)) * envmapLookup(dir) * f * dot0 * Tr / pdf;
+}
+#endif
+
+// Direction toward a point sampled on the area lights, with its distance, the density in solid angle
+// (including the light selection) and the emission. Returns false if no light is sampled
+bool sampleAreaLight(in Float uLight, in Vec3 x, in Intersection isect, out Vec3 dir, out Float dist,
+                     out Float pdf, out Vec3 Le) {
+    Float lightPmf;
+    int lightID = sampleLight(uLight, x, isect, lightPmf);
+    if (lightID < 0) {
+        return false;
+    }
+    lightPmf *= 1.0 - envSelectPmf();
+    Triangle tri = lightTriangle(lightID);
+
+    Vec2 u = Vec2(rand(), rand());
+    Vec3 nl;
+    #if TRIANGLE_SAMPLER == TRIANGLE_SAMPLER_SOLID_ANGLE
+    Float solidAngle = sphericalTriangleArea(tri, x);
+    if (solidAngle >= MIN_SPHERICAL_AREA && solidAngle <= MAX_SPHERICAL_AREA) {
+        // Uniform direction in the solid angle of the triangle
+        dir = sampleSphericalTriangle(tri, x, u);
+        dist = intersect(Ray(x, dir), tri, nl);
+        if (dist >= INFTY) {
+            return false;
+        }
+    } else
+    #endif
+    {
+        // Uniform point on the triangle
+        if (u.x + u.y > 1.0) {
+            u.x = 1.0 - u.x;
+            u.y = 1.0 - u.y;
+        }
+        Vec3 p = (1.0 - u.x - u.y) * tri.v[0] + u.x * tri.v[1] + u.y * tri.v[2];
+        nl = normalize((1.0 - u.x - u.y) * tri.n[0] + u.x * tri.n[1] + u.y * tri.n[2]);
+        dir = normalize(p - x);
+        dist = length(p - x);
+    }
+
+    Float dot1 = dot(-dir, nl);
+    if (dot1 <= 0.0) {
+        return false;
+    }
+    pdf = lightPmf * lightDirectionPdf(tri, x, dist, dot1);
+
+    int mtrlID = int(texelFetch(u_lightBuffer, lightID).w);
+    Le = texelFetch(u_matBuffer, mtrlID * 6 + 1).xyz;
+    return true;
+}
+
+Vec3 sampleDirect(in Vec3 x, in Intersection isect) {
+    // Choose between the environment map and the area lights
+    Float uLight = rand();
+    #if ENABLE_ENVMAP
+    if (uLight < u_envSelectPmf) {
+        return sampleDirectEnvmap(x, isect);
+    }
+    uLight = min((uLight - u_envSelectPmf) / (1.0 - u_envSelectPmf), 1.0 - EPS);
+    #endif
+
+    if (u_nLights == 0) {
+        return Vec3(0.0);
+    }
+
+    // Take sample vertex on an area light
+    Vec3 dir;
+    Float dist;
+    Float pdf;
+    Vec3 Le;
+    if (!sampleAreaLight(uLight, x, isect, dir, dist, pdf, Le)) {
+        return Vec3(0.0);
+    }
+
+    Float dot0 = dot(dir, isect.norm);
+    if (dot0 <= 0.0) {
+        return Vec3(0.0);
+    }
+
+    // Cast shadow ray
+    Float Tr = shadowTransmittance(spawnRay(x, isect.norm, dir), dist, -1);
+    if (Tr <= 0.0) {
+        return Vec3(0.0);
+    }
+
+    // Evaluate contribution
+    Float bsdfPdf;
+    Vec3 f = evalBSDF(isect, dir, bsdfPdf);
+    Float mis = powerHeuristic(pdf, scatteringPdf(x, isect, dir, bsdfPdf));
+    return mis * Le * f * dot0 * Tr / pdf;
+}
+
+#if ENABLE_MEDIUM_NEE
+// Next event estimation at a real collision in the medium "volID". "isect" has a zero normal, so that
+// the light selection does not bound the cosine at the receiver
+Vec3 sampleDirectMedium(in Vec3 x, in Intersection isect, in int volID) {
+    Float uLight = rand();
+    #if ENABLE_ENVMAP
+    if (uLight < u_envSelectPmf) {
+        Float pdf;
+        Vec3 dir = sampleEnvmap(Vec2(rand(), rand()), pdf);
+        if (pdf <= 0.0) {
+            return Vec3(0.0);
+        }
+
+        Float Tr = shadowTransmittance(Ray(x, dir), INFTY, volID);
+        pdf *= u_envSelectPmf;
+        return powerHeuristic(pdf, ISOTROPIC_PHASE) * envmapLookup(dir) * ISOTROPIC_PHASE * Tr / pdf;
+    }
+    uLight = min((uLight - u_envSelectPmf) / (1.0 - u_envSelectPmf), 1.0 - EPS);
+    #endif
+
+    if (u_nLights == 0) {
+        return Vec3(0.0);
+    }
+
+    Vec3 dir;
+    Float dist;
+    Float pdf;
+    Vec3 Le;
+    if (!sampleAreaLight(uLight, x, isect, dir, dist, pdf, Le)) {
+        return Vec3(0.0);
+    }
+
+    Float Tr = shadowTransmittance(Ray(x, dir), dist, volID);
+    return powerHeuristic(pdf, ISOTROPIC_PHASE) * Le * ISOTROPIC_PHASE * Tr / pdf;
+}
+#endif
+
+#if DIRECT_LIGHTING == DIRECT_LIGHTING_RESTIR
+// ----------------------------------------------------------------------------
+// Reservoir-based spatiotemporal importance resampling (ReSTIR)
+// See "Spatiotemporal reservoir resampling for real-time ray tracing with
+// dynamic direct lighting" by B. Bitterli et al., 2020.
+// ----------------------------------------------------------------------------
+uniform sampler2D u_prevReservoir;  // light ID, coordinates on the light, W
+uniform sampler2D u_prevGbufPos;    // position, material ID (negative if invalid)
+uniform sampler2D u_prevGbufNorm;   // normal, M
+
+struct Reservoir {
+    Vec3 y;  // light ID (-1 for the environment map), barycentric or equirectangular coordinates
+    Float wsum;
+    Float W;
+    Float M;
+};
+
+// Outputs for the reuse in the next frame
+Reservoir restirOut;
+Vec4 restirPos;
+Vec3 restirNorm;
+
+bool updateReservoir(inout Reservoir r, in Vec3 y, Float w) {
+    r.wsum += w;
+    if (w > 0.0 && rand() * r.wsum < w) {
+        r.y = y;
+        return true;
+    }
+    return false;
+}
+
+Vec3 evalLightSample(in Vec3 y, in Vec3 x, in Intersection isect, out Vec3 dir, out Float dist) {
+    // Unshadowed contribution of a light sample
+    Vec3 Le = Vec3(0.0);
+    Float G = 0.0;
+    #if ENABLE_ENVMAP
+    if (y.x < 0.0) {
+        dir = envmapDirection(y.yz);
+        dist = INFTY;
+        Le = envmapLookup(dir);
+        G = max(0.0, dot(isect.norm, dir));
+    } else
+    #endif
+    {
+        int lightID = int(y.x);
+        Triangle tri = lightTriangle(lightID);
+        Vec3 p = (1.0 - y.y - y.z) * tri.v[0] + y.y * tri.v[1] + y.z * tri.v[2];
+        Vec3 nl = normalize((1.0 - y.y - y.z) * tri.n[0] + y.y * tri.n[1] + y.z * tri.n[2]);
+        dist = length(p - x);
+        dir = (p - x) / dist;
+
+        int mtrlID = int(texelFetch(u_lightBuffer, lightID).w);
+        Le = texelFetch(u_matBuffer, mtrlID * 6 + 1).xyz;
+        Float dot0 = dot(dir, isect.norm);
+        Float dot1 = dot(-dir, nl);
+        G = dot0 > 0.0 && dot1 > 0.0 ? dot0 * dot1 / (dist * dist) : 0.0;
+    }
+
+    if (G <= 0.0) {
+        return Vec3(0.0);
+    }
+
+    Float bsdfPdf;
+    return Le * evalBSDF(isect, dir, bsdfPdf) * G;
+}
+
+Float targetPdf(in Vec3 y, in Vec3 x, in Intersection isect) {
+    Vec3 dir;
+    Float dist;
+    Vec3 c = evalLightSample(y, x, isect, dir, dist);
+    return luminance(c);
+}
+
+Vec3 sampleLightCandidate(in Vec3 x, in Intersection isect, out Float pdf) {
+    // Source distribution is the same as the light sampling for NEE,
+    // but the points on area lights are sampled uniformly by area.
+    Float uLight = rand();
+    #if ENABLE_ENVMAP
+    if (uLight < u_envSelectPmf) {
+        Float envPdf;
+        Vec3 dir = sampleEnvmap(Vec2(rand(), rand()), envPdf);
+        pdf = u_envSelectPmf * envPdf;
+        return Vec3(-1.0, envmapUV(dir));
+    }
+    uLight = min((uLight - u_envSelectPmf) / (1.0 - u_envSelectPmf), 1.0 - EPS);
+    #endif
+
+    pdf = 0.0;
+    if (u_nLights == 0) {
+        return Vec3(0.0);
+    }
+
+    Float lightPmf;
+    int lightID = sampleLight(uLight, x, isect, lightPmf);
+    if (lightID < 0) {
+        return Vec3(0.0);
+    }
 
     Vec2 u = Vec2(rand(), rand());
     if (u.x + u.y > 1.0) {
         u.x = 1.0 - u.x;
         u.y = 1.0 - u.y;
     }
-    Vec3 p = (1.0 - u.x - u.y) * tri.v[0] + u.x * tri.v[1] + u.y * tri.v[2];
-    Vec3 nl = (1.0 - u.x - u.y) * tri.n[0] + u.x * tri.n[1] + u.y * tri.n[2];
 
-    // Cast shadow ray
-    Vec3 dir = normalize(p - x);
-    Ray ray = spawnRay(x, isect.norm, dir);
-
-    Intersection temp;
-    bool isHit = intersect(ray, temp);
-
-    // Calculate contribution
-    Float dist = length(p - x);
-    if (isHit && abs(dist - temp.tHit) < EPS) {
-        // Evaluate BRDF
-        int type = int(texelFetch(u_matBuffer, isect.mtrl * 6 + 0).x);
-        Vec3 f = Vec3(0.0);
-        if (type == MTRL_DIFFUSE) {
-            f = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz;
-        } else if (type == MTRL_CONDUCTOR) {
-            Vec3 kappa = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz;
-            Vec3 eta = texelFetch(u_matBuffer, isect.mtrl * 6 + 3).xyz;
-            Vec2 alpha = texelFetch(u_matBuffer, isect.mtrl * 6 + 4).xy;
-            Float cosThetaI = max(0.0, dot(isect.norm, -ray.d));
-            Vec3 F = fresnelConductor(cosThetaI, eta, kappa);
-
-            Vec3 w = isect.norm;
-            Vec3 u = cross(abs(w.x) > 0.1 ? Vec3(0.0, 1.0, 0.0) : Vec3(1.0, 0.0, 0.0), w);
-            Vec3 v = cross(w, u);
-            Vec3 wo = isect.wo;
-            Vec3 wi = ray.d;
-            Vec3 woLocal = Vec3(dot(u, wo), dot(v, wo), dot(w, wo));
-            Vec3 wiLocal = Vec3(dot(u, wi), dot(v, wi), dot(w, wi));
-            f = F * microfacetGGXBRDF(wiLocal, woLocal, alpha);
-        }
-
-        // Evaluate contribution
-        int mtrlID = int(texelFetch(u_lightBuffer, lightID).w);
-        Vec3 e = texelFetch(u_matBuffer, mtrlID * 6 + 1).xyz;
-        Float dot0 = dot(ray.d, isect.norm);
-        Float dot1 = dot(-ray.d, nl);
-        if (dot0 > 0.0 && dot1 > 0.0) {
-            Float G = (dot0 * dot1) / (dist * dist);
-            Float area = 0.5 * length(cross(tri.v[1] - tri.v[0], tri.v[2] - tri.v[0]));
-            Float pdf = 1.0 / (area * Float(u_nLights));
-            return e * f * G / pdf;
+    Triangle tri = lightTriangle(lightID);
+    Float area = 0.5 * length(cross(tri.v[1] - tri.v[0], tri.v[2] - tri.v[0]));
+    pdf = (1.0 - envSelectPmf()) * lightPmf / area;
+    return Vec3(Float(lightID), u);
+}
+
+Vec3 restirDirect(in Vec3 x, in Intersection isect) {
+    // Initial candidates by resampled importance sampling
+    Reservoir r = Reservoir(Vec3(0.0), 0.0, 0.0, 0.0);
+    for (int i = 0; i < RESTIR_CANDIDATES; i++) {
+        Float pdf;
+        Vec3 y = sampleLightCandidate(x, isect, pdf);
+        Float w = pdf > 0.0 ? targetPdf(y, x, isect) / pdf : 0.0;
+        updateReservoir(r, y, w);
+    }
+    r.M = Float(RESTIR_CANDIDATES);
+
+    // Combine with the reservoirs of the previous frame. The camera is fixed until
+    // the buffers are reset, so the temporal neighbor is the same pixel.
+    Reservoir s = Reservoir(r.y, r.wsum, 0.0, r.M);
+    ivec2 size = ivec2(u_windowSize);
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    Vec3 camPos = (u_c2wMat * Vec4(0.0, 0.0, 0.0, 1.0)).xyz;
+    Float depth = length(x - camPos);
+    Float maxM = Float(RESTIR_MAX_HISTORY * RESTIR_CANDIDATES);
+
+    ivec2 neighbors[RESTIR_SPATIAL_NEIGHBORS + 1];
+    Float neighborM[RESTIR_SPATIAL_NEIGHBORS + 1];
+    for (int k = 0; k <= RESTIR_SPATIAL_NEIGHBORS; k++) {
+        ivec2 q = pixel;
+        if (k > 0) {
+            Float radius = RESTIR_SPATIAL_RADIUS * sqrt(rand());
+            Float theta = 2.0 * PI * rand();
+            q += ivec2(Vec2(radius * cos(float(theta)), radius * sin(float(theta))));
+        }
+        neighbors[k] = q;
+        neighborM[k] = 0.0;
+
+        if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) {
+            continue;
+        }
+
+        vec4 gpos = texelFetch(u_prevGbufPos, q, 0);
+        vec4 gnorm = texelFetch(u_prevGbufNorm, q, 0);
+        if (gpos.w < 0.0 || gnorm.w <= 0.0) {
+            continue;
+        }
+
+        // Reject neighbors on different surfaces
+        if (dot(Vec3(gnorm.xyz), isect.norm) < 0.9 || abs(length(Vec3(gpos.xyz) - camPos) - depth) > 0.1 * depth) {
+            continue;
+        }
+
+        vec4 res = texelFetch(u_prevReservoir, q, 0);
+        Float M = min(Float(gnorm.w), maxM);
+        Float w = targetPdf(Vec3(res.xyz), x, isect) * Float(res.w) * M;
+        updateReservoir(s, Vec3(res.xyz), w);
+        s.M += M;
+        neighborM[k] = M;
+    }
+
+    // Unbiased weight: count only the reservoirs which could have produced the sample
+    Float pHat = targetPdf(s.y, x, isect);
+    Float Z = pHat > 0.0 ? r.M : 0.0;
+    for (int k = 0; k <= RESTIR_SPATIAL_NEIGHBORS; k++) {
+        if (neighborM[k] <= 0.0) {
+            continue;
+        }
+
+        vec4 gpos = texelFetch(u_prevGbufPos, neighbors[k], 0);
+        vec4 gnorm = texelFetch(u_prevGbufNorm, neighbors[k], 0);
+        Intersection neighbor;
+        neighbor.norm = gnorm.xyz;
+        neighbor.mtrl = int(gpos.w);
+        neighbor.wo = normalize(camPos - Vec3(gpos.xyz));
+        if (targetPdf(s.y, gpos.xyz, neighbor) > 0.0) {
+            Z += neighborM[k];
+        }
+    }
+    s.W = pHat > 0.0 && Z > 0.0 ? s.wsum / (Z * pHat) : 0.0;
+    s.M = min(s.M, maxM);
+
+    restirOut = s;
+    restirPos = Vec4(x, Float(isect.mtrl));
+    restirNorm = isect.norm;
+
+    if (s.W <= 0.0) {
+        return Vec3(0.0);
+    }
+
+    // Shade the selected sample with visibility (and the transmittance of the media on the way, as the
+    // emitters hit after crossing them are weighted against this sample)
+    Vec3 dir;
+    Float dist;
+    Vec3 c = evalLightSample(s.y, x, isect, dir, dist);
+    Float Tr = shadowTransmittance(spawnRay(x, isect.norm, dir), dist, -1);
+    return c * s.W * Tr;
+}
+#endif
+
+#if ENABLE_GUIDING
+// ----------------------------------------------------------------------------
+// Path guiding with SD-tree (learned on the host from the recorded vertices)
+// ----------------------------------------------------------------------------
+uniform samplerBuffer u_guideSpatialBuffer;  // axis (-1 for a leaf), first child, directional root
+uniform samplerBuffer u_guideDirBuffer;      // child energies and child indices (0 for a leaf)
+uniform vec3 u_guideBboxMin;
+uniform vec3 u_guideBboxMax;
+uniform float u_guideFraction;
+
+// Path vertex recorded for learning, chosen uniformly by reservoir sampling
+Vec3 guideRecPos;
+Vec3 guideRecDir;
+Vec3 guideRecL;
+Vec3 guideRecBeta;
+Float guideRecPdf;
+int guideRecCount;
+// A vertex recorded while split siblings are pending only receives the radiance of its own branch
+int guideRecBranch;
+bool guideRecClosed;
+Vec3 guideRecEnd;
+
+int guideLeaf(in Vec3 p) {
+    Vec3 bmin = u_guideBboxMin;
+    Vec3 bmax = u_guideBboxMax;
+    int node = 0;
+    for (int depth = 0; depth < 64; depth++) {
+        vec4 values = texelFetch(u_guideSpatialBuffer, node);
+        if (values.x < 0.0) {
+            return int(values.z);
+        }
+
+        int axis = int(values.x);
+        Float mid = 0.5 * (bmin[axis] + bmax[axis]);
+        if (p[axis] < mid) {
+            node = int(values.y);
+            bmax[axis] = mid;
+        } else {
+            node = int(values.y) + 1;
+            bmin[axis] = mid;
+        }
+    }
+    return 0;
+}
+
+Float guideTotal(int root) {
+    vec4 sums = texelFetch(u_guideDirBuffer, root * 2 + 0);
+    return sums.x + sums.y + sums.z + sums.w;
+}
+
+Vec2 guideCanonical(in Vec3 dir) {
+    // Cylindrical mapping (cosine of polar angle, azimuth), which preserves area
+    Float phi = atan(float(dir.y), float(dir.x));
+    if (phi < 0.0) {
+        phi += 2.0 * PI;
+    }
+    Vec2 p = Vec2((clamp(dir.z, -1.0, 1.0) + 1.0) * 0.5, phi / (2.0 * PI));
+    return clamp(p, Vec2(0.0), Vec2(1.0 - 1.0e-6));
+}
+
+Vec3 guideDirection(in Vec2 p) {
+    Float cosTheta = 2.0 * p.x - 1.0;
+    Float sinTheta = sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+    Float phi = 2.0 * PI * p.y;
+    return Vec3(sinTheta * cos(float(phi)), sinTheta * sin(float(phi)), cosTheta);
+}
+
+Vec3 sampleGuide(int root, in Vec2 u, out Float pdf) {
+    int node = root;
+    Vec2 origin = Vec2(0.0);
+    Float scale = 1.0;
+    pdf = 1.0;
+    for (int depth = 0; depth < 32; depth++) {
+        vec4 s = texelFetch(u_guideDirBuffer, node * 2 + 0);
+        vec4 children = texelFetch(u_guideDirBuffer, node * 2 + 1);
+        Float total = s.x + s.y + s.z + s.w;
+        if (total <= 0.0) {
+            break;
+        }
+
+        // Choose the column, and then the row in it
+        int ix = 0;
+        Float px = (s.x + s.z) / total;
+        if (u.x < px) {
+            u.x = u.x / px;
+        } else {
+            ix = 1;
+            u.x = (u.x - px) / (1.0 - px);
+        }
+
+        int iy = 0;
+        Float col0 = ix == 0 ? s.x : s.y;
+        Float col1 = ix == 0 ? s.z : s.w;
+        Float py = col0 / (col0 + col1);
+        if (u.y < py) {
+            u.y = u.y / py;
+        } else {
+            iy = 1;
+            u.y = (u.y - py) / (1.0 - py);
+        }
+        u = min(u, Vec2(1.0 - EPS));
+
+        int c = ix + 2 * iy;
+        pdf *= 4.0 * s[c] / total;
+        scale *= 0.5;
+        origin += Vec2(ix, iy) * scale;
+        if (children[c] == 0.0) {
+            break;
+        }
+        node = int(children[c]);
+    }
+
+    // Density over the unit square to that over the sphere (4 pi)
+    pdf /= 4.0 * PI;
+    return guideDirection(origin + u * scale);
+}
+
+Float guidePdf(int root, in Vec3 dir) {
+    Vec2 p = guideCanonical(dir);
+    int node = root;
+    Float pdf = 1.0;
+    for (int depth = 0; depth < 32; depth++) {
+        vec4 s = texelFetch(u_guideDirBuffer, node * 2 + 0);
+        vec4 children = texelFetch(u_guideDirBuffer, node * 2 + 1);
+        Float total = s.x + s.y + s.z + s.w;
+        if (total <= 0.0) {
+            break;
+        }
+
+        int ix = p.x < 0.5 ? 0 : 1;
+        int iy = p.y < 0.5 ? 0 : 1;
+        int c = ix + 2 * iy;
+        pdf *= 4.0 * s[c] / total;
+        if (children[c] == 0.0) {
+            break;
+        }
+        node = int(children[c]);
+        p = (p - Vec2(ix, iy) * 0.5) * 2.0;
+    }
+    return pdf / (4.0 * PI);
+}
+
+Float scatteringPdf(in Vec3 x, in Intersection isect, in Vec3 wi, in Float bsdfPdf) {
+    // Same mixture as the sampling in "radiance"
+    int type = int(texelFetch(u_matBuffer, isect.mtrl * 6 + 0).x);
+    int root = guideLeaf(x);
+    if ((type != MTRL_DIFFUSE && type != MTRL_CONDUCTOR) || guideTotal(root) <= 0.0) {
+        return bsdfPdf;
+    }
+    return u_guideFraction * guidePdf(root, wi) + (1.0 - u_guideFraction) * bsdfPdf;
+}
+#endif
+
+#if ENABLE_RADIANCE_CACHE
+// ----------------------------------------------------------------------------
+// Radiance cache (hashed voxel grid built on the host from the recorded vertices)
+// ----------------------------------------------------------------------------
+uniform samplerBuffer u_cacheBuffer;  // cached value, checksum (zero for an empty entry)
+uniform int u_cacheTableSize;
+uniform float u_cacheCellSize;
+uniform int u_cacheDepth;
+uniform int u_cacheEnabled;
+
+const int CACHE_MAX_PROBES = 8;
+
+// Diffuse vertex recorded for updating the cache, chosen uniformly by reservoir sampling
+Vec3 cacheRecPos;
+int cacheRecBucket;
+Vec3 cacheRecL;
+Vec3 cacheRecBeta;
+Vec3 cacheRecAlbedo;
+int cacheRecCount;
+int cacheRecBranch;
+bool cacheRecClosed;
+Vec3 cacheRecEnd;
+
+int cacheNormalBucket(in Vec3 n) {
+    // Dominant axis and its sign
+    Vec3 a = abs(n);
+    int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    return axis * 2 + (n[axis] < 0.0 ? 1 : 0);
+}
+
+bool cacheLookup(in Vec3 x, in Vec3 n, out Vec3 value) {
+    ivec3 cell = ivec3(floor(x / Float(u_cacheCellSize)));
+    uint h = hashUint(uint(cell.x));
+    h = hashCombine(h, uint(cell.y));
+    h = hashCombine(h, uint(cell.z));
+    h = hashCombine(h, uint(cacheNormalBucket(n)));
+    float checksum = float((hashUint(h + 0x9e3779b9u) & 0xffffffu) + 1u);
+
+    int mask = u_cacheTableSize - 1;
+    for (int k = 0; k < CACHE_MAX_PROBES; k++) {
+        vec4 entry = texelFetch(u_cacheBuffer, (int(h & uint(mask)) + k) & mask);
+        if (entry.w == checksum) {
+            value = entry.xyz;
+            return true;
+        }
+        if (entry.w == 0.0) {
+            break;
         }
     }
-    return Vec3(0.0);
+
+    value = Vec3(0.0);
+    return false;
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// Adjoint-driven Russian roulette and splitting (ADRRS)
+// ----------------------------------------------------------------------------
+
+// Upper bound of path branches traced for one camera ray
+const int MAX_BRANCHES = 16;
+
+// Weight window [2 / (1 + s), 2s / (1 + s)] with s = 5
+const Float ADRRS_WINDOW_MIN = 1.0 / 3.0;
+const Float ADRRS_WINDOW_MAX = 5.0 / 3.0;
+
+uniform int u_maxSplit = 4;
+
+// Pixel radiance estimated from the previous frames (zero if it is not available)
+Float adjointPixel;
+
+// Luminance of the radiance reflected at "x". The radiance cache is used if it covers "x",
+// and otherwise all the vertices are assumed to reflect as much as the primary vertex
+Float reflectedEstimate(in Vec3 x, in Intersection isect, int type) {
+    #if ENABLE_RADIANCE_CACHE
+    Vec3 cached;
+    if (type == MTRL_DIFFUSE && cacheLookup(x, isect.norm, cached)) {
+        Vec3 albedo = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz;
+        return luminance(albedo * cached);
+    }
+    #endif
+    return adjointPixel;
 }
 
 // ----------------------------------------------------------------------------
@@ -413,151 +1842,376 @@ Vec3 radiance(in Ray r){
     bool passedVolume = false;
     bool specularReflect = false;
 
-    for (int depth = 0; depth < u_maxDepth; depth++) {
-        Intersection isect;
-        bool isIntersect = intersect(ray, isect);
+    // Previous surface vertex for MIS with emitters hit by BSDF sampling
+    Vec3 prevX = Vec3(0.0);
+    Intersection prevIsect;
+    Float prevPdf = 0.0;
+    bool prevRestir = false;
+    // Distance from the previous vertex to the origin of the current ray (non-zero after crossing media)
+    Float prevOffset = 0.0;
+
+    // A split vertex is revisited for each pending branch (one vertex at a time)
+    int startDepth = 0;
+    bool resume = false;
+    int branches = 1;
+    int splitRemaining = 0;
+    Ray splitRay;
+    Intersection splitIsect;
+    Vec3 splitBeta;
+    int splitDepth = 0;
+
+    for (int branch = 0; branch < MAX_BRANCHES; branch++) {
+        for (int depth = startDepth; depth < u_maxDepth; depth++) {
+            Intersection isect;
+            bool isIntersect = true;
+            if (resume) {
+                isect = splitIsect;
+            } else {
+                isIntersect = intersect(ray, isect);
+            }
+            bool rouletteDone = resume;
 
-        Vec3 x = ray.o + (isect.tHit + EPS) * ray.d;
-        int type = int(texelFetch(u_matBuffer, isect.mtrl * 6 + 0).x);
-        Vec3 e = texelFetch(u_matBuffer, isect.mtrl * 6 + 1).xyz;
+            Vec3 x = ray.o + (isect.tHit + EPS) * ray.d;
+            int type = int(texelFetch(u_matBuffer, isect.mtrl * 6 + 0).x);
+            Vec3 e = texelFetch(u_matBuffer, isect.mtrl * 6 + 1).xyz;
 
-        if (type == MTRL_MEDIA && dot(-ray.d, isect.norm) >= EPS) {
             #if ENABLE_VOLUME
-            // Volume (perform Woodcock tracking)
-            Vec3 sigS = Vec3(1.0, 1.0, 1.0) * 0.1;
-            Vec3 sigA = Vec3(0.1, 0.1, 0.1) * 0.6;
-            Float sigT = sigS.x + sigA.x;
-
-            int nTrial = 8;
-            Vec3 nextOrg = x;
-            Vec3 nextDir = ray.d;
-            for (int k = 0; k < nTrial; k++) {
-                Ray nextRay = spawnRay(nextOrg, vec3(0.0), nextDir);
-                Intersection inext;
-                bool hit = intersect(nextRay, inext);
-                if (!hit) {
-                    return Vec3(1, 0, 1);
-                }
+            if (type == MTRL_MEDIA && dot(-ray.d, isect.norm) >= EPS) {
+                // Volume (perform delta tracking)
+                Vec3 sigS = Vec3(MEDIUM_SIGMA_S);
+                Vec3 sigA = Vec3(MEDIUM_SIGMA_A);
+                Float sigT = sigS.x + sigA.x;
+
+                int volID = int(texelFetch(u_matBuffer, isect.mtrl * 6 + 5).x);
+                VolumeInfo vol = fetchVolume(volID);
+                bool enteredUnweighted = depth == 0 || specularReflect || passedVolume;
+                bool scattered = false;
+                int nTrial = 8;
+                Vec3 nextOrg = x;
+                Vec3 nextDir = ray.d;
+                for (int k = 0; k < nTrial; k++) {
+                    Ray nextRay = spawnRay(nextOrg, vec3(0.0), nextDir);
+                    Intersection inext;
+                    bool hit = intersect(nextRay, inext);
+                    if (!hit) {
+                        return Vec3(1, 0, 1);
+                    }
 
-                Float t = 0.0;
-                bool pass = false;
-                for (int i = 0; i < 256; i++) {
-                    t -= log(max(EPS, 1.0 - rand())) / (u_densityMax * sigT);
-                    if (t >= inext.tHit) {
-                        pass = true;
-                        break;
+                    Float t;
+                    int status = deltaTracking(nextRay, inext.tHit, sigT, vol, t);
+                    if (status == TRACKING_ABORT) {
+                        return Vec3(0.0, 0.0, 0.0);
                     }
 
-                    Vec3 pos = nextOrg + t * nextDir;
-                    Float density = densityLookup(pos);
-                    if (density / u_densityMax > rand()) {
-                        pass = true;
+                    if (status == TRACKING_ESCAPE) {
+                        nextOrg = nextOrg + (inext.tHit + EPS) * nextDir;
                         break;
                     }
-                }
 
-                if (!pass) {
-                    return Vec3(0.0, 0.0, 0.0);
+                    nextOrg = nextOrg + t * nextDir;
+
+                    // Black body radiation
+                    L += beta * emissionLookup(vol, nextOrg) / sigT;
+
+                    // Sample path direction
+                    Float theta = acos(2.0 * rand() - 1.0);
+                    Float phi = 2.0 * PI * rand();
+                    Float cosTheta = cos(theta);
+                    Float sinTheta = sin(theta);
+                    nextDir = Vec3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+
+                    // Scattering albedo
+                    beta *= sigS / sigT;
+
+                    #if ENABLE_MEDIUM_NEE
+                    // Direct lighting at the collision, weighted against the phase function sampling above
+                    Intersection misect = isect;
+                    misect.norm = Vec3(0.0);
+                    L += beta * sampleDirectMedium(nextOrg, misect, volID);
+
+                    prevX = nextOrg;
+                    prevIsect = misect;
+                    prevPdf = ISOTROPIC_PHASE;
+                    prevRestir = false;
+                    scattered = true;
+                    #endif
                 }
 
-                if (t >= inext.tHit) {
-                    nextOrg = nextOrg + (inext.tHit + EPS) * nextDir;
+                ray = spawnRay(nextOrg, vec3(0.0), nextDir);
+                #if ENABLE_MEDIUM_NEE
+                // Emitters behind the medium are weighted against the light sampling at the last vertex
+                passedVolume = scattered ? false : enteredUnweighted;
+                specularReflect = scattered ? false : specularReflect;
+                prevOffset = length(nextOrg - prevX);
+                #else
+                passedVolume = true;
+                #endif
+            } else
+            #endif
+            {
+                // Surface
+                bool unweighted = depth == 0 || specularReflect || passedVolume;
+                passedVolume = false;
+
+                if (!isIntersect) {
+                    #if ENABLE_ENVMAP
+                    // Environment map, weighted against light sampling
+                    Vec3 Le = envmapLookup(ray.d);
+                    if (unweighted) {
+                        L += beta * Le;
+                    } else if (!prevRestir) {
+                        L += beta * Le * powerHeuristic(prevPdf, u_envSelectPmf * envmapPdf(ray.d));
+                    }
+                    #endif
                     break;
                 }
 
-                nextOrg = nextOrg + t * nextDir;
+                // Emission, cache and direct lighting at a split vertex are added by its first branch
+                if (unweighted && !resume) {
+                    L += beta * e;
+                } else if (!isBlack(e) && !prevRestir && !resume) {
+                    // Emitter hit by BSDF sampling, weighted against light sampling
+                    int lightID = int(texelFetch(u_triLightBuffer, isect.triID).x);
+                    Float cosLight = dot(-ray.d, isect.norm);
+                    if (lightID >= 0 && cosLight > 0.0) {
+                        Float lightPdf = (1.0 - envSelectPmf()) * lightSelectPmf(lightID, prevX, prevIsect) *
+                                         lightDirectionPdf(lightTriangle(lightID), prevX, isect.tHit + prevOffset,
+                                                           cosLight);
+                        L += beta * e * powerHeuristic(prevPdf, lightPdf);
+                    }
+                }
 
-                // Black body radiation
-                Float T = temperatureLookup(nextOrg) * 1.0e2;
-                L += beta * blackBody(T) / sigT;
+                #if ENABLE_RADIANCE_CACHE
+                if (type == MTRL_DIFFUSE && !resume) {
+                    Vec3 albedo = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz;
 
-                // Sample path direction
-                Float theta = acos(2.0 * rand() - 1.0);
-                Float phi = 2.0 * PI * rand();
-                Float cosTheta = cos(theta);
-                Float sinTheta = sin(theta);
-                nextDir = Vec3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+                    // Terminate into the cache (biased preview only)
+                    Vec3 cached;
+                    if (u_cacheEnabled != 0 && depth >= u_cacheDepth && cacheLookup(x, isect.norm, cached)) {
+                        L += beta * albedo * cached;
+                        break;
+                    }
 
-                // Scattering albedo
-                beta *= sigS / sigT;
-            }
+                    // Record this vertex to update the cache
+                    cacheRecCount += 1;
+                    if (rand() * Float(cacheRecCount) < 1.0) {
+                        cacheRecPos = x;
+                        cacheRecBucket = cacheNormalBucket(isect.norm);
+                        cacheRecL = L;
+                        cacheRecBeta = beta;
+                        cacheRecAlbedo = albedo;
+                        cacheRecBranch = splitRemaining > 0 ? branch : -1;
+                        cacheRecClosed = false;
+                    }
+                }
+                #endif
+
+                // Sample BRDF
+                Vec3 w = isect.norm;
+                Vec3 u = cross(abs(w.x) > 0.1 ? Vec3(0.0, 1.0, 0.0) : Vec3(1.0, 0.0, 0.0), w);
+                Vec3 v = cross(w, u);
+                Vec3 wo = -ray.d;
+                Vec3 woLocal = Vec3(dot(u, wo), dot(v, wo), dot(w, wo));
+
+                Vec3 f = Vec3(0.0);
+                Float pdf = 1.0f;
+                Vec3 wiLocal = Vec3(0.0, 0.0, 1.0);
+                #if ENABLE_DIFFUSE
+                if (type == MTRL_DIFFUSE) {
+                    Float r1 = 2.0 * PI * rand();
+                    Float r2 = rand();
+                    Float r2s = sqrt(r2);
+
+                    wiLocal = Vec3(cos(float(r1)) * r2s, sin(float(r1)) * r2s, sqrt(1.0 - r2));
+                    f = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz / PI;
+                    pdf = wiLocal.z / PI;
+                    specularReflect = false;
+                }
+                #endif
+                #if ENABLE_CONDUCTOR
+                if (type == MTRL_CONDUCTOR) {
+                    Vec3 kappa = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz;
+                    Vec3 eta = texelFetch(u_matBuffer, isect.mtrl * 6 + 3).xyz;
+                    Vec2 alpha = texelFetch(u_matBuffer, isect.mtrl * 6 + 4).xy;
+                    Vec2 u2 = Vec2(rand(), rand());
+                    Vec3 whLocal = sampleGGXVNDF(woLocal, alpha, u2);
+
+                    wiLocal = 2.0 * dot(whLocal, woLocal) * whLocal - woLocal;
+                    Vec3 F = fresnelConductor(wiLocal.z, eta, kappa);
+                    f = F * microfacetGGXBRDF(wiLocal, woLocal, alpha);
+                    pdf = weightedGGXPDF(wiLocal, woLocal, whLocal, alpha);
+                    specularReflect = false;
+                }
+                #endif
 
-            ray = spawnRay(nextOrg, vec3(0.0), nextDir);
-            passedVolume = true;
-            #endif
-        } else {
-            // Surface
-            if (depth == 0 || specularReflect || passedVolume) {
-                if (isIntersect) {
-                    L += beta * e;
+                if (isBlack(f) || pdf == 0.0) {
+                    break;
                 }
-            }
-            passedVolume = false;
 
-            if (!isIntersect) {
-                break;
-            }
+                // Direct lighting (ReSTIR covers all the lights at the primary vertex)
+                #if DIRECT_LIGHTING == DIRECT_LIGHTING_RESTIR
+                prevRestir = depth == 0;
+                if (prevRestir && !resume) {
+                    L += beta * restirDirect(x, isect);
+                } else
+                #endif
+                if (!resume) {
+                    L += beta * sampleDirect(x, isect);
+                }
 
-            // Sample BRDF
-            Vec3 w = isect.norm;
-            Vec3 u = cross(abs(w.x) > 0.1 ? Vec3(0.0, 1.0, 0.0) : Vec3(1.0, 0.0, 0.0), w);
-            Vec3 v = cross(w, u);
-            Vec3 wo = -ray.d;
-            Vec3 woLocal = Vec3(dot(u, wo), dot(v, wo), dot(w, wo));
-
-            Vec3 f = Vec3(0.0);
-            Float pdf = 1.0f;
-            Vec3 wiLocal = Vec3(0.0, 0.0, 1.0);
-            if (type == MTRL_DIFFUSE) {
-                Float r1 = 2.0 * PI * rand();
-                Float r2 = rand();
-                Float r2s = sqrt(r2);
-
-                wiLocal = Vec3(cos(float(r1)) * r2s, sin(float(r1)) * r2s, sqrt(1.0 - r2));
-                f = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz / PI;
-                pdf = wiLocal.z / PI;
-                specularReflect = false;
-            } else if (type == MTRL_CONDUCTOR) {
-                Vec3 kappa = texelFetch(u_matBuffer, isect.mtrl * 6 + 2).xyz;
-                Vec3 eta = texelFetch(u_matBuffer, isect.mtrl * 6 + 3).xyz;
-                Vec2 alpha = texelFetch(u_matBuffer, isect.mtrl * 6 + 4).xy;
-                Vec2 u2 = Vec2(rand(), rand());
-                Vec3 whLocal = sampleGGXVNDF(woLocal, alpha, u2);
-
-                wiLocal = 2.0 * dot(whLocal, woLocal) * whLocal - woLocal;
-                Vec3 F = fresnelConductor(wiLocal.z, eta, kappa);
-                f = F * microfacetGGXBRDF(wiLocal, woLocal, alpha);
-                pdf = weightedGGXPDF(wiLocal, woLocal, whLocal, alpha);
-                specularReflect = false;
-            }
+                #if ENABLE_GUIDING
+                // Mix guided and BSDF sampling (one-sample MIS with the balance heuristic)
+                bool guidable = type == MTRL_DIFFUSE || type == MTRL_CONDUCTOR;
+                int guideRoot = guideLeaf(x);
+                if (guidable && guideTotal(guideRoot) > 0.0) {
+                    Float frac = u_guideFraction;
+                    if (rand() < frac) {
+                        Float guidePdfValue;
+                        Vec3 wiGuide = sampleGuide(guideRoot, Vec2(rand(), rand()), guidePdfValue);
+                        Float bsdfPdf;
+                        f = evalBSDF(isect, wiGuide, bsdfPdf);
+                        wiLocal = Vec3(dot(u, wiGuide), dot(v, wiGuide), dot(w, wiGuide));
+                        pdf = frac * guidePdfValue + (1.0 - frac) * bsdfPdf;
+                    } else {
+                        Vec3 wiBsdf = u * wiLocal.x + v * wiLocal.y + w * wiLocal.z;
+                        pdf = frac * guidePdf(guideRoot, wiBsdf) + (1.0 - frac) * pdf;
+                    }
 
-            if (isBlack(f) || pdf == 0.0) {
-                break;
-            }
+                    if (isBlack(f) || pdf == 0.0 || wiLocal.z <= 0.0) {
+                        break;
+                    }
+                }
+                #endif
+
+                #if RUSSIAN_ROULETTE == RUSSIAN_ROULETTE_ADRRS
+                // Adjoint-driven Russian roulette and splitting into the weight window around the pixel estimate
+                if (!resume && depth > 0 && adjointPixel > 0.0) {
+                    Float ratio = luminance(beta) * reflectedEstimate(x, isect, type) / adjointPixel;
+                    if (ratio < ADRRS_WINDOW_MIN) {
+                        if (rand() >= ratio) {
+                            break;
+                        }
+                        beta /= ratio;
+                    } else if (ratio > ADRRS_WINDOW_MAX && splitRemaining == 0) {
+                        int n = min(int(ratio), min(u_maxSplit, MAX_BRANCHES - branches + 1));
+                        if (n > 1) {
+                            beta /= Float(n);
+                            splitRemaining = n - 1;
+                            branches += n - 1;
+                            splitRay = ray;
+                            splitIsect = isect;
+                            splitBeta = beta;
+                            splitDepth = depth;
+                        }
+                    }
+                    rouletteDone = true;
+                }
+                #endif
+                resume = false;
+
+                prevX = x;
+                prevIsect = isect;
+                prevPdf = pdf;
+                prevOffset = 0.0;
+
+                // Update ray and beta
+                Vec3 wi = u * wiLocal.x + v * wiLocal.y + w * wiLocal.z;
+                ray = spawnRay(x, isect.norm, wi);
+                beta *= f * max(0.0, dot(isect.norm, wi)) / pdf;
+
+                #if ENABLE_GUIDING
+                if (guidable) {
+                    guideRecCount += 1;
+                    if (rand() * Float(guideRecCount) < 1.0) {
+                        guideRecPos = x;
+                        guideRecDir = wi;
+                        guideRecPdf = pdf;
+                        guideRecL = L;
+                        guideRecBeta = beta;
+                        guideRecBranch = splitRemaining > 0 ? branch : -1;
+                        guideRecClosed = false;
+                    }
+                }
+                #endif
 
-            // Direct lighting
-            L += beta * sampleDirect(x, isect);
+            }
 
-            // Update ray and beta
-            Vec3 wi = u * wiLocal.x + v * wiLocal.y + w * wiLocal.z;
-            ray = spawnRay(x, isect.norm, wi);
-            beta *= f * max(0.0, dot(isect.norm, wi)) / pdf;
+            // Russian roulette
+            if (depth > 2 && !rouletteDone) {
+                Float p = min(0.95, max(beta.x, max(beta.y, beta.z)));
+                if (rand() > p) {
+                    break;
+                }
+                beta /= p;
+            }
+        }
 
+        // Sibling branches are not part of the radiance at a vertex recorded after their split
+        #if ENABLE_GUIDING
+        if (guideRecCount > 0 && guideRecBranch == branch && !guideRecClosed) {
+            guideRecEnd = L;
+            guideRecClosed = true;
         }
+        #endif
+        #if ENABLE_RADIANCE_CACHE
+        if (cacheRecCount > 0 && cacheRecBranch == branch && !cacheRecClosed) {
+            cacheRecEnd = L;
+            cacheRecClosed = true;
+        }
+        #endif
 
-        // Russian roulette
-        if (depth > 2) {
-            Float p = min(0.95, max(beta.x, max(beta.y, beta.z)));
-            if (rand() > p) {
-                break;
-            }
-            beta /= p;
+        if (splitRemaining == 0) {
+            break;
         }
+
+        // Restart from the split vertex
+        splitRemaining -= 1;
+        ray = splitRay;
+        beta = splitBeta;
+        startDepth = splitDepth;
+        passedVolume = false;
+        resume = true;
     }
 
     return min(L, 1.0e2);
 }
 
+// ----------------------------------------------------------------------------
+// Adaptive sampling
+// ----------------------------------------------------------------------------
+
+// Relative standard error of the pixel mean from the first and second moments of luminance
+Float relativeError(in Vec3 sum, in Float sum2, in Float count) {
+    if (count < 2.0) {
+        return INFTY;
+    }
+
+    Float mean = luminance(sum) / count;
+    Float var = max(sum2 / count - mean * mean, 0.0) * count / (count - 1.0);
+    return sqrt(var / count) / (mean + 1.0e-2);
+}
+
+// Number of samples in this frame, proportional to the relative error
+int adaptiveSamples(in Vec3 sum, in Float sum2, in Float count) {
+    if (u_adaptive == 0 || count < Float(u_adaptiveMinSamples)) {
+        return u_nSamples;
+    }
+
+    Float error = relativeError(sum, sum2, count);
+    if (error < u_adaptiveThreshold) {
+        return 0;
+    }
+
+    if (u_meanError <= 0.0) {
+        return u_nSamples;
+    }
+
+    // Stochastic rounding keeps the expected number of samples per frame
+    Float n = min(Float(u_nSamples) * error / u_meanError, Float(4 * u_nSamples));
+    Float u = Float(hashCombine(pixelSeed, uint(count))) / 4294967296.0;
+    return int(n) + (u < fract(n) ? 1 : 0);
+}
+
 // ----------------------------------------------------------------------------
 // Main
 // ----------------------------------------------------------------------------
@@ -565,14 +2219,38 @@ Vec3 radiance(in Ray r){
 void main(void) {
     // Initialize random number state
     randState = gl_FragCoord.xy / u_windowSize;
+    pixelSeed = hashCombine(hashUint(uint(gl_FragCoord.x)), uint(gl_FragCoord.y));
 
     // Framebuffer settings
     Vec2 uv = gl_FragCoord.xy / u_windowSize;
     Vec3 L = texture(u_framebuffer, vec2(uv)).rgb;
-    Float count = texture(u_counter, vec2(uv)).x;
+    Vec3 moments = texture(u_counter, vec2(uv)).xyz;
+    Float count = moments.x;
+    Float sum2 = moments.y;
+    Float steps = moments.z;
+    int nSamples = adaptiveSamples(L, sum2, count);
+    adjointPixel = count > 0.0 ? luminance(L) / count : 0.0;
+
+    #if DIRECT_LIGHTING == DIRECT_LIGHTING_RESTIR
+    restirOut = Reservoir(Vec3(0.0), 0.0, 0.0, 0.0);
+    restirPos = Vec4(0.0, 0.0, 0.0, -1.0);
+    restirNorm = Vec3(0.0);
+    #endif
+
+    // Records are left empty for pixels without any samples in this frame
+    #if ENABLE_GUIDING
+    out_guideRecord0 = vec4(0.0);
+    out_guideRecord1 = vec4(0.0);
+    #endif
+    #if ENABLE_RADIANCE_CACHE
+    out_cacheRecord0 = vec4(0.0);
+    out_cacheRecord1 = vec4(0.0);
+    #endif
 
     // Main loop
-    for (int i = 0; i < u_nSamples; i++) {
+    for (int i = 0; i < nSamples; i++) {
+        startSample(uint(count));
+
         // Camera space
         Vec2 pRand = Vec2(rand(), rand());
         Vec3 pScreen = Vec3(0.0);
@@ -586,6 +2264,7 @@ void main(void) {
         Vec3 dir = normalize(pCamera);
 
         // Sample on disk
+        #if ENABLE_THIN_LENS
         if (u_apertureRadius > 0.0) {
             Float r = sqrt(rand()) * u_apertureRadius;
             Float theta = rand() * 2.0 * PI;
@@ -596,6 +2275,7 @@ void main(void) {
             org = Vec3(pLens, 0.0);
             dir = normalize(pFocus - org);
         }
+        #endif
 
         // World space
         temp = u_c2wMat * Vec4(org, 1.0);
@@ -605,10 +2285,47 @@ void main(void) {
 
         // Ray tracing
         Ray ray = Ray(orgWorld, normalize(dirWorld));
-        L += radiance(ray);
+        #if ENABLE_GUIDING
+        guideRecCount = 0;
+        #endif
+        #if ENABLE_RADIANCE_CACHE
+        cacheRecCount = 0;
+        #endif
+        trackingSteps = 0;
+        Vec3 Lpath = radiance(ray);
+        L += Lpath;
+        sum2 += luminance(Lpath) * luminance(Lpath);
         count += 1.0;
+        steps += Float(trackingSteps);
+
+        #if ENABLE_GUIDING
+        // Incident radiance at the recorded vertex
+        if (guideRecCount > 0 && guideRecPdf > 0.0) {
+            Vec3 Lend = guideRecClosed ? guideRecEnd : Lpath;
+            Vec3 Li = max(Lend - guideRecL, Vec3(0.0)) / max(guideRecBeta, Vec3(1.0e-8));
+            Float weight = luminance(Li) / guideRecPdf;
+            out_guideRecord0 = vec4(guideRecPos, weight);
+            out_guideRecord1 = vec4(guideRecDir, 1.0);
+        }
+        #endif
+
+        #if ENABLE_RADIANCE_CACHE
+        // Reflected radiance at the recorded vertex divided by its albedo
+        if (cacheRecCount > 0) {
+            Vec3 denom = max(cacheRecBeta * cacheRecAlbedo, Vec3(1.0e-8));
+            Vec3 Lend = cacheRecClosed ? cacheRecEnd : Lpath;
+            Vec3 value = max(Lend - cacheRecL, Vec3(0.0)) / denom;
+            out_cacheRecord0 = vec4(cacheRecPos, Float(cacheRecBucket + 1));
+            out_cacheRecord1 = vec4(value, 1.0);
+        }
+        #endif
     }
 
     out_color = vec4(L, 1.0);
-    out_count = vec4(count, count, count, 1.0);
+    out_count = vec4(count, sum2, steps, 1.0);
+    #if DIRECT_LIGHTING == DIRECT_LIGHTING_RESTIR
+    out_reservoir = vec4(restirOut.y, restirOut.W);
+    out_gbufPos = vec4(restirPos);
+    out_gbufNorm = vec4(restirNorm, restirOut.M);
+    #endif
 }
@@ -0,0 +1,64 @@
+#include <iostream>
+#include <algorithm>
+#include <experimental/filesystem>
+
+#include "core/argparse.h"
+#include "core/common.h"
+#include "core/timer.h"
+#include "core/trimesh.h"
+using namespace glrt;
+
+namespace fs = std::experimental::filesystem;
+
+// Best time of a few loads (the first one also warms up the page cache)
+double benchmark(const std::string &filename, OBJParser parser, float weldTolerance, int trials, Trimesh *mesh) {
+    double best = 1.0e20;
+    for (int t = 0; t < trials; t++) {
+        Timer timer;
+        timer.start();
+        mesh->load(filename, parser, weldTolerance);
+        best = std::min(best, timer.count());
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    ArgumentParser &parser = ArgumentParser::getInstance();
+    parser.addArgument("-i", "--input", "", true, "Input mesh (*.obj)");
+    parser.addArgument("-n", "--trials", "3", false, "Number of loads for each parser");
+    parser.addArgument("-w", "--weld-tolerance", "0", false, "Tolerance of vertex welding (negative to disable)");
+    if (!parser.parse(argc, argv)) {
+        std::cout << parser.helpText() << std::endl;
+        return 1;
+    }
+
+    const std::string filename = parser.getString("input");
+    const int trials = std::max(parser.getInt("trials"), 1);
+    const float weldTolerance = (float)parser.getDouble("weld-tolerance");
+    const double megaBytes = fs::file_size(fs::path(filename.c_str())) / (1024.0 * 1024.0);
+    Info("Input: %s (%.1f MB, %d threads)", filename.c_str(), megaBytes, omp_get_max_threads());
+
+    Trimesh reference, mesh;
+    const double tinyTime = benchmark(filename, OBJParser::TinyObj, weldTolerance, trials, &reference);
+    Info("tinyobjloader: %.3f sec (%.1f MB/s)", tinyTime, megaBytes / tinyTime);
+    const double nativeTime = benchmark(filename, OBJParser::Native, weldTolerance, trials, &mesh);
+    Info("native: %.3f sec (%.1f MB/s), speedup = %.2fx", nativeTime, megaBytes / nativeTime, tinyTime / nativeTime);
+
+    // Both parsers should give the same vertices
+    if (mesh.vertices.size() != reference.vertices.size() || mesh.indices.size() != reference.indices.size()) {
+        FatalError("Mesh mismatch: %d / %d vertices, %d / %d indices", (int)mesh.vertices.size(),
+                   (int)reference.vertices.size(), (int)mesh.indices.size(), (int)reference.indices.size());
+    }
+
+    float maxError = 0.0f;
+    for (size_t i = 0; i < mesh.vertices.size(); i++) {
+        const glm::vec3 d = glm::abs(mesh.vertices[i].pos - reference.vertices[i].pos);
+        maxError = std::max(maxError, std::max(d.x, std::max(d.y, d.z)));
+    }
+    Info("#vertex: %d, #triangle: %d, max position error: %g", (int)mesh.vertices.size(),
+         (int)mesh.indices.size() / 3, maxError);
+    Info("Welding: %d -> %d vertices (%.1f MB -> %.1f MB), %.3f sec", (int)mesh.unweldedVertices,
+         (int)mesh.vertices.size(), mesh.unweldedVertices * sizeof(Vertex) / (1024.0 * 1024.0),
+         mesh.vertices.size() * sizeof(Vertex) / (1024.0 * 1024.0), mesh.weldTime);
+}
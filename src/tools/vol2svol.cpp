@@ -0,0 +1,31 @@
+#include <iostream>
+#include <stdexcept>
+
+#include "core/argparse.h"
+#include "core/common.h"
+#include "core/sparse_volume.h"
+using namespace glrt;
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    ArgumentParser &parser = ArgumentParser::getInstance();
+    parser.addArgument("-i", "--input", "", true, "Input dense volume (*.vol)");
+    parser.addArgument("-o", "--output", "", true, "Output sparse volume (*.svol)");
+    parser.addArgument("-b", "--brick-size", "8", false, "Number of voxels along each side of a brick");
+    parser.addArgument("-t", "--threshold", "0", false, "Bricks with all the voxels below this value are dropped");
+    if (!parser.parse(argc, argv)) {
+        std::cout << parser.helpText() << std::endl;
+        return 1;
+    }
+
+    // Convert slice by slice so that only the occupied bricks are kept in memory
+    try {
+        SparseVolume volume;
+        volume.convert(parser.getString("input"), parser.getInt("brick-size"), (float)parser.getDouble("threshold"));
+        volume.save(parser.getString("output"));
+    } catch (const std::runtime_error &e) {
+        FatalError("%s", e.what());
+    }
+
+    Info("Save: %s", parser.getString("output").c_str());
+}